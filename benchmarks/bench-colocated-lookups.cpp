@@ -0,0 +1,256 @@
+/*
+ * Benchmark for the lookups in the second pass of osp-find-colocated-nodes.
+ *
+ * Reads all nodes and ways from an OSM file and finds the colocated
+ * locations like osp-find-colocated-nodes does. Then looks up the location
+ * of every node in them, once with std::equal_range on the sorted
+ * locations (the code osp-find-colocated-nodes used before), once with a
+ * Bloom filter in front of std::equal_range, and once with the LocationSet
+ * hash table. Then looks up the node references of every way in the ids of
+ * the colocated nodes, once with a binary search in an IdSetSmall and once
+ * in an IdSetDense.
+ */
+
+#include "location-set.hpp"
+
+#include <osmium/index/id_set.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/way.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using id_type = osmium::unsigned_object_id_type;
+
+/**
+ * A Bloom filter with 16 bits per location and 4 hash functions derived
+ * from one 64 bit hash. Locations found in it are checked with
+ * std::equal_range.
+ */
+class BloomFilter
+{
+
+    constexpr static unsigned int const num_hashes = 4;
+
+    std::vector<uint64_t> m_bits;
+    unsigned int m_shift = 63;
+
+    template <typename TFunc>
+    void for_each_bit(uint64_t value, TFunc &&func) const
+    {
+        auto const hash = hash_location(value);
+        auto const step = (hash_location(hash) >> m_shift) | 1U;
+        auto const mask = (m_bits.size() * 64) - 1;
+        auto bit = hash >> m_shift;
+        for (unsigned int i = 0; i < num_hashes; ++i) {
+            func(bit);
+            bit = (bit + step) & mask;
+        }
+    }
+
+public:
+    explicit BloomFilter(std::vector<osmium::Location> const &locations)
+    {
+        unsigned int bits = 6;
+        while ((std::size_t{1} << bits) < locations.size() * 16) {
+            ++bits;
+        }
+        m_shift = 64U - bits;
+        m_bits.resize((std::size_t{1} << bits) / 64);
+
+        for (auto const &location : locations) {
+            for_each_bit(pack_location(location), [&](uint64_t bit) {
+                m_bits[bit >> 6U] |= uint64_t{1} << (bit & 0x3fU);
+            });
+        }
+    }
+
+    [[nodiscard]] bool may_contain(osmium::Location location) const noexcept
+    {
+        bool found = true;
+        for_each_bit(pack_location(location), [&](uint64_t bit) {
+            found = found &&
+                    (m_bits[bit >> 6U] & (uint64_t{1} << (bit & 0x3fU))) != 0;
+        });
+        return found;
+    }
+
+}; // class BloomFilter
+
+struct input_data
+{
+    std::vector<osmium::Location> node_locations;
+    std::vector<id_type> node_ids;
+    std::vector<id_type> way_node_refs;
+};
+
+template <typename TFunc>
+double run(TFunc &&func, int count, uint64_t &result)
+{
+    auto const start = std::chrono::steady_clock::now();
+    for (int n = 0; n < count; ++n) {
+        result = std::forward<TFunc>(func)();
+    }
+    auto const end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count() / count;
+}
+
+void print(char const *name, double time, std::size_t num_lookups)
+{
+    std::cout << name << time << "s ("
+              << time * 1e9 / static_cast<double>(num_lookups)
+              << " ns/lookup)\n";
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+try {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " OSM-FILE [COUNT]\n";
+        return 2;
+    }
+
+    int const count = argc == 3 ? std::atoi(argv[2]) : 3;
+
+    input_data data;
+
+    osmium::io::Reader reader{argv[1], osmium::osm_entity_bits::node |
+                                           osmium::osm_entity_bits::way};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        for (auto const &node : buffer.select<osmium::Node>()) {
+            data.node_locations.push_back(node.location());
+            data.node_ids.push_back(node.positive_id());
+        }
+        for (auto const &way : buffer.select<osmium::Way>()) {
+            for (auto const &nr : way.nodes()) {
+                data.way_node_refs.push_back(nr.positive_ref());
+            }
+        }
+    }
+    reader.close();
+
+    std::vector<uint64_t> packed;
+    packed.reserve(data.node_locations.size());
+    for (auto const &location : data.node_locations) {
+        packed.push_back(pack_location(location));
+    }
+    std::sort(packed.begin(), packed.end());
+
+    std::vector<osmium::Location> locations;
+    auto it = packed.cbegin();
+    while ((it = std::adjacent_find(it, packed.cend())) != packed.cend()) {
+        locations.push_back(unpack_location(*it));
+        it = std::upper_bound(it, packed.cend(), *it);
+    }
+
+    std::cout << "Read " << data.node_locations.size() << " nodes and "
+              << data.way_node_refs.size() << " way node references, found "
+              << locations.size() << " colocated locations.\n";
+
+    auto const in_locations = [&](osmium::Location location) {
+        auto const r =
+            std::equal_range(locations.cbegin(), locations.cend(), location);
+        return r.first != r.second;
+    };
+
+    uint64_t r_range = 0;
+    double const t_range = run(
+        [&]() {
+            uint64_t found = 0;
+            for (auto const &location : data.node_locations) {
+                found += in_locations(location) ? 1 : 0;
+            }
+            return found;
+        },
+        count, r_range);
+
+    BloomFilter const bloom{locations};
+    uint64_t r_bloom = 0;
+    double const t_bloom = run(
+        [&]() {
+            uint64_t found = 0;
+            for (auto const &location : data.node_locations) {
+                found += (bloom.may_contain(location) &&
+                          in_locations(location))
+                             ? 1
+                             : 0;
+            }
+            return found;
+        },
+        count, r_bloom);
+
+    LocationSet const location_set{locations};
+    uint64_t r_hash = 0;
+    double const t_hash = run(
+        [&]() {
+            uint64_t found = 0;
+            for (auto const &location : data.node_locations) {
+                found += location_set.contains(location) ? 1 : 0;
+            }
+            return found;
+        },
+        count, r_hash);
+
+    auto const num_nodes = data.node_locations.size();
+    print("equal_range: ", t_range, num_nodes);
+    print("bloom:       ", t_bloom, num_nodes);
+    print("hash set:    ", t_hash, num_nodes);
+    std::cout << "nodes at colocated locations: " << r_hash << '\n';
+
+    osmium::index::IdSetSmall<id_type> ids_small;
+    osmium::index::IdSetDense<id_type> ids_dense;
+    for (std::size_t n = 0; n < num_nodes; ++n) {
+        if (location_set.contains(data.node_locations[n])) {
+            ids_small.set(data.node_ids[n]);
+            ids_dense.set(data.node_ids[n]);
+        }
+    }
+    ids_small.sort_unique();
+
+    uint64_t r_small = 0;
+    double const t_small = run(
+        [&]() {
+            uint64_t found = 0;
+            for (auto const id : data.way_node_refs) {
+                found += ids_small.get_binary_search(id) ? 1 : 0;
+            }
+            return found;
+        },
+        count, r_small);
+
+    uint64_t r_dense = 0;
+    double const t_dense = run(
+        [&]() {
+            uint64_t found = 0;
+            for (auto const id : data.way_node_refs) {
+                found += ids_dense.get(id) ? 1 : 0;
+            }
+            return found;
+        },
+        count, r_dense);
+
+    auto const num_refs = data.way_node_refs.size();
+    print("IdSetSmall:  ", t_small, num_refs);
+    print("IdSetDense:  ", t_dense, num_refs);
+    std::cout << "references to colocated nodes: " << r_dense << '\n';
+
+    if (r_range != r_bloom || r_range != r_hash || r_small != r_dense) {
+        std::cerr << "Results differ!\n";
+        return 1;
+    }
+
+    return 0;
+} catch (std::exception const &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+}
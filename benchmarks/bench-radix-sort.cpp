@@ -0,0 +1,117 @@
+/*
+ * Benchmark for the sort functions in radix-sort.hpp used by
+ * osp-analyze-relation-types.
+ *
+ * Creates random node-like keys (packed ids with duplicates, as collected
+ * from relation members) and sorts them with std::sort followed by
+ * std::unique (the code osp-analyze-relation-types used before) and with
+ * parallel_radix_sort_unique(), once single-threaded and once with the
+ * given number of threads.
+ */
+
+#include "radix-sort.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Keys like the ones osp-analyze-relation-types creates: node ids up to
+// about 12 billion shifted left by 16 bits with the index of the relation
+// type in the lowest bits. About a fifth of the keys are duplicates.
+std::vector<uint64_t> create_keys(std::size_t size)
+{
+    std::mt19937_64 rng{42};
+    std::uniform_int_distribution<uint64_t> id_dist{1, 12000000000ULL};
+    std::uniform_int_distribution<uint64_t> type_dist{1, 200};
+
+    std::vector<uint64_t> keys;
+    keys.reserve(size);
+    while (keys.size() < size) {
+        auto const key = (id_dist(rng) << 16U) | type_dist(rng);
+        keys.push_back(key);
+        if (rng() % 4 == 0 && keys.size() < size) {
+            keys.push_back(key);
+        }
+    }
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    return keys;
+}
+
+template <typename TFunc>
+double run(TFunc &&func, std::vector<uint64_t> const &keys, int count,
+           std::vector<uint64_t> &result)
+{
+    double time = 0;
+    for (int n = 0; n < count; ++n) {
+        result = keys;
+        auto const start = std::chrono::steady_clock::now();
+        std::forward<TFunc>(func)(result);
+        auto const end = std::chrono::steady_clock::now();
+        time += std::chrono::duration<double>(end - start).count();
+    }
+    return time / count;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+try {
+    if (argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " [SIZE [THREADS [COUNT]]]\n";
+        return 2;
+    }
+
+    std::size_t const size =
+        argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 50000000;
+    int const num_threads = argc > 2 ? std::atoi(argv[2]) : 4;
+    int const count = argc > 3 ? std::atoi(argv[3]) : 3;
+
+    auto const keys = create_keys(size);
+    std::cout << "Sorting " << keys.size() << " keys.\n";
+
+    std::vector<uint64_t> r_std;
+    std::vector<uint64_t> r_radix;
+    std::vector<uint64_t> r_parallel;
+
+    double const t_std = run(
+        [](std::vector<uint64_t> &data) {
+            std::sort(data.begin(), data.end());
+            data.erase(std::unique(data.begin(), data.end()), data.end());
+        },
+        keys, count, r_std);
+    double const t_radix = run(
+        [](std::vector<uint64_t> &data) {
+            parallel_radix_sort_unique(data, 1);
+        },
+        keys, count, r_radix);
+    double const t_parallel = run(
+        [&](std::vector<uint64_t> &data) {
+            parallel_radix_sort_unique(data, num_threads);
+        },
+        keys, count, r_parallel);
+
+    std::cout << "std::sort + std::unique: " << t_std << "s\n";
+    std::cout << "radix sort (1 thread):   " << t_radix << "s (speedup "
+              << t_std / t_radix << ")\n";
+    std::cout << "radix sort (" << num_threads
+              << " threads): " << t_parallel << "s (speedup "
+              << t_std / t_parallel << ")\n";
+    std::cout << "unique keys: " << r_std.size() << '\n';
+
+    if (r_std != r_radix || r_std != r_parallel) {
+        std::cerr << "Results differ!\n";
+        return 1;
+    }
+
+    return 0;
+} catch (std::exception const &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+}
@@ -0,0 +1,226 @@
+/*
+ * Benchmark for the geometry kernels in geom-kernels.hpp used by
+ * osp-find-way-problems.
+ *
+ * Reads all ways from an OSM file with locations on ways and runs the close
+ * nodes, long segment and acute angle checks on them, once with the scalar
+ * code osp-find-way-problems used before and once with the batch kernels.
+ */
+
+#include "geom-kernels.hpp"
+
+#include <osmium/geom/haversine.hpp>
+#include <osmium/geom/util.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/way.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr int const min_diff_for_close_nodes = 10;
+constexpr double const max_angle = 0.03;
+constexpr double const max_segment_length = 100000.0;
+
+struct way_coordinates
+{
+    std::vector<int32_t> x;
+    std::vector<int32_t> y;
+    std::vector<std::size_t> offsets{0};
+};
+
+struct results
+{
+    uint64_t close_nodes = 0;
+    uint64_t long_segment = 0;
+    uint64_t acute_angles = 0;
+
+    bool operator==(results const &other) const noexcept
+    {
+        return close_nodes == other.close_nodes &&
+               long_segment == other.long_segment &&
+               acute_angles == other.acute_angles;
+    }
+};
+
+double calc_angle(int32_t const *x, int32_t const *y, std::size_t m)
+{
+    int64_t const dax = static_cast<int64_t>(x[m - 1]) - x[m];
+    int64_t const day = static_cast<int64_t>(y[m - 1]) - y[m];
+    int64_t const dbx = static_cast<int64_t>(x[m + 1]) - x[m];
+    int64_t const dby = static_cast<int64_t>(y[m + 1]) - y[m];
+    auto const dp = static_cast<double>(dax * dbx + day * dby);
+    double const m1 = std::sqrt(static_cast<double>(dax * dax + day * day));
+    double const m2 = std::sqrt(static_cast<double>(dbx * dbx + dby * dby));
+
+    if (m1 == 0 || m2 == 0) {
+        return 0;
+    }
+
+    return std::acos(dp / (m1 * m2));
+}
+
+double distance(int32_t const *x, int32_t const *y, std::size_t i)
+{
+    return osmium::geom::haversine::distance(
+        osmium::Location{x[i], y[i]}, osmium::Location{x[i + 1], y[i + 1]});
+}
+
+results run_scalar(way_coordinates const &coords)
+{
+    results r;
+
+    for (std::size_t w = 0; w + 1 < coords.offsets.size(); ++w) {
+        auto const *x = coords.x.data() + coords.offsets[w];
+        auto const *y = coords.y.data() + coords.offsets[w];
+        std::size_t const size = coords.offsets[w + 1] - coords.offsets[w];
+
+        for (std::size_t i = 1; i < size; ++i) {
+            auto const dx = std::abs(x[i] - x[i - 1]);
+            auto const dy = std::abs(y[i] - y[i - 1]);
+            if (dx < min_diff_for_close_nodes &&
+                dy < min_diff_for_close_nodes) {
+                ++r.close_nodes;
+                break;
+            }
+        }
+
+        for (std::size_t i = 0; i + 1 < size; ++i) {
+            if ((x[i] != x[i + 1] || y[i] != y[i + 1]) &&
+                distance(x, y, i) > max_segment_length) {
+                ++r.long_segment;
+                break;
+            }
+        }
+
+        for (std::size_t i = 1; i + 1 < size; ++i) {
+            if (calc_angle(x, y, i) < max_angle) {
+                ++r.acute_angles;
+            }
+        }
+    }
+
+    return r;
+}
+
+results run_kernels(way_coordinates const &coords)
+{
+    results r;
+
+    double const cos_max_angle = std::cos(max_angle);
+    double const min_l1 =
+        max_segment_length * (1.0 - 1.0e-9) /
+        (osmium::geom::haversine::EARTH_RADIUS_IN_METERS *
+         osmium::geom::deg_to_rad(1.0 / osmium::detail::coordinate_precision));
+
+    std::vector<uint32_t> candidates;
+
+    for (std::size_t w = 0; w + 1 < coords.offsets.size(); ++w) {
+        auto const *x = coords.x.data() + coords.offsets[w];
+        auto const *y = coords.y.data() + coords.offsets[w];
+        std::size_t const size = coords.offsets[w + 1] - coords.offsets[w];
+
+        if (has_close_nodes(x, y, size, min_diff_for_close_nodes)) {
+            ++r.close_nodes;
+        }
+
+        candidates.clear();
+        find_long_segment_candidates(x, y, size, min_l1, candidates);
+        for (auto const i : candidates) {
+            if ((x[i] != x[i + 1] || y[i] != y[i + 1]) &&
+                distance(x, y, i) > max_segment_length) {
+                ++r.long_segment;
+                break;
+            }
+        }
+
+        candidates.clear();
+        find_acute_angle_candidates(x, y, size, cos_max_angle, candidates);
+        for (auto const i : candidates) {
+            if (calc_angle(x, y, i) < max_angle) {
+                ++r.acute_angles;
+            }
+        }
+    }
+
+    return r;
+}
+
+template <typename TFunc>
+double run(TFunc &&func, way_coordinates const &coords, int count,
+           results &r)
+{
+    auto const start = std::chrono::steady_clock::now();
+    for (int n = 0; n < count; ++n) {
+        r = std::forward<TFunc>(func)(coords);
+    }
+    auto const end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count() / count;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+try {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " OSM-FILE [COUNT]\n"
+                  << "OSM-FILE must contain locations on ways.\n";
+        return 2;
+    }
+
+    int const count = argc == 3 ? std::atoi(argv[2]) : 3;
+
+    way_coordinates coords;
+
+    osmium::io::Reader reader{argv[1], osmium::osm_entity_bits::way};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        for (auto const &way : buffer.select<osmium::Way>()) {
+            if (way.nodes().size() < 2) {
+                continue;
+            }
+            for (auto const &nr : way.nodes()) {
+                coords.x.push_back(nr.location().x());
+                coords.y.push_back(nr.location().y());
+            }
+            coords.offsets.push_back(coords.x.size());
+        }
+    }
+    reader.close();
+
+    auto const num_ways = coords.offsets.size() - 1;
+    auto const num_nodes = coords.x.size();
+    std::cout << "Read " << num_ways << " ways with " << num_nodes
+              << " nodes.\n";
+
+    results rs;
+    results rk;
+    double const ts = run(run_scalar, coords, count, rs);
+    double const tk = run(run_kernels, coords, count, rk);
+
+    std::cout << "scalar:  " << ts << "s ("
+              << ts * 1e9 / static_cast<double>(num_nodes) << " ns/node)\n";
+    std::cout << "kernels: " << tk << "s ("
+              << tk * 1e9 / static_cast<double>(num_nodes)
+              << " ns/node) using " << geom_kernels_implementation() << '\n';
+    std::cout << "speedup: " << ts / tk << '\n';
+    std::cout << "close nodes: " << rk.close_nodes
+              << ", long segments: " << rk.long_segment
+              << ", acute angles: " << rk.acute_angles << '\n';
+
+    if (!(rs == rk)) {
+        std::cerr << "Results differ!\n";
+        return 1;
+    }
+
+    return 0;
+} catch (std::exception const &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+}
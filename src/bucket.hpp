@@ -0,0 +1,307 @@
+#ifndef OSMIUM_SURPLUS_BUCKET_HPP
+#define OSMIUM_SURPLUS_BUCKET_HPP
+
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Build the name of the file for bucket n (0 <= n < 256) in the directory.
+ */
+inline std::string build_bucket_filename(std::string const &dirname,
+                                         char const *prefix, unsigned int n)
+{
+    static char const *const lookup_hex = "0123456789abcdef";
+
+    std::string filename = dirname;
+    filename += '/';
+    filename += prefix;
+    filename += '_';
+    filename += lookup_hex[(n >> 4U) & 0xfU];
+    filename += lookup_hex[n & 0xfU];
+    filename += ".dat";
+
+    return filename;
+}
+
+/**
+ * Write all the data to the file or throw.
+ */
+inline void write_to_bucket_file(int fd, void const *data, std::size_t bytes,
+                                 std::string const &filename)
+{
+    auto const length = ::write(fd, data, bytes);
+    if (length != static_cast<long>(bytes)) { // NOLINT(google-runtime-int)
+        throw std::system_error{errno, std::system_category(),
+                                std::string{"can't write to file '"} +
+                                    filename + "'"};
+    }
+}
+
+/**
+ * Runs the writes of buckets in a background thread, so the thread filling
+ * the buckets doesn't have to wait for the disk. Writes are done in the
+ * order they were submitted. At most max_queue_size writes are waiting at
+ * any time, after that submit() blocks.
+ */
+class BackgroundWriter
+{
+
+    std::deque<std::function<void()>> m_queue;
+
+    std::mutex m_mutex;
+
+    std::condition_variable m_queue_changed;
+
+    std::exception_ptr m_error;
+
+    std::size_t m_max_queue_size;
+
+    bool m_busy = false;
+
+    bool m_done = false;
+
+    std::thread m_thread;
+
+    void run()
+    {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock{m_mutex};
+                m_queue_changed.wait(
+                    lock, [this]() { return m_done || !m_queue.empty(); });
+                if (m_queue.empty()) {
+                    return;
+                }
+                job = std::move(m_queue.front());
+                m_queue.pop_front();
+                m_busy = true;
+            }
+            m_queue_changed.notify_all();
+
+            try {
+                job();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                m_busy = false;
+            }
+            m_queue_changed.notify_all();
+        }
+    }
+
+    // Must be called with the lock held.
+    void check_error()
+    {
+        if (m_error) {
+            auto error = m_error;
+            m_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+public:
+    explicit BackgroundWriter(std::size_t max_queue_size = 16)
+    : m_max_queue_size(max_queue_size), m_thread(&BackgroundWriter::run, this)
+    {}
+
+    BackgroundWriter(BackgroundWriter const &) = delete;
+    BackgroundWriter &operator=(BackgroundWriter const &) = delete;
+
+    BackgroundWriter(BackgroundWriter &&) = delete;
+    BackgroundWriter &operator=(BackgroundWriter &&) = delete;
+
+    ~BackgroundWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_done = true;
+        }
+        m_queue_changed.notify_all();
+        m_thread.join();
+    }
+
+    void submit(std::function<void()> &&job)
+    {
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_queue_changed.wait(lock, [this]() {
+                return m_queue.size() < m_max_queue_size;
+            });
+            check_error();
+            m_queue.push_back(std::move(job));
+        }
+        m_queue_changed.notify_all();
+    }
+
+    /// Wait until all submitted writes are done.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_queue_changed.wait(lock,
+                             [this]() { return m_queue.empty() && !m_busy; });
+        check_error();
+    }
+
+}; // class BackgroundWriter
+
+/**
+ * A bucket collects objects of type T in memory and writes them out to a
+ * file when it is full. This is used to split up large amounts of data into
+ * pieces small enough to be processed in memory one after the other.
+ */
+template <typename T>
+class Bucket
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Bucket data must be trivially copyable");
+
+    // maximum size of bucket before it gets flushed
+    constexpr static int const max_bucket_size = 512 * 1024;
+
+    constexpr static int const open_flags =
+        // NOLINTNEXTLINE(hicpp-signed-bitwise)
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+    std::vector<T> m_data;
+
+    std::string m_filename;
+
+    BackgroundWriter *m_writer;
+
+    std::size_t m_size = 0;
+
+    int m_fd;
+
+public:
+    /**
+     * If a writer is given, the data is written out by the writer in the
+     * background while the next data is collected.
+     */
+    explicit Bucket(std::string filename, BackgroundWriter *writer = nullptr)
+    : m_filename(std::move(filename)), m_writer(writer),
+      m_fd(::open(m_filename.c_str(), open_flags, 0666))
+    {
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(),
+                                    std::string{"Can't open file '"} +
+                                        m_filename + "'"};
+        }
+        m_data.reserve(max_bucket_size);
+    }
+
+    Bucket(Bucket const &) = delete;
+    Bucket &operator=(Bucket const &) = delete;
+
+    Bucket(Bucket &&) = default;
+    Bucket &operator=(Bucket &&) = default;
+
+    ~Bucket()
+    {
+        try {
+            flush();
+            if (m_writer) {
+                m_writer->wait();
+            }
+        } catch (...) {
+            // ignore exceptions
+        }
+        ::close(m_fd);
+    }
+
+    void set(T const &value)
+    {
+        ++m_size;
+        m_data.push_back(value);
+        if (m_data.size() == max_bucket_size) {
+            flush();
+        }
+    }
+
+    void append(T const *values, std::size_t count)
+    {
+        m_size += count;
+        m_data.insert(m_data.end(), values, values + count);
+        if (m_data.size() >= max_bucket_size) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (m_data.empty()) {
+            return;
+        }
+
+        if (m_writer) {
+            std::vector<T> data;
+            data.reserve(max_bucket_size);
+            m_data.swap(data);
+            m_writer->submit([fd = m_fd, filename = m_filename,
+                              data = std::move(data)]() {
+                write_to_bucket_file(fd, data.data(), data.size() * sizeof(T),
+                                     filename);
+            });
+            return;
+        }
+
+        write_to_bucket_file(m_fd, m_data.data(), m_data.size() * sizeof(T),
+                             m_filename);
+        m_data.clear();
+    }
+
+    /// The number of objects added to this bucket.
+    [[nodiscard]] std::size_t size() const noexcept { return m_size; }
+
+}; // class Bucket
+
+/**
+ * Map the contents of a bucket file written by Bucket<T> into memory,
+ * call func with the (private, writable) mapping and remove the file.
+ */
+template <typename T, typename TFunc>
+void process_bucket_file(std::string const &filename, TFunc &&func)
+{
+    int const fd = ::open(filename.c_str(),
+                          O_RDONLY | O_CLOEXEC); // NOLINT(hicpp-signed-bitwise)
+    if (fd < 0) {
+        throw std::system_error{errno, std::system_category(),
+                                std::string{"Can't open file '"} + filename +
+                                    "'"};
+    }
+    auto const file_size = osmium::util::file_size(fd);
+
+    if (file_size > 0) {
+        osmium::util::TypedMemoryMapping<T> mapping{
+            file_size / sizeof(T),
+            osmium::util::MemoryMapping::mapping_mode::write_private, fd};
+        func(mapping);
+    }
+
+    ::close(fd);
+    ::unlink(filename.c_str());
+}
+
+#endif // OSMIUM_SURPLUS_BUCKET_HPP
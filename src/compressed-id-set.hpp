@@ -0,0 +1,202 @@
+#ifndef OSMIUM_SURPLUS_COMPRESSED_ID_SET_HPP
+#define OSMIUM_SURPLUS_COMPRESSED_ID_SET_HPP
+
+#include <osmium/osm/types.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * A set of (unsigned) ids stored like a "roaring bitmap": The ids are split
+ * into blocks of 2^16 ids. Each block that has any ids set gets a
+ * container which is either a sorted array of the lower 16 bits of the ids
+ * (as long as there are only a few of them) or a bitmap with 2^16 bits. So
+ * the memory needed depends on the number of ids set, not on the largest
+ * id. The containers are found through a flat table with one pointer per
+ * block.
+ *
+ * Has the same interface as osmium::index::IdSetDense as far as used here.
+ */
+class CompressedIdSet
+{
+
+public:
+    using id_type = osmium::unsigned_object_id_type;
+
+private:
+    constexpr static unsigned int const block_bits = 16;
+    constexpr static id_type const low_mask = (id_type{1} << block_bits) - 1;
+
+    // Containers with more ids than this are stored as bitmaps. At this
+    // point the array needs the same memory as the bitmap.
+    constexpr static std::size_t const max_array_size = 4096;
+
+    constexpr static std::size_t const bitmap_words =
+        (std::size_t{1} << block_bits) / 64;
+
+    class container
+    {
+
+        std::vector<uint16_t> m_array;
+        std::unique_ptr<uint64_t[]> m_bitmap;
+        std::size_t m_size = 0;
+
+        static uint64_t bit(uint16_t value) noexcept
+        {
+            return uint64_t{1} << (value & 0x3fU);
+        }
+
+        void convert_to_bitmap()
+        {
+            m_bitmap.reset(new uint64_t[bitmap_words]());
+            for (auto const value : m_array) {
+                m_bitmap[value >> 6U] |= bit(value);
+            }
+            m_array.clear();
+            m_array.shrink_to_fit();
+        }
+
+    public:
+        // Returns true if the value was not set before.
+        bool set(uint16_t value)
+        {
+            if (m_bitmap) {
+                auto &word = m_bitmap[value >> 6U];
+                if (word & bit(value)) {
+                    return false;
+                }
+                word |= bit(value);
+                ++m_size;
+                return true;
+            }
+
+            auto const it =
+                std::lower_bound(m_array.begin(), m_array.end(), value);
+            if (it != m_array.end() && *it == value) {
+                return false;
+            }
+            m_array.insert(it, value);
+            ++m_size;
+            if (m_array.size() > max_array_size) {
+                convert_to_bitmap();
+            }
+            return true;
+        }
+
+        // Returns true if the value was set before.
+        bool unset(uint16_t value)
+        {
+            if (m_bitmap) {
+                auto &word = m_bitmap[value >> 6U];
+                if (!(word & bit(value))) {
+                    return false;
+                }
+                word &= ~bit(value);
+                --m_size;
+                return true;
+            }
+
+            auto const it =
+                std::lower_bound(m_array.begin(), m_array.end(), value);
+            if (it == m_array.end() || *it != value) {
+                return false;
+            }
+            m_array.erase(it);
+            --m_size;
+            return true;
+        }
+
+        [[nodiscard]] bool get(uint16_t value) const noexcept
+        {
+            if (m_bitmap) {
+                return (m_bitmap[value >> 6U] & bit(value)) != 0;
+            }
+            return std::binary_search(m_array.cbegin(), m_array.cend(),
+                                      value);
+        }
+
+        [[nodiscard]] std::size_t size() const noexcept { return m_size; }
+
+        [[nodiscard]] std::size_t used_memory() const noexcept
+        {
+            return sizeof(container) +
+                   (m_bitmap ? bitmap_words * sizeof(uint64_t)
+                             : m_array.capacity() * sizeof(uint16_t));
+        }
+
+    }; // class container
+
+    std::vector<std::unique_ptr<container>> m_containers;
+
+    std::size_t m_size = 0;
+
+    static std::size_t block_of(id_type id) noexcept
+    {
+        return static_cast<std::size_t>(id >> block_bits);
+    }
+
+    static uint16_t low_bits(id_type id) noexcept
+    {
+        return static_cast<uint16_t>(id & low_mask);
+    }
+
+public:
+    void set(id_type id)
+    {
+        auto const block = block_of(id);
+        if (block >= m_containers.size()) {
+            m_containers.resize(block + 1);
+        }
+        auto &c = m_containers[block];
+        if (!c) {
+            c = std::make_unique<container>();
+        }
+        if (c->set(low_bits(id))) {
+            ++m_size;
+        }
+    }
+
+    void unset(id_type id)
+    {
+        auto const block = block_of(id);
+        if (block >= m_containers.size() || !m_containers[block]) {
+            return;
+        }
+        auto &c = m_containers[block];
+        if (c->unset(low_bits(id))) {
+            --m_size;
+            if (c->size() == 0) {
+                c.reset();
+            }
+        }
+    }
+
+    [[nodiscard]] bool get(id_type id) const noexcept
+    {
+        auto const block = block_of(id);
+        return block < m_containers.size() && m_containers[block] &&
+               m_containers[block]->get(low_bits(id));
+    }
+
+    [[nodiscard]] bool empty() const noexcept { return m_size == 0; }
+
+    [[nodiscard]] std::size_t size() const noexcept { return m_size; }
+
+    [[nodiscard]] std::size_t used_memory() const noexcept
+    {
+        std::size_t memory =
+            m_containers.capacity() * sizeof(std::unique_ptr<container>);
+        for (auto const &c : m_containers) {
+            if (c) {
+                memory += c->used_memory();
+            }
+        }
+        return memory;
+    }
+
+}; // class CompressedIdSet
+
+#endif // OSMIUM_SURPLUS_COMPRESSED_ID_SET_HPP
@@ -0,0 +1,149 @@
+#ifndef OSMIUM_SURPLUS_CONCURRENT_ID_SET_HPP
+#define OSMIUM_SURPLUS_CONCURRENT_ID_SET_HPP
+
+#include <osmium/osm/types.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+/**
+ * A dense set of (unsigned) ids stored as a bitmap which can be filled from
+ * several threads at the same time. Like osmium::index::IdSetDense the
+ * bitmap is split into chunks which are only allocated when an id in them
+ * is set. Reading with get() is only safe after all threads setting ids are
+ * done.
+ */
+class ConcurrentIdSet
+{
+
+public:
+    using id_type = osmium::unsigned_object_id_type;
+
+    // number of ids in a chunk
+    constexpr static unsigned int const chunk_bits = 22U;
+    constexpr static std::size_t const words_per_chunk =
+        (std::size_t{1} << chunk_bits) / 64U;
+
+    // ids must be smaller than 2^(chunk_bits + max_chunk_bits)
+    constexpr static unsigned int const max_chunk_bits = 18U;
+    constexpr static std::size_t const max_chunks = std::size_t{1}
+                                                    << max_chunk_bits;
+
+    using word_type = std::atomic<uint64_t>;
+
+private:
+    std::unique_ptr<std::atomic<word_type *>[]> m_chunks;
+
+    static std::size_t chunk_of(id_type id) noexcept
+    {
+        return static_cast<std::size_t>(id >> chunk_bits);
+    }
+
+    static std::size_t word_of(id_type id) noexcept
+    {
+        return static_cast<std::size_t>(id >> 6U) & (words_per_chunk - 1);
+    }
+
+    static uint64_t bit_of(id_type id) noexcept
+    {
+        return uint64_t{1} << (id & 0x3fU);
+    }
+
+public:
+    ConcurrentIdSet() : m_chunks(new std::atomic<word_type *>[max_chunks]())
+    {}
+
+    ConcurrentIdSet(ConcurrentIdSet const &) = delete;
+    ConcurrentIdSet &operator=(ConcurrentIdSet const &) = delete;
+
+    ConcurrentIdSet(ConcurrentIdSet &&) = delete;
+    ConcurrentIdSet &operator=(ConcurrentIdSet &&) = delete;
+
+    ~ConcurrentIdSet()
+    {
+        for (std::size_t n = 0; n < max_chunks; ++n) {
+            delete[] m_chunks[n].load();
+        }
+    }
+
+    /**
+     * Get the chunk with the given number, allocating it if needed. If two
+     * threads allocate the same chunk at the same time, one of them wins
+     * and the other one frees its chunk again.
+     */
+    word_type *chunk(std::size_t n)
+    {
+        auto *data = m_chunks[n].load(std::memory_order_acquire);
+        if (data) {
+            return data;
+        }
+
+        auto *new_data = new word_type[words_per_chunk]();
+        if (m_chunks[n].compare_exchange_strong(data, new_data,
+                                                std::memory_order_acq_rel)) {
+            return new_data;
+        }
+        delete[] new_data;
+        return data;
+    }
+
+    /// Get the chunk with the given number or nullptr if it doesn't exist.
+    [[nodiscard]] word_type const *chunk(std::size_t n) const noexcept
+    {
+        return m_chunks[n].load(std::memory_order_acquire);
+    }
+
+    /// Can be called from several threads at the same time.
+    void set(id_type id)
+    {
+        if (chunk_of(id) >= max_chunks) {
+            throw std::range_error{"id too large for ConcurrentIdSet"};
+        }
+
+        auto &word = chunk(chunk_of(id))[word_of(id)];
+        auto const bit = bit_of(id);
+
+        // Most ids are referenced more than once, avoid writing to the
+        // cache line if the bit is already set.
+        if ((word.load(std::memory_order_relaxed) & bit) == 0) {
+            word.fetch_or(bit, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Set the id and return whether it was set before. Can be called from
+     * several threads at the same time, only one of them will see false for
+     * any id.
+     */
+    bool test_and_set(id_type id)
+    {
+        if (chunk_of(id) >= max_chunks) {
+            throw std::range_error{"id too large for ConcurrentIdSet"};
+        }
+
+        auto &word = chunk(chunk_of(id))[word_of(id)];
+        auto const bit = bit_of(id);
+
+        if ((word.load(std::memory_order_relaxed) & bit) != 0) {
+            return true;
+        }
+        return (word.fetch_or(bit, std::memory_order_relaxed) & bit) != 0;
+    }
+
+    [[nodiscard]] bool get(id_type id) const noexcept
+    {
+        if (chunk_of(id) >= max_chunks) {
+            return false;
+        }
+
+        auto const *data = chunk(chunk_of(id));
+        return data && (data[word_of(id)].load(std::memory_order_relaxed) &
+                        bit_of(id)) != 0;
+    }
+
+}; // class ConcurrentIdSet
+
+#endif // OSMIUM_SURPLUS_CONCURRENT_ID_SET_HPP
@@ -0,0 +1,227 @@
+#ifndef OSMIUM_SURPLUS_EXTERNAL_SORT_HPP
+#define OSMIUM_SURPLUS_EXTERNAL_SORT_HPP
+
+#include "bucket.hpp"
+#include "radix-sort.hpp"
+
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Collects uint64_t values and gives them back sorted and without
+ * duplicates. If more than max_values values are added, the values
+ * collected so far are sorted and written to disk as a "run" and memory is
+ * reused for the next values. The runs are merged when reading the values
+ * back with a cursor. If max_values is 0, everything is kept in memory.
+ *
+ * Sorting needs twice the memory of the values, so max_values should be
+ * set to about 1/16 of the memory available (in bytes).
+ */
+class ExternalSorter
+{
+
+    // Runs are written in pieces this large, because write() can not
+    // write more than 2 GB at once.
+    constexpr static std::size_t const max_write_values = 8UL * 1024UL * 1024UL;
+
+    std::string m_prefix;
+
+    std::vector<uint64_t> m_data;
+
+    std::vector<std::string> m_runs;
+
+    std::size_t m_max_values;
+
+    int m_num_threads;
+
+    void write_run()
+    {
+        parallel_radix_sort_unique(m_data, m_num_threads);
+
+        std::string filename =
+            m_prefix + "-" + std::to_string(m_runs.size()) + ".run";
+        int const fd = ::open(filename.c_str(),
+                              // NOLINTNEXTLINE(hicpp-signed-bitwise)
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            throw std::system_error{errno, std::system_category(),
+                                    std::string{"Can't open file '"} +
+                                        filename + "'"};
+        }
+        m_runs.push_back(std::move(filename));
+
+        for (std::size_t pos = 0; pos < m_data.size();
+             pos += max_write_values) {
+            auto const count = std::min(max_write_values, m_data.size() - pos);
+            write_to_bucket_file(fd, m_data.data() + pos,
+                                 count * sizeof(uint64_t), m_runs.back());
+        }
+        ::close(fd);
+
+        m_data.clear();
+    }
+
+public:
+    /**
+     * Reads the values from all runs and the data in memory, merging them
+     * and skipping duplicates.
+     */
+    class cursor
+    {
+
+        struct source_type
+        {
+            std::unique_ptr<osmium::util::MemoryMapping> mapping;
+            uint64_t const *it;
+            uint64_t const *end;
+        }; // struct source_type
+
+        std::vector<source_type> m_sources;
+
+        // Heap with the next value from each source and the source index.
+        std::vector<std::pair<uint64_t, std::size_t>> m_heap;
+
+        uint64_t m_value = 0;
+
+        bool m_empty = true;
+
+        void push(std::size_t n)
+        {
+            auto &source = m_sources[n];
+            if (source.it != source.end) {
+                m_heap.emplace_back(*source.it++, n);
+                std::push_heap(m_heap.begin(), m_heap.end(), std::greater<>{});
+            }
+        }
+
+    public:
+        cursor(std::vector<std::string> const &runs,
+               std::vector<uint64_t> const &data)
+        {
+            for (auto const &filename : runs) {
+                int const fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    throw std::system_error{errno, std::system_category(),
+                                            std::string{"Can't open file '"} +
+                                                filename + "'"};
+                }
+                auto const size = osmium::util::file_size(fd);
+                source_type source{nullptr, nullptr, nullptr};
+                if (size > 0) {
+                    source.mapping =
+                        std::make_unique<osmium::util::MemoryMapping>(
+                            size,
+                            osmium::util::MemoryMapping::mapping_mode::readonly,
+                            fd);
+                    source.it = source.mapping->get_addr<uint64_t const>();
+                    source.end = source.it + size / sizeof(uint64_t);
+                }
+                ::close(fd);
+                m_sources.push_back(std::move(source));
+            }
+            m_sources.push_back(
+                {nullptr, data.data(), data.data() + data.size()});
+
+            for (std::size_t n = 0; n < m_sources.size(); ++n) {
+                push(n);
+            }
+            next();
+        }
+
+        [[nodiscard]] bool empty() const noexcept { return m_empty; }
+
+        [[nodiscard]] uint64_t value() const noexcept { return m_value; }
+
+        void next()
+        {
+            while (!m_heap.empty()) {
+                std::pop_heap(m_heap.begin(), m_heap.end(), std::greater<>{});
+                auto const top = m_heap.back();
+                m_heap.pop_back();
+                push(top.second);
+                if (m_empty || top.first != m_value) {
+                    m_value = top.first;
+                    m_empty = false;
+                    return;
+                }
+            }
+            m_empty = true;
+        }
+
+    }; // class cursor
+
+    /**
+     * Run files are called PREFIX-N.run. If max_values is 0, all values
+     * are kept in memory.
+     */
+    ExternalSorter(std::string prefix, std::size_t max_values,
+                   int num_threads)
+    : m_prefix(std::move(prefix)), m_max_values(max_values),
+      m_num_threads(num_threads)
+    {
+        if (m_max_values > 0) {
+            m_data.reserve(m_max_values);
+        }
+    }
+
+    ExternalSorter(ExternalSorter const &) = delete;
+    ExternalSorter &operator=(ExternalSorter const &) = delete;
+
+    ExternalSorter(ExternalSorter &&) = delete;
+    ExternalSorter &operator=(ExternalSorter &&) = delete;
+
+    ~ExternalSorter()
+    {
+        for (auto const &filename : m_runs) {
+            ::unlink(filename.c_str());
+        }
+    }
+
+    void push_back(uint64_t value)
+    {
+        if (m_max_values > 0 && m_data.size() == m_max_values) {
+            write_run();
+        }
+        m_data.push_back(value);
+    }
+
+    /**
+     * Call this after all values have been added and before getting a
+     * cursor. Sorts the values still in memory.
+     */
+    void finish() { parallel_radix_sort_unique(m_data, m_num_threads); }
+
+    /// The number of runs written to disk.
+    [[nodiscard]] std::size_t num_runs() const noexcept
+    {
+        return m_runs.size();
+    }
+
+    /**
+     * The values in memory. After finish() they are sorted. If there are
+     * no runs, these are all the values.
+     */
+    [[nodiscard]] std::vector<uint64_t> const &data() const noexcept
+    {
+        return m_data;
+    }
+
+    /// Get a cursor for reading all values. Call finish() first.
+    [[nodiscard]] cursor values() const { return cursor{m_runs, m_data}; }
+
+}; // class ExternalSorter
+
+#endif // OSMIUM_SURPLUS_EXTERNAL_SORT_HPP
@@ -0,0 +1,286 @@
+#ifndef OSMIUM_SURPLUS_GEOM_KERNELS_HPP
+#define OSMIUM_SURPLUS_GEOM_KERNELS_HPP
+
+/**
+ * Batch kernels for the geometry checks in osp-find-way-problems. They work
+ * on arrays with the x and y coordinates (in osmium::Location units) of all
+ * nodes of a way.
+ *
+ * If the code is compiled with AVX2 or SSE4.1 enabled (for instance with
+ * -march=native), vector instructions are used, otherwise a scalar
+ * implementation.
+ *
+ * The kernels for long segments and acute angles are filters: They find
+ * all candidates but, because of rounding and the cheaper math used, maybe
+ * some more. The caller has to check the candidates with the exact
+ * calculation.
+ */
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+// Unaligned loads of 8, 4, or 2 int32_t values.
+// NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+#if defined(__AVX2__)
+inline __m256i load8(int32_t const *p) noexcept
+{
+    return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+}
+#endif
+
+inline __m128i load4(int32_t const *p) noexcept
+{
+    return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+}
+
+inline __m128i load2(int32_t const *p) noexcept
+{
+    return _mm_loadl_epi64(reinterpret_cast<__m128i const *>(p));
+}
+// NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+#endif
+
+inline char const *geom_kernels_implementation() noexcept
+{
+#if defined(__AVX2__)
+    return "AVX2";
+#elif defined(__SSE4_1__)
+    return "SSE4.1";
+#else
+    return "scalar";
+#endif
+}
+
+/**
+ * Are there two nodes in a row with both their x and y coordinates less
+ * than min_diff apart?
+ */
+inline bool has_close_nodes(int32_t const *x, int32_t const *y,
+                            std::size_t size, int32_t min_diff) noexcept
+{
+    std::size_t i = 1;
+
+#if defined(__AVX2__)
+    __m256i const upper = _mm256_set1_epi32(min_diff);
+    __m256i const lower = _mm256_set1_epi32(-min_diff);
+    for (; i + 8 <= size; i += 8) {
+        __m256i const dx = _mm256_sub_epi32(load8(x + i), load8(x + i - 1));
+        __m256i const dy = _mm256_sub_epi32(load8(y + i), load8(y + i - 1));
+        __m256i const close = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(upper, dx),
+                             _mm256_cmpgt_epi32(dx, lower)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(upper, dy),
+                             _mm256_cmpgt_epi32(dy, lower)));
+        if (!_mm256_testz_si256(close, close)) {
+            return true;
+        }
+    }
+#elif defined(__SSE4_1__)
+    __m128i const upper = _mm_set1_epi32(min_diff);
+    __m128i const lower = _mm_set1_epi32(-min_diff);
+    for (; i + 4 <= size; i += 4) {
+        __m128i const dx = _mm_sub_epi32(load4(x + i), load4(x + i - 1));
+        __m128i const dy = _mm_sub_epi32(load4(y + i), load4(y + i - 1));
+        __m128i const close =
+            _mm_and_si128(_mm_and_si128(_mm_cmplt_epi32(dx, upper),
+                                        _mm_cmpgt_epi32(dx, lower)),
+                          _mm_and_si128(_mm_cmplt_epi32(dy, upper),
+                                        _mm_cmpgt_epi32(dy, lower)));
+        if (!_mm_testz_si128(close, close)) {
+            return true;
+        }
+    }
+#endif
+
+    for (; i < size; ++i) {
+        auto const dx = std::abs(static_cast<int64_t>(x[i]) - x[i - 1]);
+        auto const dy = std::abs(static_cast<int64_t>(y[i]) - y[i - 1]);
+        if (dx < min_diff && dy < min_diff) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Find all segments (from node i to node i+1) where the sum of the absolute
+ * x and y differences is at least min_l1 and append their indexes i to
+ * the result vector.
+ *
+ * The great circle distance between two points is never larger than the
+ * way along the meridian and then along the parallel. So this can be used
+ * to rule out most segments before calculating the haversine distance.
+ */
+inline void find_long_segment_candidates(int32_t const *x, int32_t const *y,
+                                         std::size_t size, double min_l1,
+                                         std::vector<uint32_t> &result)
+{
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256d const sign_mask = _mm256_set1_pd(-0.0);
+    __m256d const limit = _mm256_set1_pd(min_l1);
+    for (; i + 5 <= size; i += 4) {
+        __m256d const dx = _mm256_sub_pd(_mm256_cvtepi32_pd(load4(x + i + 1)),
+                                         _mm256_cvtepi32_pd(load4(x + i)));
+        __m256d const dy = _mm256_sub_pd(_mm256_cvtepi32_pd(load4(y + i + 1)),
+                                         _mm256_cvtepi32_pd(load4(y + i)));
+        __m256d const l1 = _mm256_add_pd(_mm256_andnot_pd(sign_mask, dx),
+                                         _mm256_andnot_pd(sign_mask, dy));
+        auto mask = static_cast<unsigned int>(
+            _mm256_movemask_pd(_mm256_cmp_pd(l1, limit, _CMP_GE_OQ)));
+        for (uint32_t n = 0; mask != 0; ++n, mask >>= 1U) {
+            if (mask & 1U) {
+                result.push_back(static_cast<uint32_t>(i) + n);
+            }
+        }
+    }
+#elif defined(__SSE4_1__)
+    __m128d const sign_mask = _mm_set1_pd(-0.0);
+    __m128d const limit = _mm_set1_pd(min_l1);
+    for (; i + 3 <= size; i += 2) {
+        __m128d const dx = _mm_sub_pd(_mm_cvtepi32_pd(load2(x + i + 1)),
+                                      _mm_cvtepi32_pd(load2(x + i)));
+        __m128d const dy = _mm_sub_pd(_mm_cvtepi32_pd(load2(y + i + 1)),
+                                      _mm_cvtepi32_pd(load2(y + i)));
+        __m128d const l1 = _mm_add_pd(_mm_andnot_pd(sign_mask, dx),
+                                      _mm_andnot_pd(sign_mask, dy));
+        auto mask =
+            static_cast<unsigned int>(_mm_movemask_pd(_mm_cmpge_pd(l1, limit)));
+        for (uint32_t n = 0; mask != 0; ++n, mask >>= 1U) {
+            if (mask & 1U) {
+                result.push_back(static_cast<uint32_t>(i) + n);
+            }
+        }
+    }
+#endif
+
+    for (; i + 1 < size; ++i) {
+        double const dx = std::abs(static_cast<double>(x[i + 1]) - x[i]);
+        double const dy = std::abs(static_cast<double>(y[i + 1]) - y[i]);
+        if (dx + dy >= min_l1) {
+            result.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+/**
+ * Find all nodes i (not the first or last) where the angle between the
+ * segments to nodes i-1 and i+1 is smaller than the angle whose cosine is
+ * cos_max and append their indexes to the result vector. Angles where one
+ * of the segments has length 0 are always reported.
+ *
+ * Instead of calculating acos(a.b / (|a| |b|)) < max_angle for every node,
+ * this checks a.b >= 0 && (a.b)^2 >= cos(max_angle)^2 |a|^2 |b|^2 which
+ * doesn't need any square roots or trigonometric functions. A small margin
+ * is added to make sure rounding errors don't hide any candidates.
+ */
+inline void find_acute_angle_candidates(int32_t const *x, int32_t const *y,
+                                        std::size_t size, double cos_max,
+                                        std::vector<uint32_t> &result)
+{
+    if (size < 3) {
+        return;
+    }
+
+    std::size_t i = 1;
+
+    if (cos_max <= 0) {
+        // angles of 90 degrees or more, everything is a candidate
+        for (; i + 1 < size; ++i) {
+            result.push_back(static_cast<uint32_t>(i));
+        }
+        return;
+    }
+
+    double const k = cos_max * cos_max * (1.0 - 1.0e-6);
+
+#if defined(__AVX2__)
+    __m256d const zero = _mm256_setzero_pd();
+    __m256d const vk = _mm256_set1_pd(k);
+    for (; i + 5 <= size; i += 4) {
+        __m256d const xa = _mm256_cvtepi32_pd(load4(x + i - 1));
+        __m256d const ya = _mm256_cvtepi32_pd(load4(y + i - 1));
+        __m256d const xm = _mm256_cvtepi32_pd(load4(x + i));
+        __m256d const ym = _mm256_cvtepi32_pd(load4(y + i));
+        __m256d const xb = _mm256_cvtepi32_pd(load4(x + i + 1));
+        __m256d const yb = _mm256_cvtepi32_pd(load4(y + i + 1));
+        __m256d const dax = _mm256_sub_pd(xa, xm);
+        __m256d const day = _mm256_sub_pd(ya, ym);
+        __m256d const dbx = _mm256_sub_pd(xb, xm);
+        __m256d const dby = _mm256_sub_pd(yb, ym);
+        __m256d const dp =
+            _mm256_add_pd(_mm256_mul_pd(dax, dbx), _mm256_mul_pd(day, dby));
+        __m256d const ma =
+            _mm256_add_pd(_mm256_mul_pd(dax, dax), _mm256_mul_pd(day, day));
+        __m256d const mb =
+            _mm256_add_pd(_mm256_mul_pd(dbx, dbx), _mm256_mul_pd(dby, dby));
+        __m256d const lhs = _mm256_mul_pd(dp, dp);
+        __m256d const rhs = _mm256_mul_pd(vk, _mm256_mul_pd(ma, mb));
+        __m256d const cond =
+            _mm256_and_pd(_mm256_cmp_pd(dp, zero, _CMP_GE_OQ),
+                          _mm256_cmp_pd(lhs, rhs, _CMP_GE_OQ));
+        auto mask = static_cast<unsigned int>(_mm256_movemask_pd(cond));
+        for (uint32_t n = 0; mask != 0; ++n, mask >>= 1U) {
+            if (mask & 1U) {
+                result.push_back(static_cast<uint32_t>(i) + n);
+            }
+        }
+    }
+#elif defined(__SSE4_1__)
+    __m128d const zero = _mm_setzero_pd();
+    __m128d const vk = _mm_set1_pd(k);
+    for (; i + 3 <= size; i += 2) {
+        __m128d const xa = _mm_cvtepi32_pd(load2(x + i - 1));
+        __m128d const ya = _mm_cvtepi32_pd(load2(y + i - 1));
+        __m128d const xm = _mm_cvtepi32_pd(load2(x + i));
+        __m128d const ym = _mm_cvtepi32_pd(load2(y + i));
+        __m128d const xb = _mm_cvtepi32_pd(load2(x + i + 1));
+        __m128d const yb = _mm_cvtepi32_pd(load2(y + i + 1));
+        __m128d const dax = _mm_sub_pd(xa, xm);
+        __m128d const day = _mm_sub_pd(ya, ym);
+        __m128d const dbx = _mm_sub_pd(xb, xm);
+        __m128d const dby = _mm_sub_pd(yb, ym);
+        __m128d const dp =
+            _mm_add_pd(_mm_mul_pd(dax, dbx), _mm_mul_pd(day, dby));
+        __m128d const ma =
+            _mm_add_pd(_mm_mul_pd(dax, dax), _mm_mul_pd(day, day));
+        __m128d const mb =
+            _mm_add_pd(_mm_mul_pd(dbx, dbx), _mm_mul_pd(dby, dby));
+        __m128d const lhs = _mm_mul_pd(dp, dp);
+        __m128d const rhs = _mm_mul_pd(vk, _mm_mul_pd(ma, mb));
+        __m128d const cond =
+            _mm_and_pd(_mm_cmpge_pd(dp, zero), _mm_cmpge_pd(lhs, rhs));
+        auto mask = static_cast<unsigned int>(_mm_movemask_pd(cond));
+        for (uint32_t n = 0; mask != 0; ++n, mask >>= 1U) {
+            if (mask & 1U) {
+                result.push_back(static_cast<uint32_t>(i) + n);
+            }
+        }
+    }
+#endif
+
+    for (; i + 1 < size; ++i) {
+        double const dax = static_cast<double>(x[i - 1]) - x[i];
+        double const day = static_cast<double>(y[i - 1]) - y[i];
+        double const dbx = static_cast<double>(x[i + 1]) - x[i];
+        double const dby = static_cast<double>(y[i + 1]) - y[i];
+        double const dp = dax * dbx + day * dby;
+        double const ma = dax * dax + day * day;
+        double const mb = dbx * dbx + dby * dby;
+        if (dp >= 0 && dp * dp >= k * (ma * mb)) {
+            result.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+#endif // OSMIUM_SURPLUS_GEOM_KERNELS_HPP
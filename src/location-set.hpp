@@ -0,0 +1,105 @@
+#ifndef OSMIUM_SURPLUS_LOCATION_SET_HPP
+#define OSMIUM_SURPLUS_LOCATION_SET_HPP
+
+#include <osmium/osm/location.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Pack a location into a 64 bit integer sorting in the same order as the
+// location.
+inline uint64_t pack_location(osmium::Location location) noexcept
+{
+    constexpr uint32_t const sign_bit = 0x80000000U;
+    return (static_cast<uint64_t>(static_cast<uint32_t>(location.x()) ^
+                                  sign_bit)
+            << 32U) |
+           (static_cast<uint32_t>(location.y()) ^ sign_bit);
+}
+
+inline osmium::Location unpack_location(uint64_t value) noexcept
+{
+    constexpr uint32_t const sign_bit = 0x80000000U;
+    return osmium::Location{
+        static_cast<int32_t>(static_cast<uint32_t>(value >> 32U) ^ sign_bit),
+        static_cast<int32_t>(static_cast<uint32_t>(value) ^ sign_bit)};
+}
+
+// Multiplicative (Fibonacci) hash of a packed location. Use the highest
+// bits of the result.
+inline uint64_t hash_location(uint64_t value) noexcept
+{
+    return value * 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * A set of locations stored in a hash table with open addressing and linear
+ * probing. The table is at most half full, so a lookup usually needs only
+ * one cache line.
+ */
+class LocationSet
+{
+
+    // Marks an empty slot. It is the packed undefined location, which is
+    // tracked separately.
+    static constexpr uint64_t const empty_slot =
+        (static_cast<uint64_t>(0x7fffffffU ^ 0x80000000U) << 32U) |
+        (0x7fffffffU ^ 0x80000000U);
+
+    std::vector<uint64_t> m_table;
+
+    unsigned int m_shift = 63;
+
+    bool m_has_undefined = false;
+
+    [[nodiscard]] std::size_t slot(uint64_t value) const noexcept
+    {
+        return static_cast<std::size_t>(hash_location(value) >> m_shift);
+    }
+
+public:
+    explicit LocationSet(std::vector<osmium::Location> const &locations)
+    {
+        unsigned int bits = 1;
+        while ((std::size_t{1} << bits) < locations.size() * 2) {
+            ++bits;
+        }
+        m_shift = 64U - bits;
+        m_table.resize(std::size_t{1} << bits, empty_slot);
+
+        auto const mask = m_table.size() - 1;
+        for (auto const &location : locations) {
+            auto const value = pack_location(location);
+            if (value == empty_slot) {
+                m_has_undefined = true;
+                continue;
+            }
+            auto n = slot(value);
+            while (m_table[n] != empty_slot && m_table[n] != value) {
+                n = (n + 1) & mask;
+            }
+            m_table[n] = value;
+        }
+    }
+
+    [[nodiscard]] bool contains(osmium::Location location) const noexcept
+    {
+        auto const value = pack_location(location);
+        if (value == empty_slot) {
+            return m_has_undefined;
+        }
+
+        auto const mask = m_table.size() - 1;
+        for (auto n = slot(value); m_table[n] != empty_slot;
+             n = (n + 1) & mask) {
+            if (m_table[n] == value) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+}; // class LocationSet
+
+#endif // OSMIUM_SURPLUS_LOCATION_SET_HPP
@@ -0,0 +1,162 @@
+#ifndef OSMIUM_SURPLUS_MEMBER_WAY_STORE_HPP
+#define OSMIUM_SURPLUS_MEMBER_WAY_STORE_HPP
+
+#include "bucket.hpp"
+
+#include <osmium/osm/way.hpp>
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Append-only store for ways on disk. Ways are added with add() while
+ * reading the input file. After finish() the file is mapped into memory
+ * and get() returns pointers to the ways in the mapping. So the memory
+ * needed for the ways is taken from the page cache, only the index from
+ * way id to file offset is kept in memory.
+ *
+ * The file is removed when the store is destroyed.
+ */
+class MemberWayStore
+{
+
+    // size of the write buffer
+    constexpr static std::size_t const max_buffer_size = 1024UL * 1024UL;
+
+    struct index_entry
+    {
+        osmium::unsigned_object_id_type id;
+        std::size_t offset;
+
+        bool operator<(index_entry const &other) const noexcept
+        {
+            return id < other.id;
+        }
+    }; // struct index_entry
+
+    std::string m_filename;
+
+    std::vector<char> m_buffer;
+
+    std::vector<index_entry> m_index;
+
+    std::unique_ptr<osmium::util::MemoryMapping> m_mapping;
+
+    // number of bytes added to the store so far
+    std::size_t m_size = 0;
+
+    int m_fd;
+
+    bool m_sorted = true;
+
+    void flush()
+    {
+        write_to_bucket_file(m_fd, m_buffer.data(), m_buffer.size(),
+                             m_filename);
+        m_buffer.clear();
+    }
+
+public:
+    explicit MemberWayStore(std::string filename)
+    : m_filename(std::move(filename)),
+      m_fd(::open(m_filename.c_str(),
+                  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+                  O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))
+    {
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(),
+                                    std::string{"Can't open file '"} +
+                                        m_filename + "'"};
+        }
+        m_buffer.reserve(max_buffer_size);
+    }
+
+    MemberWayStore(MemberWayStore const &) = delete;
+    MemberWayStore &operator=(MemberWayStore const &) = delete;
+
+    MemberWayStore(MemberWayStore &&) = delete;
+    MemberWayStore &operator=(MemberWayStore &&) = delete;
+
+    ~MemberWayStore()
+    {
+        m_mapping.reset();
+        ::close(m_fd);
+        ::unlink(m_filename.c_str());
+    }
+
+    /// Add a copy of the way to the store.
+    void add(osmium::Way const &way)
+    {
+        if (!m_index.empty() && way.positive_id() < m_index.back().id) {
+            m_sorted = false;
+        }
+        m_index.push_back({way.positive_id(), m_size});
+
+        // Items are always padded to the alignment needed, so the next way
+        // will be properly aligned, too.
+        auto const *data = reinterpret_cast<char const *>(&way);
+        auto const size = way.padded_size();
+        if (m_buffer.size() + size > max_buffer_size) {
+            flush();
+        }
+        if (size > max_buffer_size) {
+            write_to_bucket_file(m_fd, data, size, m_filename);
+        } else {
+            m_buffer.insert(m_buffer.end(), data, data + size);
+        }
+        m_size += size;
+    }
+
+    /**
+     * Call this after all ways were added and before calling get(). Writes
+     * out the rest of the data and maps the file into memory.
+     */
+    void finish()
+    {
+        flush();
+        m_buffer.shrink_to_fit();
+
+        if (!m_sorted) {
+            std::sort(m_index.begin(), m_index.end());
+        }
+
+        if (m_size > 0) {
+            m_mapping = std::make_unique<osmium::util::MemoryMapping>(
+                m_size, osmium::util::MemoryMapping::mapping_mode::readonly,
+                m_fd);
+        }
+    }
+
+    /// Get the way with the specified id or nullptr if it isn't stored.
+    [[nodiscard]] osmium::Way const *
+    get(osmium::unsigned_object_id_type id) const noexcept
+    {
+        auto const it = std::lower_bound(m_index.cbegin(), m_index.cend(),
+                                         index_entry{id, 0});
+        if (it == m_index.cend() || it->id != id) {
+            return nullptr;
+        }
+        return reinterpret_cast<osmium::Way const *>(
+            m_mapping->get_addr<char>() + it->offset);
+    }
+
+    /// The number of ways in the store.
+    [[nodiscard]] std::size_t size() const noexcept { return m_index.size(); }
+
+    /// The number of bytes used by the ways in the store.
+    [[nodiscard]] std::size_t bytes() const noexcept { return m_size; }
+
+}; // class MemberWayStore
+
+#endif // OSMIUM_SURPLUS_MEMBER_WAY_STORE_HPP
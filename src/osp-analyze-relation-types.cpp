@@ -1,9 +1,11 @@
 
 #include "app.hpp"
 #include "db.hpp"
+#include "external-sort.hpp"
+#include "radix-sort.hpp"
 #include "util.hpp"
+#include "writer-multiplexer.hpp"
 
-#include <osmium/index/nwr_array.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
 #include <osmium/util/file.hpp>
@@ -22,10 +24,6 @@
 
 /* ========================================================================= */
 
-static constexpr const std::array<osmium::item_type, 3> nwr{
-    osmium::item_type::node, osmium::item_type::way,
-    osmium::item_type::relation};
-
 constexpr uint64_t const shift = 16;
 constexpr uint64_t const mask = (1ULL << shift) - 1;
 
@@ -45,12 +43,42 @@ static constexpr uint64_t combine(uint64_t id, uint64_t type) noexcept
     return (id << shift) | type;
 }
 
-static void sort_unique(std::vector<uint64_t> *vec)
+/**
+ * The packed ids and types of all objects to copy. Ways and relations are
+ * kept in memory, the node ids can be sorted on disk if there are too many.
+ */
+struct ids_type
 {
-    std::sort(vec->begin(), vec->end());
-    auto const last = std::unique(vec->begin(), vec->end());
-    vec->erase(last, vec->end());
-}
+    ExternalSorter nodes;
+    std::vector<uint64_t> ways;
+    std::vector<uint64_t> relations;
+
+    ids_type(std::string const &prefix, std::size_t max_node_ids,
+             int num_threads)
+    : nodes(prefix, max_node_ids, num_threads)
+    {}
+
+}; // struct ids_type
+
+/// Read sorted packed ids from a vector.
+class vector_cursor
+{
+
+    std::vector<uint64_t>::const_iterator m_it;
+    std::vector<uint64_t>::const_iterator m_end;
+
+public:
+    explicit vector_cursor(std::vector<uint64_t> const &data)
+    : m_it(data.cbegin()), m_end(data.cend())
+    {}
+
+    [[nodiscard]] bool empty() const noexcept { return m_it == m_end; }
+
+    [[nodiscard]] uint64_t value() const noexcept { return *m_it; }
+
+    void next() noexcept { ++m_it; }
+
+}; // class vector_cursor
 
 class TypeMap
 {
@@ -125,50 +153,61 @@ public:
 
 }; // class TypeMap
 
-static osmium::nwr_array<std::vector<uint64_t>>
-read_relations(osmium::io::File const &input_file, TypeMap *types)
+static void read_relations(osmium::io::File const &input_file,
+                           TypeMap *types, ids_type *ids, int num_threads)
 {
-    osmium::nwr_array<std::vector<uint64_t>> ids;
-
     osmium::io::Reader reader{input_file, osmium::osm_entity_bits::relation};
     while (auto const buffer = reader.read()) {
         for (auto const &relation : buffer.select<osmium::Relation>()) {
             std::size_t const n = types->add(relation.tags()["type"]);
-            ids.relations().push_back(combine(relation.positive_id(), n));
+            ids->relations.push_back(combine(relation.positive_id(), n));
             for (auto const &member : relation.members()) {
-                ids(member.type()).push_back(combine(member.positive_ref(), n));
+                auto const value = combine(member.positive_ref(), n);
+                switch (member.type()) {
+                case osmium::item_type::node:
+                    ids->nodes.push_back(value);
+                    break;
+                case osmium::item_type::way:
+                    ids->ways.push_back(value);
+                    break;
+                case osmium::item_type::relation:
+                    ids->relations.push_back(value);
+                    break;
+                default:
+                    break;
+                }
             }
         }
     }
     reader.close();
 
-    for (auto t : nwr) {
-        sort_unique(&ids(t));
-    }
-
-    return ids;
+    parallel_radix_sort_unique(ids->ways, num_threads);
+    parallel_radix_sort_unique(ids->relations, num_threads);
 }
 
-static void read_ways(osmium::io::File const &input_file,
-                      osmium::nwr_array<std::vector<uint64_t>> *ids)
+static void read_ways(osmium::io::File const &input_file, ids_type *ids)
 {
-    auto it = ids->ways().cbegin();
+    if (ids->ways.empty()) {
+        return;
+    }
+
+    auto it = ids->ways.cbegin();
     osmium::io::Reader reader{input_file, osmium::osm_entity_bits::way};
     while (auto const buffer = reader.read()) {
         for (auto const &way : buffer.select<osmium::Way>()) {
             while (get_id(*it) < way.positive_id()) {
                 ++it;
-                if (it == ids->ways().cend()) {
+                if (it == ids->ways.cend()) {
                     return;
                 }
             }
             while (get_id(*it) == way.positive_id()) {
                 auto const n = get_type(*it);
                 for (auto const &nr : way.nodes()) {
-                    ids->nodes().push_back(combine(nr.positive_ref(), n));
+                    ids->nodes.push_back(combine(nr.positive_ref(), n));
                 }
                 ++it;
-                if (it == ids->ways().cend()) {
+                if (it == ids->ways.cend()) {
                     return;
                 }
             }
@@ -176,42 +215,54 @@ static void read_ways(osmium::io::File const &input_file,
     }
 }
 
+/**
+ * Write the object to the outputs for all types found for it. The cursor
+ * must point to a sorted list of packed ids which is read in step with
+ * the (sorted) objects.
+ */
+template <typename TCursor>
+static void copy_object(TCursor &cursor, osmium::OSMObject const &object,
+                        WriterMultiplexer &writers)
+{
+    while (!cursor.empty() && get_id(cursor.value()) < object.positive_id()) {
+        cursor.next();
+    }
+    while (!cursor.empty() && get_id(cursor.value()) == object.positive_id()) {
+        auto const n = get_type(cursor.value());
+        assert(n < writers.size());
+        writers(n, object);
+        cursor.next();
+    }
+}
+
 static void copy_data(osmium::io::File const &input_file,
-                      std::vector<std::unique_ptr<osmium::io::Writer>> &writers,
-                      osmium::nwr_array<std::vector<uint64_t>> const &ids,
+                      WriterMultiplexer &writers, ids_type const &ids,
                       bool verbose)
 {
     osmium::io::Reader reader{input_file, osmium::io::buffers_type::single};
     osmium::ProgressBar progress_bar{reader.file_size(), verbose};
 
-    osmium::nwr_array<std::vector<uint64_t>::const_iterator> its;
-    its.nodes() = ids.nodes().cbegin();
-    its.ways() = ids.ways().cbegin();
-    its.relations() = ids.relations().cbegin();
+    auto node_cursor = ids.nodes.values();
+    vector_cursor way_cursor{ids.ways};
+    vector_cursor relation_cursor{ids.relations};
 
     while (auto const buffer = reader.read()) {
         progress_bar.update(reader.offset());
         for (auto const &object : buffer.select<osmium::OSMObject>()) {
-            auto const t = object.type();
-            if (its(t) != ids(t).cend()) {
-                while (get_id(*its(t)) < object.positive_id()) {
-                    ++its(t);
-                    if (its(t) == ids(t).cend()) {
-                        goto next_buffer;
-                    }
-                }
-                while (get_id(*its(t)) == object.positive_id()) {
-                    auto const n = get_type(*its(t));
-                    assert(n < writers.size());
-                    (*writers[n])(object);
-                    ++its(t);
-                    if (its(t) == ids(t).cend()) {
-                        goto next_buffer;
-                    }
-                }
+            switch (object.type()) {
+            case osmium::item_type::node:
+                copy_object(node_cursor, object, writers);
+                break;
+            case osmium::item_type::way:
+                copy_object(way_cursor, object, writers);
+                break;
+            case osmium::item_type::relation:
+                copy_object(relation_cursor, object, writers);
+                break;
+            default:
+                break;
             }
         }
-    next_buffer:;
     }
 
     reader.close();
@@ -222,11 +273,22 @@ static void copy_data(osmium::io::File const &input_file,
 
 class App : public BasicApp
 {
+    std::size_t m_max_memory = 0;
+    int m_num_threads = 1;
+
 public:
     App()
     : BasicApp("osp-analyze-relations-types",
                "Split input file based on relation types", with_output::dir)
-    {}
+    {
+        add_option("-m,--max-memory", m_max_memory,
+                   "Memory for sorting node ids in MBytes (default: no limit)")
+            ->type_name("MB");
+        add_option("-t,--threads", m_num_threads,
+                   "Number of threads used for sorting (default: 1)")
+            ->type_name("NUM")
+            ->check(CLI::PositiveNumber);
+    }
 
     void run()
     {
@@ -234,44 +296,48 @@ public:
 
         auto db = open_database(output() + "/relation-types.db", true);
 
+        // Sorting needs 16 bytes per node id (the id and scratch space).
+        auto const max_node_ids = m_max_memory * 1024UL * 1024UL / 16;
+        ids_type ids{output() + "/node-ids", max_node_ids, m_num_threads};
+
         TypeMap types;
         vout() << "Reading relations...\n";
-        auto ids = read_relations(input_file, &types);
+        read_relations(input_file, &types, &ids, m_num_threads);
         vout() << fmt::format("Found {:z} different type tags.\n",
                               types.size());
         types.insert_into_db(&db);
 
         vout() << "Reading ways...\n";
         read_ways(input_file, &ids);
-        sort_unique(&ids.nodes());
+        ids.nodes.finish();
 
-        vout() << fmt::format(
-            "Data to copy: {} nodes, {} ways, {} relations.\n",
-            ids.nodes().size(), ids.ways().size(), ids.relations().size());
+        if (ids.nodes.num_runs() == 0) {
+            vout() << fmt::format(
+                "Data to copy: {} nodes, {} ways, {} relations.\n",
+                ids.nodes.data().size(), ids.ways.size(),
+                ids.relations.size());
+        } else {
+            vout() << fmt::format(
+                "Data to copy: {} ways, {} relations, nodes are sorted on "
+                "disk in {} runs.\n",
+                ids.ways.size(), ids.relations.size(),
+                ids.nodes.num_runs() + 1);
+        }
 
-        std::vector<std::unique_ptr<osmium::io::Writer>> writers;
-        writers.reserve(types.size());
+        // There can be thousands of types, so they don't all get their
+        // own writer.
+        WriterMultiplexer writers;
         for (auto const &type : types) {
-            writers.emplace_back(std::make_unique<osmium::io::Writer>(
+            writers.add_output(osmium::io::File{
                 fmt::format("{}/{}.osm.pbf", output(),
-                            TypeMap::generate_filename(type.first)),
-                osmium::io::overwrite::allow));
+                            TypeMap::generate_filename(type.first))});
         }
 
-#if 0
-        for (auto t : nwr) {
-            for (auto v : ids(t)) {
-                fmt::print("{}{} {}\n", osmium::item_type_to_char(t), get_id(v),
-                           get_type(v));
-            }
-        }
-#endif
-
         vout() << "Copying data...\n";
         copy_data(input_file, writers, ids, vout().verbose());
-        for (auto &writer : writers) {
-            writer->close();
-        }
+
+        vout() << "Writing out files...\n";
+        writers.close();
     }
 }; // class App
 
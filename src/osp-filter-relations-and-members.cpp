@@ -1,8 +1,9 @@
 
 #include "app.hpp"
+#include "compressed-id-set.hpp"
+#include "referenced-ids.hpp"
 #include "util.hpp"
 
-#include <osmium/index/id_set.hpp>
 #include <osmium/index/nwr_array.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
@@ -10,10 +11,15 @@
 #include <osmium/util/progress_bar.hpp>
 #include <osmium/util/verbose_output.hpp>
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <exception>
+#include <numeric>
 #include <string>
+#include <vector>
 
 /* ========================================================================= */
 
@@ -21,22 +27,195 @@ constexpr static std::array<osmium::item_type, 3> const nwr{
     osmium::item_type::node, osmium::item_type::way,
     osmium::item_type::relation};
 
-using idset_type = osmium::index::IdSetDense<osmium::unsigned_object_id_type>;
+using idset_type = CompressedIdSet;
 
+/**
+ * The members of all relations, kept in memory so that the closure over
+ * nested relations can be computed without reading the relations again.
+ * Each member is packed into 8 bytes with the id in the upper bits and the
+ * type in the lowest two bits.
+ */
+class RelationMemberTable
+{
+
+    std::vector<osmium::unsigned_object_id_type> m_ids;
+
+    // position of the first member of each relation in m_members
+    std::vector<std::size_t> m_offsets{0};
+
+    std::vector<uint64_t> m_members;
+
+    // relations selected by the user, the closure starts from those
+    std::vector<bool> m_selected;
+
+    // indexes of the relations in order of their ids, only needed if the
+    // relations in the input file are not sorted
+    std::vector<std::size_t> m_order;
+
+    bool m_sorted = true;
+
+    // Returns the index of the relation with the id or m_ids.size() if it
+    // is not in the table.
+    [[nodiscard]] std::size_t
+    index_of(osmium::unsigned_object_id_type id) const noexcept
+    {
+        if (m_sorted) {
+            auto const it = std::lower_bound(m_ids.cbegin(), m_ids.cend(), id);
+            if (it == m_ids.cend() || *it != id) {
+                return m_ids.size();
+            }
+            return static_cast<std::size_t>(it - m_ids.cbegin());
+        }
+
+        auto const it = std::lower_bound(
+            m_order.cbegin(), m_order.cend(), id,
+            [&](std::size_t n, osmium::unsigned_object_id_type value) {
+                return m_ids[n] < value;
+            });
+        if (it == m_order.cend() || m_ids[*it] != id) {
+            return m_ids.size();
+        }
+        return *it;
+    }
+
+public:
+    void add(osmium::Relation const &relation, bool selected)
+    {
+        if (!m_ids.empty() && m_ids.back() >= relation.positive_id()) {
+            m_sorted = false;
+        }
+        m_ids.push_back(relation.positive_id());
+        m_selected.push_back(selected);
+        for (auto const &member : relation.members()) {
+            m_members.push_back(
+                (member.positive_ref() << 2U) |
+                osmium::item_type_to_nwr_index(member.type()));
+        }
+        m_offsets.push_back(m_members.size());
+    }
+
+    /// Call after all relations have been added.
+    void build()
+    {
+        if (m_sorted) {
+            return;
+        }
+        m_order.resize(m_ids.size());
+        std::iota(m_order.begin(), m_order.end(), 0);
+        std::stable_sort(m_order.begin(), m_order.end(),
+                         [&](std::size_t a, std::size_t b) {
+                             return m_ids[a] < m_ids[b];
+                         });
+    }
+
+    [[nodiscard]] std::size_t used_memory() const noexcept
+    {
+        return m_ids.capacity() * sizeof(osmium::unsigned_object_id_type) +
+               m_offsets.capacity() * sizeof(std::size_t) +
+               m_members.capacity() * sizeof(uint64_t) +
+               m_selected.capacity() / 8 +
+               m_order.capacity() * sizeof(std::size_t);
+    }
+
+    /**
+     * Set the ids of the selected relations and all their direct and
+     * indirect members. This works with a stack instead of recursion and
+     * visits every relation at most once, so it terminates even if there
+     * are cycles in the relation graph.
+     */
+    void add_closure(osmium::nwr_array<idset_type> *ids) const
+    {
+        std::vector<bool> visited(m_ids.size());
+        std::vector<std::size_t> stack;
+
+        for (std::size_t n = 0; n < m_ids.size(); ++n) {
+            if (m_selected[n]) {
+                visited[n] = true;
+                stack.push_back(n);
+                ids->relations().set(m_ids[n]);
+            }
+        }
+
+        while (!stack.empty()) {
+            auto const n = stack.back();
+            stack.pop_back();
+            for (auto i = m_offsets[n]; i < m_offsets[n + 1]; ++i) {
+                auto const type = osmium::nwr_index_to_item_type(
+                    static_cast<unsigned int>(m_members[i] & 0x3U));
+                auto const ref = m_members[i] >> 2U;
+                (*ids)(type).set(ref);
+                if (type != osmium::item_type::relation) {
+                    continue;
+                }
+                auto const child = index_of(ref);
+                if (child != m_ids.size() && !visited[child]) {
+                    visited[child] = true;
+                    stack.push_back(child);
+                }
+            }
+        }
+    }
+
+}; // class RelationMemberTable
+
+// If no types are given, all relations are selected. In that case the
+// closure is the same as the set of direct members of all relations, so no
+// member table is needed.
 static void read_relations(osmium::io::File const &input_file,
-                           osmium::nwr_array<idset_type> *ids)
+                           std::vector<std::string> const &types,
+                           osmium::nwr_array<idset_type> *ids,
+                           std::size_t *table_memory)
 {
     osmium::io::Reader reader{input_file, osmium::osm_entity_bits::relation};
 
-    while (auto const buffer = reader.read()) {
-        for (auto const &relation : buffer.select<osmium::Relation>()) {
-            for (auto const &member : relation.members()) {
-                (*ids)(member.type()).set(member.positive_ref());
+    if (types.empty()) {
+        while (auto const buffer = reader.read()) {
+            for (auto const &relation : buffer.select<osmium::Relation>()) {
+                for (auto const &member : relation.members()) {
+                    (*ids)(member.type()).set(member.positive_ref());
+                }
             }
         }
+        reader.close();
+        return;
     }
 
+    RelationMemberTable table;
+    while (auto const buffer = reader.read()) {
+        for (auto const &relation : buffer.select<osmium::Relation>()) {
+            char const *type = relation.tags()["type"];
+            table.add(relation, type && std::find(types.cbegin(), types.cend(),
+                                                  type) != types.cend());
+        }
+    }
     reader.close();
+
+    table.build();
+    table.add_closure(ids);
+    *table_memory = table.used_memory();
+}
+
+// Get the relation members from the cache of referenced ids, creating it if
+// it doesn't exist or is out of date.
+static void read_relations_from_cache(osmium::io::File const &input_file,
+                                      std::string const &cache_filename,
+                                      osmium::nwr_array<idset_type> *ids)
+{
+    ReferencedIds refs;
+    refs.load_or_create(input_file, cache_filename, 1);
+
+    refs.for_each(ref_set::member_nodes,
+                  [&](osmium::unsigned_object_id_type id) {
+                      ids->nodes().set(id);
+                  });
+    refs.for_each(ref_set::member_ways,
+                  [&](osmium::unsigned_object_id_type id) {
+                      ids->ways().set(id);
+                  });
+    refs.for_each(ref_set::member_relations,
+                  [&](osmium::unsigned_object_id_type id) {
+                      ids->relations().set(id);
+                  });
 }
 
 static void read_ways(osmium::io::File const &input_file,
@@ -61,21 +240,40 @@ static void read_ways(osmium::io::File const &input_file,
 
 class App : public BasicApp
 {
+    std::vector<std::string> m_types;
+    std::string m_ref_cache;
+
 public:
     App()
     : BasicApp("osp-filter-relations-and-members",
                "Filter relations and their members from OSM file",
                with_output::file)
-    {}
+    {
+        auto *const type_option =
+            add_option("-t,--type", m_types,
+                       "Only relations with this type tag (can be given "
+                       "multiple times)")
+                ->type_name("TYPE");
+        add_option("-r,--ref-cache", m_ref_cache,
+                   "Cache file for referenced ids")
+            ->type_name("FILE")
+            ->excludes(type_option);
+    }
 
     void run()
     {
         osmium::io::File const input_file{input()};
 
         osmium::nwr_array<idset_type> ids;
+        std::size_t table_memory = 0;
 
-        vout() << "Reading relations...\n";
-        read_relations(input_file, &ids);
+        if (m_ref_cache.empty()) {
+            vout() << "Reading relations...\n";
+            read_relations(input_file, m_types, &ids, &table_memory);
+        } else {
+            vout() << "Reading relation members from cache...\n";
+            read_relations_from_cache(input_file, m_ref_cache, &ids);
+        }
 
         vout() << "Reading ways...\n";
         read_ways(input_file, &ids);
@@ -93,7 +291,8 @@ public:
             progress_bar.update(reader.offset());
             for (auto const &object : buffer.select<osmium::OSMObject>()) {
                 ++counts_in(object.type());
-                if (object.type() == osmium::item_type::relation ||
+                if ((m_types.empty() &&
+                     object.type() == osmium::item_type::relation) ||
                     ids(object.type()).get(object.positive_id())) {
                     ++counts_out(object.type());
                     writer(object);
@@ -127,6 +326,11 @@ public:
                                   osmium::item_type_to_name(t),
                                   mbytes(ids(t).used_memory()));
         }
+        if (table_memory > 0) {
+            vout() << fmt::format(
+                "Memory used for relation member table: {} MBytes.\n",
+                mbytes(table_memory));
+        }
     }
 }; // class App
 
@@ -1,14 +1,20 @@
 
+#include "bucket.hpp"
+#include "location-set.hpp"
+#include "radix-sort.hpp"
 #include "utils.hpp"
 
 #include <gdalcpp.hpp>
 
+#include <osmium/geom/haversine.hpp>
+#include <osmium/geom/util.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/index/id_set.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
 #include <osmium/osm/location.hpp>
 #include <osmium/osm/timestamp.hpp>
+#include <osmium/thread/pool.hpp>
 #include <osmium/util/memory.hpp>
 #include <osmium/util/memory_mapping.hpp>
 #include <osmium/util/progress_bar.hpp>
@@ -16,12 +22,21 @@
 #include <osmium/visitor.hpp>
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <ctime>
+#include <deque>
+#include <future>
 #include <getopt.h>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <numeric>
 #include <string>
 #include <system_error>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 static char const *const program_name = "osp-find-colocated-nodes";
@@ -29,6 +44,9 @@ static char const *const program_name = "osp-find-colocated-nodes";
 struct options_type
 {
     osmium::Timestamp before_time{osmium::end_of_time()};
+    std::size_t max_memory = 1024; // in MBytes
+    double tolerance = 0.0; // in meters, 0: only exactly colocated nodes
+    int num_threads = 1;
     bool verbose = true;
 };
 
@@ -38,104 +56,462 @@ struct stats_type
     uint64_t colocated_nodes = 0;
     uint64_t ways_referencing_colocated_nodes = 0;
     uint64_t relations_referencing_colocated_nodes = 0;
+    uint64_t node_clusters = 0;
 };
 
 // must be a power of 2
-// must change build_filename() function if you change this
-constexpr unsigned int const num_buckets = 1U << 8U;
+// must change build_bucket_filename() function if you change this
+constexpr unsigned int const num_bucket_bits = 8;
+constexpr unsigned int const num_buckets = 1U << num_bucket_bits;
 
-std::string build_filename(std::string const &dirname, unsigned int n)
+static std::string build_filename(std::string const &dirname, unsigned int n)
 {
-    static char const *const lookup_hex = "0123456789abcdef";
-
-    std::string filename = dirname;
-    filename += "/locations_";
-    filename += lookup_hex[(n >> 4U) & 0xfU];
-    filename += lookup_hex[n & 0xfU];
-    filename += ".dat";
+    return build_bucket_filename(dirname, "locations", n);
+}
 
-    return filename;
+/**
+ * The bucket for a location. This uses a multiplicative hash of the whole
+ * location, because the lowest bits of the coordinates are not evenly
+ * distributed when nodes are on regular grids.
+ */
+static unsigned int bucket_of(osmium::Location location) noexcept
+{
+    return static_cast<unsigned int>(hash_location(pack_location(location)) >>
+                                     (64U - num_bucket_bits));
 }
 
-class Bucket
+/**
+ * Collects the locations of all nodes. They are kept in memory as long as
+ * they fit into the memory budget (including the scratch space needed for
+ * sorting them). The budget is checked against the capacity of the vector,
+ * not only its size. When the budget is exceeded, all locations are
+ * written out to bucket files instead.
+ */
+class LocationCollector
 {
-    // maximum size of bucket before it gets flushed
-    constexpr static int const max_bucket_size = 512 * 1024;
 
-    constexpr static int const open_flags =
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    std::vector<uint64_t> m_locations;
+
+    // must be destructed after the buckets
+    BackgroundWriter m_writer;
+
+    std::vector<Bucket<osmium::Location>> m_buckets;
+
+    std::vector<std::size_t> m_bucket_sizes;
 
-    std::vector<osmium::Location> m_data;
+    std::string m_directory;
+
+    std::size_t m_max_locations;
+
+    static constexpr std::size_t const min_capacity = 1024;
+
+    void spill()
+    {
+        m_buckets.reserve(num_buckets);
+        for (unsigned int i = 0; i < num_buckets; ++i) {
+            m_buckets.emplace_back(build_filename(m_directory, i), &m_writer);
+        }
 
-    std::string m_filename;
+        for (auto const value : m_locations) {
+            add_to_bucket(unpack_location(value));
+        }
+        std::vector<uint64_t>{}.swap(m_locations);
+    }
 
-    int m_fd;
+    void add_to_bucket(osmium::Location location)
+    {
+        m_buckets[bucket_of(location)].set(location);
+    }
 
 public:
-    Bucket(std::string const &dirname, unsigned int n)
-    : m_filename(build_filename(dirname, n)),
-      m_fd(::open(m_filename.c_str(), open_flags, 0666))
+    LocationCollector(std::string directory, std::size_t max_memory)
+    : m_directory(std::move(directory)),
+      m_max_locations(max_memory / (2 * sizeof(uint64_t)))
+    {}
+
+    void add(osmium::Location location)
     {
-        if (m_fd < 0) {
-            throw std::system_error{errno, std::system_category(),
-                                    std::string{"Can't open file '"} +
-                                        m_filename + "'"};
+        if (m_buckets.empty()) {
+            if (m_locations.size() < m_max_locations) {
+                // Grow the vector ourselves, so its capacity never gets
+                // larger than the budget.
+                if (m_locations.size() == m_locations.capacity()) {
+                    m_locations.reserve(std::min(
+                        std::max(m_locations.capacity() * 2, min_capacity),
+                        m_max_locations));
+                }
+                m_locations.push_back(pack_location(location));
+                return;
+            }
+            spill();
         }
-        m_data.reserve(max_bucket_size);
+        add_to_bucket(location);
     }
 
-    Bucket(Bucket const &) = delete;
-    Bucket &operator=(Bucket const &) = delete;
+    [[nodiscard]] bool in_memory() const noexcept { return m_buckets.empty(); }
 
-    Bucket(Bucket &&) = default;
-    Bucket &operator=(Bucket &&) = default;
+    std::vector<uint64_t> &locations() noexcept { return m_locations; }
 
-    ~Bucket()
+    void flush()
     {
-        try {
-            flush();
-        } catch (...) {
-            // ignore exceptions
+        for (auto &bucket : m_buckets) {
+            bucket.flush();
+            m_bucket_sizes.push_back(bucket.size());
         }
-        ::close(m_fd);
+        m_writer.wait();
+        m_buckets.clear();
     }
 
-    void set(osmium::Location const &location)
+    /// The number of locations in each bucket file (after flush()).
+    [[nodiscard]] std::vector<std::size_t> const &
+    bucket_sizes() const noexcept
     {
-        m_data.push_back(location);
-        if (m_data.size() == max_bucket_size) {
-            flush();
+        return m_bucket_sizes;
+    }
+
+}; // class LocationCollector
+
+void extract_locations(osmium::io::File const &input_file,
+                       LocationCollector &collector,
+                       options_type const &options)
+{
+    osmium::io::Reader reader{input_file, osmium::osm_entity_bits::node};
+    osmium::ProgressBar progress_bar{reader.file_size(), display_progress()};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        progress_bar.update(reader.offset());
+        for (auto const &node : buffer.select<osmium::Node>()) {
+            if (node.timestamp() < options.before_time) {
+                collector.add(node.location());
+            }
         }
     }
+    progress_bar.done();
+    reader.close();
 
-    void flush()
+    collector.flush();
+}
+
+// Find locations in the sorted data that appear more than once.
+std::vector<osmium::Location>
+find_locations_in_memory(std::vector<uint64_t> &data,
+                         options_type const &options)
+{
+    parallel_radix_sort(data, options.num_threads);
+
+    std::vector<osmium::Location> locations;
+
+    auto it = data.cbegin();
+    while ((it = std::adjacent_find(it, data.cend())) != data.cend()) {
+        locations.push_back(unpack_location(*it));
+        it = std::upper_bound(it, data.cend(), *it);
+    }
+
+    return locations;
+}
+
+// Find locations in a bucket file that appear more than once.
+static std::vector<osmium::Location>
+find_locations_in_bucket(std::string const &filename)
+{
+    std::vector<osmium::Location> locations;
+
+    process_bucket_file<osmium::Location>(filename, [&](auto &mapping) {
+        std::sort(mapping.begin(), mapping.end());
+
+        auto *it = mapping.begin();
+        while ((it = std::adjacent_find(it, mapping.end())) != mapping.end()) {
+            locations.push_back(*it);
+            ++it;
+            ++it;
+        }
+    });
+
+    return locations;
+}
+
+/**
+ * Call process(n) for all buckets and add() with each result in bucket
+ * order. With more than one thread the buckets are processed in parallel,
+ * but only as many at the same time as there are threads, so that only that
+ * many buckets have to be in memory.
+ */
+template <typename TProcess, typename TAdd>
+static void process_buckets(options_type const &options, TProcess &&process,
+                            TAdd &&add)
+{
+    if (options.num_threads == 1) {
+        for (unsigned int i = 0; i < num_buckets; ++i) {
+            add(process(i));
+        }
+        return;
+    }
+
+    osmium::thread::Pool pool{options.num_threads};
+    std::deque<std::future<decltype(process(0U))>> queue;
+    auto const max_queue_size = static_cast<std::size_t>(options.num_threads);
+
+    for (unsigned int i = 0; i < num_buckets; ++i) {
+        queue.push_back(pool.submit([&process, i]() { return process(i); }));
+        if (queue.size() > max_queue_size) {
+            add(queue.front().get());
+            queue.pop_front();
+        }
+    }
+
+    for (auto &future : queue) {
+        add(future.get());
+    }
+}
+
+std::vector<osmium::Location> find_locations(std::string const &directory,
+                                             options_type const &options)
+{
+    std::vector<osmium::Location> locations;
+
+    process_buckets(
+        options,
+        [&directory](unsigned int i) {
+            return find_locations_in_bucket(build_filename(directory, i));
+        },
+        [&](std::vector<osmium::Location> const &found) {
+            locations.insert(locations.end(), found.cbegin(), found.cend());
+        });
+
+    std::sort(locations.begin(), locations.end());
+    auto const last = std::unique(locations.begin(), locations.end());
+    locations.erase(last, locations.end());
+
+    return locations;
+}
+
+// Size of the tiles (in coordinate units, about 0.1 degrees) used to split
+// up the locations in the --tolerance mode. Locations near the border of a
+// tile are also added to the neighbouring tiles, so that all locations near
+// each other can be found in one tile.
+constexpr int64_t const near_tile_size = int64_t{1} << 20U;
+
+constexpr int64_t const near_tiles_x =
+    (int64_t{2} * 1800000000 + near_tile_size - 1) / near_tile_size;
+
+constexpr int64_t const near_tiles_y =
+    (int64_t{2} * 900000000 + near_tile_size - 1) / near_tile_size;
+
+// Tolerance range (in meters) allowed for the --tolerance option. The
+// maximum makes sure that the tolerance is much smaller than a tile even
+// near the poles and keeps the number of locations compared in dense areas
+// (and the size of the clusters) reasonable.
+constexpr double const min_tolerance = 0.01;
+constexpr double const max_tolerance = 10.0;
+
+// Above this latitude (in degrees) the tolerance in x direction doesn't
+// grow any more, so some locations near each other might not be found
+// there.
+constexpr double const max_near_latitude = 88.0;
+
+// Layout of the keys of near_record: 1 bit home flag, 23 bits tile, 20 bits
+// each for the cell y and x coordinates in the tile (plus one, because
+// locations copied from neighbouring tiles can be in cell -1).
+constexpr unsigned int const near_cell_bits = 20;
+constexpr unsigned int const near_tile_shift = 2 * near_cell_bits;
+constexpr uint64_t const near_home_flag = 1ULL << 63U;
+
+static_assert(near_tiles_x * near_tiles_y < (int64_t{1} << 23U),
+              "tiles must fit into 23 bits");
+
+/**
+ * A location in the --tolerance mode with the tile and grid cell in that
+ * tile it is in.
+ */
+struct near_record
+{
+    uint64_t key;
+    osmium::Location location;
+
+    [[nodiscard]] uint64_t cell() const noexcept
+    {
+        return key & ~near_home_flag;
+    }
+
+    [[nodiscard]] bool home() const noexcept
+    {
+        return (key & near_home_flag) != 0;
+    }
+
+    friend bool operator<(near_record const &a, near_record const &b) noexcept
+    {
+        return std::make_tuple(a.cell(), a.location) <
+               std::make_tuple(b.cell(), b.location);
+    }
+};
+
+// Two locations (packed) that are near each other.
+using near_edge = std::pair<uint64_t, uint64_t>;
+
+/**
+ * The grid used to find locations near each other. The world is divided
+ * into tiles, each tile into cells at least as large as the tolerance. So
+ * locations near each other are always in the same or neighbouring cells.
+ * Because the length of a degree of longitude gets shorter towards the
+ * poles, the cells are wider there.
+ */
+class NearGrid
+{
+
+    double m_tolerance;
+
+    // Tolerance in coordinate units in y direction.
+    int64_t m_tolerance_y;
+
+    // Width of the cells in coordinate units for each row of tiles. This
+    // is the tolerance in x direction for this row and the neighbouring
+    // rows, whichever is largest.
+    std::vector<int64_t> m_cell_width;
+
+    static double latitude_of(int64_t y) noexcept
+    {
+        return static_cast<double>(y - int64_t{900000000}) /
+               osmium::detail::coordinate_precision;
+    }
+
+    [[nodiscard]] int64_t cell_width(int64_t ty) const noexcept
     {
-        if (m_data.empty()) {
-            return;
+        return m_cell_width[static_cast<std::size_t>(ty)];
+    }
+
+    static int64_t cell_of(int64_t offset, int64_t size) noexcept
+    {
+        // floor division, offset can be negative
+        return (offset >= 0 ? offset : offset - size + 1) / size + 1;
+    }
+
+    [[nodiscard]] uint64_t key(osmium::Location location, int64_t tx,
+                               int64_t ty, bool home) const noexcept
+    {
+        int64_t const x = location.x() + int64_t{1800000000};
+        int64_t const y = location.y() + int64_t{900000000};
+        auto const cx = cell_of(x - tx * near_tile_size, cell_width(ty));
+        auto const cy = cell_of(y - ty * near_tile_size, m_tolerance_y);
+        auto const tile = ty * near_tiles_x + tx;
+
+        return (home ? near_home_flag : 0U) |
+               (static_cast<uint64_t>(tile) << near_tile_shift) |
+               (static_cast<uint64_t>(cy) << near_cell_bits) |
+               static_cast<uint64_t>(cx);
+    }
+
+public:
+    explicit NearGrid(double tolerance)
+    : m_tolerance(tolerance),
+      m_tolerance_y(std::max(
+          int64_t{2},
+          static_cast<int64_t>(std::ceil(
+              tolerance * osmium::detail::coordinate_precision /
+              (osmium::geom::haversine::EARTH_RADIUS_IN_METERS *
+               osmium::geom::PI / 180.0))))),
+      m_cell_width(static_cast<std::size_t>(near_tiles_y))
+    {
+        std::vector<int64_t> tolerance_x;
+        for (int64_t ty = 0; ty < near_tiles_y; ++ty) {
+            auto const lat = std::min(
+                max_near_latitude,
+                std::max(std::abs(latitude_of(ty * near_tile_size)),
+                         std::abs(latitude_of((ty + 1) * near_tile_size))));
+            tolerance_x.push_back(static_cast<int64_t>(
+                std::ceil(static_cast<double>(m_tolerance_y) /
+                          std::cos(osmium::geom::deg_to_rad(lat)))));
         }
 
-        auto const bytes = m_data.size() * sizeof(osmium::Location);
-        auto const length = ::write(m_fd, m_data.data(), bytes);
-        if (length != static_cast<long>(bytes)) { // NOLINT(google-runtime-int)
-            throw std::system_error{errno, std::system_category(),
-                                    std::string{"can't write to file '"} +
-                                        m_filename + "'"};
+        for (std::size_t ty = 0; ty < tolerance_x.size(); ++ty) {
+            auto width = tolerance_x[ty];
+            if (ty > 0) {
+                width = std::max(width, tolerance_x[ty - 1]);
+            }
+            if (ty + 1 < tolerance_x.size()) {
+                width = std::max(width, tolerance_x[ty + 1]);
+            }
+            m_cell_width[ty] = width;
         }
+    }
 
-        m_data.clear();
+    /**
+     * Call func with a near_record for the tile the location is in and for
+     * all neighbouring tiles it is near to.
+     */
+    template <typename TFunc>
+    void for_each_record(osmium::Location location, TFunc &&func) const
+    {
+        int64_t const x = location.x() + int64_t{1800000000};
+        int64_t const y = location.y() + int64_t{900000000};
+        auto const tx = std::min(x / near_tile_size, near_tiles_x - 1);
+        auto const ty = std::min(y / near_tile_size, near_tiles_y - 1);
+
+        int64_t const dy_min =
+            (ty > 0 && y - ty * near_tile_size < m_tolerance_y) ? -1 : 0;
+        int64_t const dy_max =
+            (ty < near_tiles_y - 1 &&
+             (ty + 1) * near_tile_size - y <= m_tolerance_y)
+                ? 1
+                : 0;
+
+        for (auto dy = dy_min; dy <= dy_max; ++dy) {
+            // The location is copied into the neighbouring tile if it is
+            // not more than a cell width of that tile away.
+            auto const width = cell_width(ty + dy);
+            int64_t const dx_min =
+                (tx > 0 && x - tx * near_tile_size < width) ? -1 : 0;
+            int64_t const dx_max =
+                (tx < near_tiles_x - 1 &&
+                 (tx + 1) * near_tile_size - x <= width)
+                    ? 1
+                    : 0;
+            for (auto dx = dx_min; dx <= dx_max; ++dx) {
+                func(near_record{key(location, tx + dx, ty + dy,
+                                     dx == 0 && dy == 0),
+                                 location});
+            }
+        }
     }
 
-}; // class Bucket
+    [[nodiscard]] bool is_near(osmium::Location a,
+                               osmium::Location b) const noexcept
+    {
+        return a == b ||
+               osmium::geom::haversine::distance(a, b) <= m_tolerance;
+    }
 
-void extract_locations(osmium::io::File const &input_file,
-                       std::string const &directory,
-                       options_type const &options)
+}; // class NearGrid
+
+// The bucket for a near_record. All records of a tile are in the same
+// bucket.
+static unsigned int bucket_of(near_record const &record) noexcept
 {
-    std::vector<Bucket> buckets;
+    return static_cast<unsigned int>(
+        hash_location(record.cell() >> near_tile_shift) >>
+        (64U - num_bucket_bits));
+}
+
+static std::string build_near_filename(std::string const &dirname,
+                                       unsigned int n)
+{
+    return build_bucket_filename(dirname, "near", n);
+}
+
+/**
+ * Read all node locations and write them (and their copies for
+ * neighbouring tiles) to the bucket files for the --tolerance mode.
+ * Returns the number of records in each bucket.
+ */
+std::vector<std::size_t> extract_near_locations(
+    osmium::io::File const &input_file, std::string const &directory,
+    NearGrid const &grid, options_type const &options)
+{
+    std::vector<std::size_t> sizes;
+
+    BackgroundWriter writer;
+    std::vector<Bucket<near_record>> buckets;
     buckets.reserve(num_buckets);
     for (unsigned int i = 0; i < num_buckets; ++i) {
-        buckets.emplace_back(directory, i);
+        buckets.emplace_back(build_near_filename(directory, i), &writer);
     }
 
     osmium::io::Reader reader{input_file, osmium::osm_entity_bits::node};
@@ -143,11 +519,12 @@ void extract_locations(osmium::io::File const &input_file,
     while (osmium::memory::Buffer buffer = reader.read()) {
         progress_bar.update(reader.offset());
         for (auto const &node : buffer.select<osmium::Node>()) {
-            if (node.timestamp() < options.before_time) {
-                auto const bucket_num =
-                    static_cast<uint32_t>(node.location().x()) &
-                    (num_buckets - 1);
-                buckets[bucket_num].set(node.location());
+            if (node.timestamp() < options.before_time &&
+                node.location().valid()) {
+                grid.for_each_record(
+                    node.location(), [&](near_record const &record) {
+                        buckets[bucket_of(record)].set(record);
+                    });
             }
         }
     }
@@ -156,48 +533,189 @@ void extract_locations(osmium::io::File const &input_file,
 
     for (auto &bucket : buckets) {
         bucket.flush();
+        sizes.push_back(bucket.size());
     }
+    writer.wait();
+
+    return sizes;
 }
 
-std::vector<osmium::Location> find_locations(std::string const &directory)
+/**
+ * Find the clusters of locations near each other in a bucket file. Only
+ * pairs with at least one location in its home tile are looked at, the
+ * others are found in another tile. Locations in the same cluster are
+ * joined with union-find, so the result has only one edge for each
+ * location in a cluster (from it to the first location of its cluster in
+ * this bucket), no matter how many locations are near each other.
+ * Identical locations are reported as a pair of the location with itself.
+ * Clusters found in different tiles are joined later through the
+ * locations they share.
+ */
+static std::vector<near_edge> find_near_in_bucket(std::string const &filename,
+                                                  NearGrid const &grid)
 {
-    std::vector<osmium::Location> locations;
-
-    for (unsigned int i = 0; i < num_buckets; ++i) {
-        auto const filename = build_filename(directory, i);
-        int const fd =
-            ::open(filename.c_str(),
-                   O_RDONLY | O_CLOEXEC); // NOLINT(hicpp-signed-bitwise)
-        if (fd < 0) {
-            throw std::system_error{errno, std::system_category(),
-                                    std::string{"Can't open file '"} +
-                                        filename + "'"};
+    std::vector<near_edge> edges;
+
+    process_bucket_file<near_record>(filename, [&](auto &mapping) {
+        std::sort(mapping.begin(), mapping.end());
+
+        // Merge records with the same location in the same tile.
+        std::vector<bool> in_cluster;
+        auto *end = mapping.begin();
+        for (auto *it = mapping.begin(); it != mapping.end();) {
+            auto *run_end = std::next(it);
+            while (run_end != mapping.end() &&
+                   run_end->cell() == it->cell() &&
+                   run_end->location == it->location) {
+                ++run_end;
+            }
+            in_cluster.push_back(std::distance(it, run_end) > 1 &&
+                                 it->home());
+            *end++ = *it;
+            it = run_end;
         }
-        auto const file_size = osmium::util::file_size(fd);
 
-        if (file_size > 0) {
-            osmium::util::TypedMemoryMapping<osmium::Location> m_mapping{
-                file_size / sizeof(osmium::Location),
-                osmium::util::MemoryMapping::mapping_mode::write_private, fd};
+        auto const index_of = [&](near_record const &record) {
+            return static_cast<uint32_t>(&record - mapping.begin());
+        };
+
+        // union-find on the records in this bucket
+        std::vector<uint32_t> parent(in_cluster.size());
+        std::iota(parent.begin(), parent.end(), 0);
+        auto const find_root = [&](uint32_t n) {
+            while (parent[n] != n) {
+                parent[n] = parent[parent[n]];
+                n = parent[n];
+            }
+            return n;
+        };
+
+        auto const check = [&](near_record const &a, near_record const &b) {
+            if ((a.home() || b.home()) &&
+                grid.is_near(a.location, b.location)) {
+                auto const ia = index_of(a);
+                auto const ib = index_of(b);
+                in_cluster[ia] = true;
+                in_cluster[ib] = true;
+                auto const ra = find_root(ia);
+                auto const rb = find_root(ib);
+                if (ra != rb) {
+                    parent[std::max(ra, rb)] = std::min(ra, rb);
+                }
+            }
+        };
+
+        // Compare each location with the locations in the same cell after
+        // it and in the cell to the right, and with the cells in the row
+        // above (to the left, same, and to the right). The records are
+        // sorted by cell, so the start of the cells above is only moving
+        // forward.
+        auto *above = mapping.begin();
+        for (auto *it = mapping.begin(); it != end; ++it) {
+            auto const cell = it->cell();
+
+            for (auto *other = std::next(it);
+                 other != end && other->cell() <= cell + 1; ++other) {
+                check(*it, *other);
+            }
 
-            std::sort(m_mapping.begin(), m_mapping.end());
+            auto const above_first = cell + (1ULL << near_cell_bits) - 1;
+            auto const above_last = cell + (1ULL << near_cell_bits) + 1;
+            while (above != end && above->cell() < above_first) {
+                ++above;
+            }
+            for (auto *other = above;
+                 other != end && other->cell() <= above_last; ++other) {
+                check(*it, *other);
+            }
+        }
 
-            auto *it = m_mapping.begin();
-            while ((it = std::adjacent_find(it, m_mapping.end())) !=
-                   m_mapping.end()) {
-                locations.push_back(*it);
-                ++it;
-                ++it;
+        for (uint32_t n = 0; n < in_cluster.size(); ++n) {
+            if (in_cluster[n]) {
+                edges.emplace_back(
+                    pack_location(mapping.begin()[n].location),
+                    pack_location(mapping.begin()[find_root(n)].location));
             }
         }
+    });
+
+    return edges;
+}
+
+/**
+ * Find all locations with other nodes at the same location or within the
+ * tolerance and group them into clusters of locations near each other.
+ * Returns the sorted locations, clusters contains the cluster number for
+ * each location.
+ */
+std::vector<osmium::Location>
+find_near_locations(std::string const &directory, NearGrid const &grid,
+                    options_type const &options,
+                    std::vector<uint32_t> &clusters)
+{
+    std::vector<near_edge> edges;
+    process_buckets(
+        options,
+        [&](unsigned int i) {
+            return find_near_in_bucket(build_near_filename(directory, i),
+                                       grid);
+        },
+        [&](std::vector<near_edge> const &found) {
+            edges.insert(edges.end(), found.cbegin(), found.cend());
+        });
+
+    std::vector<uint64_t> values;
+    values.reserve(edges.size() * 2);
+    for (auto const &edge : edges) {
+        values.push_back(edge.first);
+        values.push_back(edge.second);
+    }
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    auto const index_of = [&](uint64_t value) {
+        return static_cast<uint32_t>(
+            std::lower_bound(values.cbegin(), values.cend(), value) -
+            values.cbegin());
+    };
+
+    // union-find
+    std::vector<uint32_t> parent(values.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto const find_root = [&](uint32_t n) {
+        while (parent[n] != n) {
+            parent[n] = parent[parent[n]];
+            n = parent[n];
+        }
+        return n;
+    };
+    for (auto const &edge : edges) {
+        auto const a = find_root(index_of(edge.first));
+        auto const b = find_root(index_of(edge.second));
+        if (a != b) {
+            parent[std::max(a, b)] = std::min(a, b);
+        }
+    }
 
-        ::close(fd);
-        ::unlink(filename.c_str());
+    // Number the clusters in the order of their first location.
+    constexpr uint32_t const no_cluster = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> numbers(values.size(), no_cluster);
+    uint32_t num_clusters = 0;
+    clusters.clear();
+    clusters.reserve(values.size());
+    for (uint32_t n = 0; n < values.size(); ++n) {
+        auto const root = find_root(n);
+        if (numbers[root] == no_cluster) {
+            numbers[root] = num_clusters++;
+        }
+        clusters.push_back(numbers[root]);
     }
 
-    std::sort(locations.begin(), locations.end());
-    auto const last = std::unique(locations.begin(), locations.end());
-    locations.erase(last, locations.end());
+    std::vector<osmium::Location> locations;
+    locations.reserve(values.size());
+    for (auto const value : values) {
+        locations.push_back(unpack_location(value));
+    }
 
     return locations;
 }
@@ -208,29 +726,38 @@ class CheckHandler : public HandlerWithDB
     stats_type m_stats;
     gdalcpp::Layer m_layer_colocated_nodes;
     osmium::io::Writer &m_writer;
-    std::vector<osmium::Location> const &m_locations;
-    osmium::index::IdSetSmall<osmium::unsigned_object_id_type> m_node_ids;
-    bool m_nodes_done = false;
+    LocationSet m_locations;
+    std::vector<osmium::Location> const &m_location_list;
+    std::vector<uint32_t> const &m_clusters;
+    osmium::index::IdSetDense<osmium::unsigned_object_id_type> m_node_ids;
 
 public:
+    /**
+     * The locations must be sorted, clusters has the cluster number for
+     * each location.
+     */
     CheckHandler(std::string const &output_dirname, osmium::io::Writer *writer,
-                 std::vector<osmium::Location> const &locations)
+                 std::vector<osmium::Location> const &locations,
+                 std::vector<uint32_t> const &clusters)
     : HandlerWithDB(output_dirname + "/geoms-colocated-nodes.db"),
       m_layer_colocated_nodes(m_dataset, "colocated_nodes", wkbPoint,
                               {"SPATIAL_INDEX=NO"}),
-      m_writer(*writer), m_locations(locations)
+      m_writer(*writer), m_locations(locations), m_location_list(locations),
+      m_clusters(clusters)
     {
         m_layer_colocated_nodes.add_field("node_id", OFTReal, 12);
         m_layer_colocated_nodes.add_field("timestamp", OFTString, 20);
+        m_layer_colocated_nodes.add_field("cluster", OFTInteger, 10);
         m_stats.locations_with_colocated_nodes = locations.size();
+        if (!clusters.empty()) {
+            m_stats.node_clusters =
+                *std::max_element(clusters.cbegin(), clusters.cend()) + 1;
+        }
     }
 
     void node(osmium::Node const &node)
     {
-        auto const r = std::equal_range(m_locations.begin(), m_locations.end(),
-                                        node.location());
-
-        if (r.first != r.second) {
+        if (m_locations.contains(node.location())) {
             m_node_ids.set(node.positive_id());
             ++m_stats.colocated_nodes;
             m_writer(node);
@@ -239,19 +766,22 @@ public:
             feature.set_field("node_id", static_cast<double>(node.id()));
             auto const ts = node.timestamp().to_iso();
             feature.set_field("timestamp", ts.c_str());
+            auto const it =
+                std::lower_bound(m_location_list.cbegin(),
+                                 m_location_list.cend(), node.location());
+            feature.set_field(
+                "cluster",
+                static_cast<int32_t>(
+                    m_clusters[static_cast<std::size_t>(std::distance(
+                        m_location_list.cbegin(), it))]));
             feature.add_to_layer();
         }
     }
 
     void way(osmium::Way const &way)
     {
-        if (!m_nodes_done) {
-            m_nodes_done = true;
-            m_node_ids.sort_unique();
-        }
-
         for (auto const &node_ref : way.nodes()) {
-            if (m_node_ids.get_binary_search(node_ref.positive_ref())) {
+            if (m_node_ids.get(node_ref.positive_ref())) {
                 ++m_stats.ways_referencing_colocated_nodes;
                 m_writer(way);
                 break;
@@ -263,7 +793,7 @@ public:
     {
         for (auto const &member : relation.members()) {
             if (member.type() == osmium::item_type::node &&
-                m_node_ids.get_binary_search(member.positive_ref())) {
+                m_node_ids.get(member.positive_ref())) {
                 ++m_stats.relations_referencing_colocated_nodes;
                 m_writer(relation);
                 break;
@@ -287,7 +817,14 @@ static void print_help()
               << "                          this time (format: "
                  "yyyy-mm-ddThh:mm:ssZ)\n"
               << "  -h, --help              This help message\n"
-              << "  -q, --quiet             Work quietly\n";
+              << "  -m, --max-memory=MB     Sort locations in memory if they "
+                 "fit into\n"
+              << "                          this many MBytes (default: 1024)\n"
+              << "  -q, --quiet             Work quietly\n"
+              << "  -t, --threads=NUM       Number of threads used for "
+                 "sorting (default: 1)\n"
+              << "  -T, --tolerance=METERS  Also find nodes closer to each "
+                 "other than this\n";
 }
 
 static options_type parse_command_line(int argc, char *argv[])
@@ -296,13 +833,17 @@ static options_type parse_command_line(int argc, char *argv[])
         {"age", required_argument, nullptr, 'a'},
         {"before", required_argument, nullptr, 'b'},
         {"help", no_argument, nullptr, 'h'},
+        {"max-memory", required_argument, nullptr, 'm'},
         {"quiet", no_argument, nullptr, 'q'},
+        {"threads", required_argument, nullptr, 't'},
+        {"tolerance", required_argument, nullptr, 'T'},
         {nullptr, 0, nullptr, 0}};
 
     options_type options;
 
     while (true) {
-        int const c = getopt_long(argc, argv, "a:b:hq", long_options, nullptr);
+        int const c =
+            getopt_long(argc, argv, "a:b:hm:qt:T:", long_options, nullptr);
         if (c == -1) {
             break;
         }
@@ -327,9 +868,28 @@ static options_type parse_command_line(int argc, char *argv[])
         case 'h':
             print_help();
             std::exit(0);
+        case 'm':
+            options.max_memory = std::strtoul(optarg, nullptr, 10);
+            break;
         case 'q':
             options.verbose = false;
             break;
+        case 't':
+            options.num_threads = std::atoi(optarg);
+            if (options.num_threads < 1) {
+                std::cerr << "Number of threads must be at least 1\n";
+                std::exit(2);
+            }
+            break;
+        case 'T':
+            options.tolerance = std::atof(optarg);
+            if (options.tolerance < min_tolerance ||
+                options.tolerance > max_tolerance) {
+                std::cerr << "Tolerance must be between " << min_tolerance
+                          << " and " << max_tolerance << " meters\n";
+                std::exit(2);
+            }
+            break;
         default:
             std::exit(2);
         }
@@ -347,6 +907,22 @@ static options_type parse_command_line(int argc, char *argv[])
     return options;
 }
 
+static void print_bucket_sizes(osmium::util::VerboseOutput &vout,
+                               std::vector<std::size_t> const &sizes)
+{
+    auto const minmax = std::minmax_element(sizes.cbegin(), sizes.cend());
+    auto const average =
+        static_cast<double>(
+            std::accumulate(sizes.cbegin(), sizes.cend(), std::size_t{0})) /
+        static_cast<double>(sizes.size());
+    vout << "  Locations per bucket file: min " << *minmax.first << ", max "
+         << *minmax.second << ", average " << static_cast<std::size_t>(average)
+         << " (skew max/average "
+         << (average > 0 ? static_cast<double>(*minmax.second) / average
+                         : 1.0)
+         << ")\n";
+}
+
 int main(int argc, char *argv[])
 try {
     auto const options = parse_command_line(argc, argv);
@@ -368,6 +944,18 @@ try {
              << options.before_time
              << " (change with --age, -a or --before, -b)\n";
     }
+    vout << "  Sorting in memory up to " << options.max_memory
+         << " MBytes (change with --max-memory, -m)\n";
+    vout << "  Using " << options.num_threads
+         << " thread(s) for sorting (change with --threads, -t)\n";
+    if (options.tolerance > 0) {
+        vout << "  Also finding nodes closer than " << options.tolerance
+             << " meters to each other (change with --tolerance, -T)\n";
+    } else {
+        vout << "  Only finding nodes with the same location (change with "
+                "--tolerance, -T)\n";
+    }
+
     osmium::io::File const input_file{input_filename};
     osmium::io::File const output_file{output_dirname +
                                        "/colocated-nodes.osm.pbf"};
@@ -377,19 +965,53 @@ try {
     osmium::io::Writer writer{output_file, header,
                               osmium::io::overwrite::allow};
 
-    vout << "Extracting all locations...\n";
-    extract_locations(input_file, output_dirname, options);
+    std::vector<osmium::Location> locations;
+    std::vector<uint32_t> clusters;
+    if (options.tolerance > 0) {
+        NearGrid const grid{options.tolerance};
+
+        vout << "Extracting all locations...\n";
+        auto const sizes =
+            extract_near_locations(input_file, output_dirname, grid, options);
+        print_bucket_sizes(vout, sizes);
+
+        vout << "Finding locations near each other...\n";
+        locations =
+            find_near_locations(output_dirname, grid, options, clusters);
+        vout << "Found " << locations.size()
+             << " locations with nodes near each other.\n";
+    } else {
+        vout << "Extracting all locations...\n";
+        LocationCollector collector{output_dirname,
+                                    options.max_memory * 1024U * 1024U};
+        extract_locations(input_file, collector, options);
+
+        vout << "Finding locations with multiple nodes...\n";
+        if (collector.in_memory()) {
+            vout << "  Sorting " << collector.locations().size()
+                 << " locations in memory...\n";
+            locations =
+                find_locations_in_memory(collector.locations(), options);
+            std::vector<uint64_t>{}.swap(collector.locations());
+        } else {
+            print_bucket_sizes(vout, collector.bucket_sizes());
+            vout << "  Sorting locations in bucket files...\n";
+            locations = find_locations(output_dirname, options);
+        }
+        vout << "Found " << locations.size()
+             << " locations with multiple nodes.\n";
 
-    vout << "Finding locations with multiple nodes...\n";
-    auto const locations = find_locations(output_dirname);
-    vout << "Found " << locations.size() << " locations with multiple nodes.\n";
+        // each location is its own cluster
+        clusters.resize(locations.size());
+        std::iota(clusters.begin(), clusters.end(), 0);
+    }
 
     vout << "Copying colocated nodes and the ways/relations referencing "
             "them...\n";
     osmium::io::Reader reader{input_file, osmium::osm_entity_bits::nwr};
 
     LastTimestampHandler last_timestamp_handler;
-    CheckHandler handler{output_dirname, &writer, locations};
+    CheckHandler handler{output_dirname, &writer, locations, clusters};
 
     osmium::ProgressBar progress_bar{reader.file_size(), display_progress()};
     while (osmium::memory::Buffer buffer = reader.read()) {
@@ -412,6 +1034,10 @@ try {
                         handler.stats().ways_referencing_colocated_nodes);
                     add("relations_referencing_colocated_nodes",
                         handler.stats().relations_referencing_colocated_nodes);
+                    if (options.tolerance > 0) {
+                        add("near_node_clusters",
+                            handler.stats().node_clusters);
+                    }
                 });
 
     const osmium::MemoryUsage memory_usage;
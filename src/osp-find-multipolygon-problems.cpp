@@ -1,7 +1,10 @@
 
+#include "member-way-store.hpp"
 #include "outputs.hpp"
 #include "utils.hpp"
 
+#include <osmium/area/assembler.hpp>
+#include <osmium/area/problem_reporter.hpp>
 #include <osmium/index/id_set.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/file.hpp>
@@ -11,6 +14,7 @@
 #include <osmium/relations/relations_manager.hpp>
 #include <osmium/tags/taglist.hpp>
 #include <osmium/tags/tags_filter.hpp>
+#include <osmium/thread/pool.hpp>
 #include <osmium/util/file.hpp>
 #include <osmium/util/memory.hpp>
 #include <osmium/util/progress_bar.hpp>
@@ -18,12 +22,17 @@
 #include <osmium/visitor.hpp>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <future>
 #include <getopt.h>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 static char const *const program_name = "osp-find-multipolygon-problems";
@@ -31,6 +40,8 @@ static char const *const program_name = "osp-find-multipolygon-problems";
 struct options_type
 {
     bool verbose = true;
+    bool disk_store = false;
+    int num_threads = 1;
 };
 
 struct stats_type
@@ -55,6 +66,116 @@ struct MPFilter : public osmium::TagsFilter
 
 }; // struct MPFilter
 
+struct problem_point
+{
+    osmium::object_id_type node_id;
+    osmium::Location location;
+};
+
+/**
+ * The problems found when assembling the area from a multipolygon relation.
+ * The buffer contains the relation followed by its member ways.
+ */
+struct assembly_result
+{
+    osmium::memory::Buffer buffer;
+
+    std::vector<problem_point> open_ring_points;
+    std::vector<osmium::unsigned_object_id_type> open_ring_ways;
+
+    std::vector<problem_point> touching_ring_points;
+
+    std::vector<osmium::unsigned_object_id_type> role_mismatch_ways;
+
+    explicit assembly_result(osmium::memory::Buffer &&buf)
+    : buffer(std::move(buf))
+    {}
+
+    [[nodiscard]] osmium::Relation const &relation() const
+    {
+        return buffer.get<osmium::Relation>(0);
+    }
+
+}; // struct assembly_result
+
+/**
+ * Collects the problems reported by the area assembler we are interested
+ * in. All others are ignored.
+ */
+class ProblemCollector : public osmium::area::ProblemReporter
+{
+
+    assembly_result &m_result;
+
+public:
+    explicit ProblemCollector(assembly_result *result) : m_result(*result) {}
+
+    void report_touching_ring(osmium::object_id_type node_id,
+                              osmium::Location location) override
+    {
+        m_result.touching_ring_points.push_back({node_id, location});
+    }
+
+    void report_ring_not_closed(osmium::NodeRef const &nr,
+                                osmium::Way const *way) override
+    {
+        m_result.open_ring_points.push_back({nr.ref(), nr.location()});
+        if (way) {
+            m_result.open_ring_ways.push_back(way->positive_id());
+        }
+    }
+
+    void report_role_should_be_outer(osmium::object_id_type way_id,
+                                     osmium::Location /*seg_start*/,
+                                     osmium::Location /*seg_end*/) override
+    {
+        m_result.role_mismatch_ways.push_back(
+            static_cast<osmium::unsigned_object_id_type>(way_id));
+    }
+
+    void report_role_should_be_inner(osmium::object_id_type way_id,
+                                     osmium::Location /*seg_start*/,
+                                     osmium::Location /*seg_end*/) override
+    {
+        m_result.role_mismatch_ways.push_back(
+            static_cast<osmium::unsigned_object_id_type>(way_id));
+    }
+
+}; // class ProblemCollector
+
+/**
+ * Assemble the area from the relation and member ways in the buffer and
+ * collect the problems found. This is independent of any other relation
+ * and can run in a worker thread.
+ */
+static assembly_result assemble_multipolygon(osmium::memory::Buffer &&buffer)
+{
+    assembly_result result{std::move(buffer)};
+
+    std::vector<osmium::Way const *> ways;
+    for (auto const &way : result.buffer.select<osmium::Way>()) {
+        ways.push_back(&way);
+    }
+
+    ProblemCollector collector{&result};
+    osmium::area::AssemblerConfig config;
+    config.problem_reporter = &collector;
+    config.check_roles = true;
+
+    osmium::area::Assembler assembler{config};
+    osmium::memory::Buffer area_buffer{
+        1024, osmium::memory::Buffer::auto_grow::yes};
+    assembler(result.relation(), ways, area_buffer);
+
+    // Duplicate reports for the same way are possible.
+    for (auto *ids : {&result.open_ring_ways, &result.role_mismatch_ways}) {
+        std::sort(ids->begin(), ids->end());
+        ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+    }
+
+    return result;
+}
+
 class CheckMPManager
 : public osmium::relations::RelationsManager<CheckMPManager, true, true, true>
 {
@@ -64,6 +185,92 @@ class CheckMPManager
     stats_type m_stats;
     MPFilter m_filter;
 
+    // If set, the member ways are taken from here instead of from the
+    // RelationsManager.
+    MemberWayStore const *m_store = nullptr;
+
+    std::unique_ptr<osmium::thread::Pool> m_pool;
+
+    osmium::Way const *member_way(osmium::object_id_type id)
+    {
+        if (m_store) {
+            return m_store->get(
+                static_cast<osmium::unsigned_object_id_type>(id));
+        }
+        return this->get_member_way(id);
+    }
+
+    // Assemblies running in the pool in the order they were submitted.
+    std::deque<std::future<assembly_result>> m_queue;
+
+    void add_assembly_result(assembly_result const &result)
+    {
+        auto const &relation = result.relation();
+
+        if (!result.open_ring_points.empty()) {
+            auto &output = m_outputs["multipolygon_open_ring"];
+            output.add(relation, result.open_ring_points.size(),
+                       result.open_ring_ways);
+            for (auto const &point : result.open_ring_points) {
+                output.add_problem_point(relation, point.node_id,
+                                         point.location);
+            }
+        }
+
+        if (!result.touching_ring_points.empty()) {
+            auto &output = m_outputs["multipolygon_touching_ring"];
+            output.add(relation, result.touching_ring_points.size());
+            for (auto const &point : result.touching_ring_points) {
+                output.add_problem_point(relation, point.node_id,
+                                         point.location);
+            }
+        }
+
+        if (!result.role_mismatch_ways.empty()) {
+            m_outputs["multipolygon_role_mismatch"].add(
+                relation, result.role_mismatch_ways.size(),
+                result.role_mismatch_ways);
+        }
+    }
+
+    // Copy the relation and its member ways into a buffer and assemble the
+    // area, in the pool if there is one.
+    void assemble(osmium::Relation const &relation)
+    {
+        osmium::memory::Buffer buffer{
+            1024, osmium::memory::Buffer::auto_grow::yes};
+        buffer.add_item(relation);
+        buffer.commit();
+        for (auto const &member : relation.members()) {
+            if (member.type() == osmium::item_type::way &&
+                member.ref() != 0) {
+                buffer.add_item(*member_way(member.ref()));
+                buffer.commit();
+            }
+        }
+
+        if (!m_pool) {
+            add_assembly_result(assemble_multipolygon(std::move(buffer)));
+            return;
+        }
+
+        m_queue.push_back(m_pool->submit(
+            [b = std::move(buffer)]() mutable {
+                return assemble_multipolygon(std::move(b));
+            }));
+
+        // The queue limits the number of relations in flight.
+        auto const max_queue_size =
+            static_cast<std::size_t>(m_options.num_threads) * 4;
+        while (m_queue.size() > max_queue_size ||
+               (!m_queue.empty() &&
+                m_queue.front().wait_for(std::chrono::seconds(0)) ==
+                    std::future_status::ready)) {
+            add_assembly_result(m_queue.front().get());
+            m_queue.pop_front();
+        }
+    }
+
     [[nodiscard]] bool compare_tags(osmium::TagList const &rtags,
                                     osmium::TagList const &wtags) const
     {
@@ -104,7 +311,42 @@ class CheckMPManager
 public:
     CheckMPManager(Outputs *outputs, options_type const &options)
     : m_outputs(*outputs), m_options(options)
-    {}
+    {
+        if (options.num_threads > 1) {
+            m_pool = std::make_unique<osmium::thread::Pool>(
+                options.num_threads);
+        }
+    }
+
+    void set_member_way_store(MemberWayStore const *store) noexcept
+    {
+        m_store = store;
+    }
+
+    /**
+     * Used instead of the RelationsManager when the member ways are in a
+     * MemberWayStore. Relations with missing member ways are ignored like
+     * the RelationsManager does.
+     */
+    void complete_relation_from_store(osmium::Relation const &relation)
+    {
+        for (auto const &member : relation.members()) {
+            if (member.type() == osmium::item_type::way &&
+                !member_way(member.ref())) {
+                return;
+            }
+        }
+        complete_relation(relation);
+    }
+
+    /// Wait for all assemblies still running and add their results.
+    void finish()
+    {
+        for (auto &future : m_queue) {
+            add_assembly_result(future.get());
+        }
+        m_queue.clear();
+    }
 
     [[nodiscard]] stats_type const &stats() const noexcept { return m_stats; }
 
@@ -131,6 +373,8 @@ public:
 
     void complete_relation(osmium::Relation const &relation)
     {
+        assemble(relation);
+
         if (osmium::tags::match_none_of(relation.tags(), m_filter)) {
             ++m_stats.multipolygon_relations_without_tags;
             return;
@@ -140,7 +384,7 @@ public:
 
         for (auto const &member : relation.members()) {
             if (member.type() == osmium::item_type::way) {
-                auto const *way = this->get_member_way(member.ref());
+                auto const *way = member_way(member.ref());
                 if (compare_tags(relation.tags(), way->tags())) {
                     ++m_stats.multipolygon_relation_members_with_same_tags;
                     marks.push_back(way->positive_id());
@@ -149,6 +393,7 @@ public:
         }
 
         if (!marks.empty()) {
+            std::sort(marks.begin(), marks.end());
             m_outputs["multipolygon_relations_with_same_tags"].add(relation, 1,
                                                                    marks);
         }
@@ -161,31 +406,49 @@ static void print_help()
     std::cout << program_name << " [OPTIONS] OSM-FILE OUTPUT-DIR\n\n"
               << "Find multipolygons with problems.\n"
               << "\nOptions:\n"
+              << "  -d, --disk-store        Store member ways on disk instead "
+                 "of in memory\n"
               << "  -h, --help              This help message\n"
-              << "  -q, --quiet             Work quietly\n";
+              << "  -q, --quiet             Work quietly\n"
+              << "  -t, --threads=NUM       Number of threads used for "
+                 "assembling areas\n"
+              << "                          (default: 1)\n";
 }
 
 static options_type parse_command_line(int argc, char *argv[])
 {
-    static struct option long_options[] = {{"help", no_argument, nullptr, 'h'},
-                                           {"quiet", no_argument, nullptr, 'q'},
-                                           {nullptr, 0, nullptr, 0}};
+    static struct option long_options[] = {
+        {"disk-store", no_argument, nullptr, 'd'},
+        {"help", no_argument, nullptr, 'h'},
+        {"quiet", no_argument, nullptr, 'q'},
+        {"threads", required_argument, nullptr, 't'},
+        {nullptr, 0, nullptr, 0}};
 
     options_type options;
 
     while (true) {
-        int const c = getopt_long(argc, argv, "hq", long_options, nullptr);
+        int const c = getopt_long(argc, argv, "dhqt:", long_options, nullptr);
         if (c == -1) {
             break;
         }
 
         switch (c) {
+        case 'd':
+            options.disk_store = true;
+            break;
         case 'h':
             print_help();
             std::exit(0);
         case 'q':
             options.verbose = false;
             break;
+        case 't':
+            options.num_threads = std::atoi(optarg);
+            if (options.num_threads < 1) {
+                std::cerr << "Number of threads must be at least 1\n";
+                std::exit(2);
+            }
+            break;
         default:
             std::exit(2);
         }
@@ -203,6 +466,37 @@ static options_type parse_command_line(int argc, char *argv[])
     return options;
 }
 
+/**
+ * Read the multipolygon relations for use with a MemberWayStore. The
+ * relations are kept in the buffer, the ids of their member ways are
+ * stored in member_way_ids.
+ */
+static void read_relations_for_store(
+    osmium::io::File const &file, CheckMPManager *manager,
+    osmium::memory::Buffer *relations,
+    osmium::index::IdSetDense<osmium::unsigned_object_id_type> *member_way_ids)
+{
+    osmium::io::Reader reader{file, osmium::osm_entity_bits::relation};
+
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        for (auto const &relation : buffer.select<osmium::Relation>()) {
+            if (!manager->new_relation(relation)) {
+                continue;
+            }
+            relations->add_item(relation);
+            relations->commit();
+            std::size_t n = 0;
+            for (auto const &member : relation.members()) {
+                if (manager->new_member(relation, member, n++)) {
+                    member_way_ids->set(member.positive_ref());
+                }
+            }
+        }
+    }
+
+    reader.close();
+}
+
 static void write_data_files(std::string const &input_filename,
                              Outputs *outputs)
 {
@@ -236,12 +530,20 @@ try {
     vout << "Command line options:\n";
     vout << "  Reading from file '" << input_filename << "'\n";
     vout << "  Writing to directory '" << output_dirname << "'\n";
+    vout << "  Using " << options.num_threads
+         << " thread(s) for assembling areas (change with --threads, -t)\n";
+    vout << "  Storing member ways "
+         << (options.disk_store ? "on disk" : "in memory")
+         << " (change with --disk-store, -d)\n";
 
     osmium::io::Header header;
     header.set("generator", program_name);
 
     Outputs outputs{output_dirname, "geoms-multipolygon-problems", header};
     outputs.add_output("multipolygon_relations_with_same_tags", false, true);
+    outputs.add_output("multipolygon_open_ring", true, true);
+    outputs.add_output("multipolygon_touching_ring", true, true);
+    outputs.add_output("multipolygon_role_mismatch", false, true);
 
     LastTimestampHandler last_timestamp_handler;
 
@@ -252,7 +554,21 @@ try {
     CheckMPManager manager{&outputs, options};
 
     const osmium::io::File file{input_filename};
-    osmium::relations::read_relations(file, manager);
+
+    // Only used with --disk-store.
+    std::unique_ptr<MemberWayStore> store;
+    osmium::memory::Buffer relations;
+    osmium::index::IdSetDense<osmium::unsigned_object_id_type> member_way_ids;
+
+    if (options.disk_store) {
+        store = std::make_unique<MemberWayStore>(output_dirname +
+                                                 "/member-ways.tmp");
+        relations = osmium::memory::Buffer{
+            1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+        read_relations_for_store(file, &manager, &relations, &member_way_ids);
+    } else {
+        osmium::relations::read_relations(file, manager);
+    }
 
     vout << "Reading ways and checking for problems...\n";
     osmium::io::Reader reader{file, osmium::osm_entity_bits::way};
@@ -264,12 +580,39 @@ try {
 
     while (osmium::memory::Buffer buffer = reader.read()) {
         progress_bar.update(reader.offset());
-        osmium::apply(buffer, last_timestamp_handler, manager.handler());
+        if (store) {
+            osmium::apply(buffer, last_timestamp_handler);
+            for (auto const &way : buffer.select<osmium::Way>()) {
+                if (member_way_ids.get(way.positive_id())) {
+                    store->add(way);
+                }
+            }
+        } else {
+            osmium::apply(buffer, last_timestamp_handler, manager.handler());
+        }
     }
     progress_bar.file_done(file_size);
     progress_bar.done();
     reader.close();
 
+    if (store) {
+        store->finish();
+        vout << "Stored " << store->size() << " member ways ("
+             << store->bytes() / (1024 * 1024)
+             << " MBytes) on disk. Checking relations...\n";
+        manager.set_member_way_store(store.get());
+        for (auto const &relation : relations.select<osmium::Relation>()) {
+            manager.complete_relation_from_store(relation);
+        }
+    }
+    manager.finish();
+
+    if (store) {
+        manager.set_member_way_store(nullptr);
+        store.reset();
+        relations = osmium::memory::Buffer{};
+    }
+
     outputs.for_all([&](Output &output) {
         output.close_writer_rel(); // XXX
         output.prepare();
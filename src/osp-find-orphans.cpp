@@ -1,9 +1,9 @@
 
+#include "referenced-ids.hpp"
 #include "utils.hpp"
 
 #include <gdalcpp.hpp>
 
-#include <osmium/index/id_set.hpp>
 #include <osmium/index/nwr_array.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
@@ -30,6 +30,8 @@ struct options_type
     bool verbose = true;
     bool untagged = true;
     bool tagged = true;
+    std::string ref_cache;
+    int num_threads = 1;
 };
 
 struct stats_type
@@ -39,41 +41,6 @@ struct stats_type
     uint64_t orphan_relations = 0;
 };
 
-using id_set_type = osmium::index::IdSetDense<osmium::unsigned_object_id_type>;
-
-static osmium::nwr_array<id_set_type>
-create_index_of_referenced_objects(osmium::io::File const &input_file,
-                                   osmium::ProgressBar *progress_bar)
-{
-    osmium::nwr_array<id_set_type> index;
-
-    osmium::io::Reader reader{input_file,
-                              osmium::osm_entity_bits::way |
-                                  osmium::osm_entity_bits::relation};
-
-    while (osmium::memory::Buffer buffer = reader.read()) {
-        progress_bar->update(reader.offset());
-
-        for (auto const &object : buffer.select<osmium::OSMObject>()) {
-            if (object.type() == osmium::item_type::way) {
-                for (auto const &node_ref :
-                     static_cast<osmium::Way const &>(object).nodes()) {
-                    index(osmium::item_type::node).set(node_ref.positive_ref());
-                }
-            } else if (object.type() == osmium::item_type::relation) {
-                for (auto const &member :
-                     static_cast<osmium::Relation const &>(object).members()) {
-                    index(member.type()).set(member.positive_ref());
-                }
-            }
-        }
-    }
-
-    reader.close();
-
-    return index;
-}
-
 class CheckHandler : public HandlerWithDB
 {
 
@@ -85,12 +52,12 @@ class CheckHandler : public HandlerWithDB
 
     osmium::TagsFilter m_filter{false};
 
-    osmium::nwr_array<id_set_type> &m_index;
+    ReferencedIds const &m_index;
     osmium::nwr_array<std::unique_ptr<osmium::io::Writer>> m_writers;
 
 public:
     CheckHandler(std::string const &output_dirname, options_type const &options,
-                 osmium::nwr_array<id_set_type> *index)
+                 ReferencedIds const *index)
     : HandlerWithDB(output_dirname + "/geoms-orphans.db"), m_options(options),
       m_layer_orphan_nodes(m_dataset, "orphan_nodes", wkbPoint,
                            {"SPATIAL_INDEX=NO"}),
@@ -130,7 +97,7 @@ public:
             return;
         }
 
-        if (m_index(osmium::item_type::node).get(node.positive_id())) {
+        if (m_index.referenced(osmium::item_type::node, node.positive_id())) {
             return;
         }
 
@@ -154,7 +121,7 @@ public:
             return;
         }
 
-        if (m_index(osmium::item_type::way).get(way.positive_id())) {
+        if (m_index.referenced(osmium::item_type::way, way.positive_id())) {
             return;
         }
 
@@ -182,7 +149,8 @@ public:
             return;
         }
 
-        if (m_index(osmium::item_type::relation).get(relation.positive_id())) {
+        if (m_index.referenced(osmium::item_type::relation,
+                               relation.positive_id())) {
             return;
         }
 
@@ -220,6 +188,11 @@ static void print_help()
                  "yyyy-mm-ddThh:mm:ssZ)\n"
               << "  -h, --help              This help message\n"
               << "  -q, --quiet             Work quietly\n"
+              << "  -r, --ref-cache=FILE    Cache file for the index of "
+                 "referenced objects\n"
+              << "  -t, --threads=NUM       Number of threads used for "
+                 "creating the index\n"
+              << "                          (default: 1)\n"
               << "  -u, --untagged-only     Untagged objects only\n"
               << "  -U, --no-untagged       No untagged objects\n";
 }
@@ -231,6 +204,8 @@ static options_type parse_command_line(int argc, char *argv[])
         {"before", required_argument, nullptr, 'b'},
         {"help", no_argument, nullptr, 'h'},
         {"quiet", no_argument, nullptr, 'q'},
+        {"ref-cache", required_argument, nullptr, 'r'},
+        {"threads", required_argument, nullptr, 't'},
         {"untagged-only", no_argument, nullptr, 'u'},
         {"no-untagged", no_argument, nullptr, 'U'},
         {nullptr, 0, nullptr, 0}};
@@ -239,7 +214,7 @@ static options_type parse_command_line(int argc, char *argv[])
 
     while (true) {
         int const c =
-            getopt_long(argc, argv, "a:b:hquU", long_options, nullptr);
+            getopt_long(argc, argv, "a:b:hqr:t:uU", long_options, nullptr);
         if (c == -1) {
             break;
         }
@@ -267,6 +242,16 @@ static options_type parse_command_line(int argc, char *argv[])
         case 'q':
             options.verbose = false;
             break;
+        case 'r':
+            options.ref_cache = optarg;
+            break;
+        case 't':
+            options.num_threads = std::atoi(optarg);
+            if (options.num_threads < 1) {
+                std::cerr << "Number of threads must be at least 1\n";
+                std::exit(2);
+            }
+            break;
         case 'u':
             options.tagged = false;
             break;
@@ -321,6 +306,15 @@ try {
          << " (change with --untagged, -u)\n";
     vout << "  Finding tagged objects: " << (options.tagged ? "yes" : "no")
          << " (change with --no-untagged, -U)\n";
+    if (options.ref_cache.empty()) {
+        vout << "  Not using a cache file for the index (change with "
+                "--ref-cache, -r)\n";
+    } else {
+        vout << "  Using cache file '" << options.ref_cache
+             << "' for the index (change with --ref-cache, -r)\n";
+    }
+    vout << "  Using " << options.num_threads
+         << " thread(s) for creating the index (change with --threads, -t)\n";
 
     osmium::io::File const input_file{input_filename};
 
@@ -328,10 +322,15 @@ try {
     osmium::ProgressBar progress_bar{file_size * 2, display_progress()};
 
     vout << "First pass: Creating index of referenced objects...\n";
-    auto index = create_index_of_referenced_objects(input_file, &progress_bar);
+    ReferencedIds index;
+    bool const from_cache = index.load_or_create(
+        input_file, options.ref_cache, options.num_threads, &progress_bar);
     progress_bar.file_done(file_size);
 
     progress_bar.remove();
+    if (from_cache) {
+        vout << "  Loaded index from cache file.\n";
+    }
     vout << "Second pass: Writing out non-referenced and untagged objects...\n";
 
     LastTimestampHandler last_timestamp_handler;
@@ -1,5 +1,6 @@
 
 #include "outputs.hpp"
+#include "relation-graph.hpp"
 #include "utils.hpp"
 
 #include <osmium/index/id_set.hpp>
@@ -14,6 +15,8 @@
 #include <osmium/visitor.hpp>
 
 #include <algorithm>
+#include <array>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
@@ -24,10 +27,12 @@
 
 static char const *const program_name = "osp-find-relation-problems";
 static std::size_t const min_members_of_large_relations = 1000;
+static RelationGraph::index_type const max_relation_nesting_depth = 5;
 
 struct options_type
 {
     osmium::Timestamp before_time{osmium::end_of_time()};
+    int num_threads = 1;
     bool verbose = true;
 };
 
@@ -37,6 +42,70 @@ struct stats_type
     uint64_t relation_members = 0;
 };
 
+/// All outputs, in the same order as in output_defs.
+enum class output_id : std::size_t
+{
+    relation_no_members,
+    relation_no_tag,
+    relation_only_type_tag,
+    relation_no_type_tag,
+    relation_large,
+    relation_references_self,
+    relation_cycle,
+    relation_deep_nesting,
+    relation_unreachable,
+    multipolygon_node_member,
+    multipolygon_relation_member,
+    multipolygon_unknown_role,
+    multipolygon_empty_role,
+    multipolygon_area_tag,
+    multipolygon_boundary_administrative_tag,
+    multipolygon_boundary_other_tag,
+    multipolygon_old_style,
+    multipolygon_single_way,
+    multipolygon_duplicate_way,
+    boundary_empty_role,
+    boundary_duplicate_way,
+    boundary_area_tag,
+    boundary_no_boundary_tag,
+    num_outputs
+};
+
+struct output_def
+{
+    char const *name;
+    bool points;
+    bool lines;
+};
+
+constexpr static std::array<output_def,
+                            static_cast<std::size_t>(output_id::num_outputs)>
+    output_defs{{
+        {"relation_no_members", false, false},
+        {"relation_no_tag", true, true},
+        {"relation_only_type_tag", true, true},
+        {"relation_no_type_tag", true, true},
+        {"relation_large", true, true},
+        {"relation_references_self", true, true},
+        {"relation_cycle", false, false},
+        {"relation_deep_nesting", false, false},
+        {"relation_unreachable", false, false},
+        {"multipolygon_node_member", true, false},
+        {"multipolygon_relation_member", false, false},
+        {"multipolygon_unknown_role", false, true},
+        {"multipolygon_empty_role", false, true},
+        {"multipolygon_area_tag", false, true},
+        {"multipolygon_boundary_administrative_tag", false, true},
+        {"multipolygon_boundary_other_tag", false, true},
+        {"multipolygon_old_style", false, false},
+        {"multipolygon_single_way", false, true},
+        {"multipolygon_duplicate_way", false, true},
+        {"boundary_empty_role", false, true},
+        {"boundary_duplicate_way", false, true},
+        {"boundary_area_tag", false, true},
+        {"boundary_no_boundary_tag", false, true},
+    }};
+
 struct MPFilter : public osmium::TagsFilter
 {
 
@@ -57,31 +126,42 @@ class CheckHandler : public osmium::handler::Handler
     options_type m_options;
     stats_type m_stats;
     MPFilter m_mp_filter;
+    RelationGraph m_graph;
+
+    // Reused for all relations to avoid allocations.
+    std::vector<osmium::unsigned_object_id_type> m_way_ids;
+    std::vector<osmium::unsigned_object_id_type> m_duplicate_ids;
+
+    Output &output(output_id id) noexcept
+    {
+        return m_outputs[static_cast<std::size_t>(id)];
+    }
 
-    static std::vector<osmium::unsigned_object_id_type>
+    // Find ways that are members of the relation more than once. The
+    // result (sorted) is in m_duplicate_ids.
+    std::vector<osmium::unsigned_object_id_type> const &
     find_duplicate_ways(osmium::Relation const &relation)
     {
-        std::vector<osmium::unsigned_object_id_type> duplicate_ids;
+        m_duplicate_ids.clear();
 
-        std::vector<osmium::unsigned_object_id_type> way_ids;
-        way_ids.reserve(relation.members().size());
+        m_way_ids.clear();
         for (auto const &member : relation.members()) {
             if (member.type() == osmium::item_type::way) {
-                way_ids.push_back(member.positive_ref());
+                m_way_ids.push_back(member.positive_ref());
             }
         }
-        std::sort(way_ids.begin(), way_ids.end());
+        std::sort(m_way_ids.begin(), m_way_ids.end());
 
-        auto it = way_ids.begin();
-        while (it != way_ids.end()) {
-            it = std::adjacent_find(it, way_ids.end());
-            if (it != way_ids.end()) {
-                duplicate_ids.push_back(*it);
+        auto it = m_way_ids.begin();
+        while (it != m_way_ids.end()) {
+            it = std::adjacent_find(it, m_way_ids.end());
+            if (it != m_way_ids.end()) {
+                m_duplicate_ids.push_back(*it);
                 ++it;
             }
         }
 
-        return duplicate_ids;
+        return m_duplicate_ids;
     }
 
     void multipolygon_relation(osmium::Relation const &relation)
@@ -117,52 +197,56 @@ class CheckHandler : public osmium::handler::Handler
         }
 
         if (node_member != 0U) {
-            m_outputs["multipolygon_node_member"].add(relation, node_member);
+            output(output_id::multipolygon_node_member)
+                .add(relation, node_member);
         }
 
         if (relation_member != 0U) {
-            m_outputs["multipolygon_relation_member"].add(relation,
-                                                          relation_member);
+            output(output_id::multipolygon_relation_member)
+                .add(relation, relation_member);
         }
 
         if (unknown_role != 0U) {
-            m_outputs["multipolygon_unknown_role"].add(relation, unknown_role);
+            output(output_id::multipolygon_unknown_role)
+                .add(relation, unknown_role);
         }
 
         if (empty_role != 0U) {
-            m_outputs["multipolygon_empty_role"].add(relation, empty_role);
+            output(output_id::multipolygon_empty_role)
+                .add(relation, empty_role);
         }
 
         if (relation.members().size() == 1 &&
             relation.members().cbegin()->type() == osmium::item_type::way) {
-            m_outputs["multipolygon_single_way"].add(relation);
+            output(output_id::multipolygon_single_way).add(relation);
         }
 
-        auto const duplicates = find_duplicate_ways(relation);
+        auto const &duplicates = find_duplicate_ways(relation);
         if (!duplicates.empty()) {
-            m_outputs["multipolygon_duplicate_way"].add(relation, 1,
-                                                        duplicates);
+            output(output_id::multipolygon_duplicate_way)
+                .add(relation, 1, duplicates);
         }
 
         if (relation.tags().size() == 1 ||
             std::none_of(relation.tags().cbegin(), relation.tags().cend(),
                          std::cref(m_mp_filter))) {
-            m_outputs["multipolygon_old_style"].add(relation);
+            output(output_id::multipolygon_old_style).add(relation);
             return;
         }
 
         char const *area = relation.tags().get_value_by_key("area");
         if (area) {
-            m_outputs["multipolygon_area_tag"].add(relation);
+            output(output_id::multipolygon_area_tag).add(relation);
         }
 
         char const *boundary = relation.tags().get_value_by_key("boundary");
         if (boundary) {
             if (!std::strcmp(boundary, "administrative")) {
-                m_outputs["multipolygon_boundary_administrative_tag"].add(
-                    relation);
+                output(output_id::multipolygon_boundary_administrative_tag)
+                    .add(relation);
             } else {
-                m_outputs["multipolygon_boundary_other_tag"].add(relation);
+                output(output_id::multipolygon_boundary_other_tag)
+                    .add(relation);
             }
         }
     }
@@ -180,23 +264,24 @@ class CheckHandler : public osmium::handler::Handler
             }
         }
         if (empty_role != 0U) {
-            m_outputs["boundary_empty_role"].add(relation, empty_role);
+            output(output_id::boundary_empty_role).add(relation, empty_role);
         }
 
-        const auto duplicates = find_duplicate_ways(relation);
+        const auto &duplicates = find_duplicate_ways(relation);
         if (!duplicates.empty()) {
-            m_outputs["boundary_duplicate_way"].add(relation, 1, duplicates);
+            output(output_id::boundary_duplicate_way)
+                .add(relation, 1, duplicates);
         }
 
         const char *area = relation.tags().get_value_by_key("area");
         if (area) {
-            m_outputs["boundary_area_tag"].add(relation);
+            output(output_id::boundary_area_tag).add(relation);
         }
 
         // is boundary:historic or historic:boundary also okay?
         const char *boundary = relation.tags().get_value_by_key("boundary");
         if (!boundary) {
-            m_outputs["boundary_no_boundary_tag"].add(relation);
+            output(output_id::boundary_no_boundary_tag).add(relation);
         }
     }
 
@@ -224,31 +309,33 @@ public:
         ++m_stats.relations;
         m_stats.relation_members += relation.members().size();
 
+        m_graph.add_relation(relation);
+
         if (relation.members().empty()) {
-            m_outputs["relation_no_members"].add(relation);
+            output(output_id::relation_no_members).add(relation);
         }
 
         if (relation.members().size() >= min_members_of_large_relations) {
-            m_outputs["relation_large"].add(relation);
+            output(output_id::relation_large).add(relation);
         }
 
         if (relation.tags().empty()) {
-            m_outputs["relation_no_tag"].add(relation);
+            output(output_id::relation_no_tag).add(relation);
             return;
         }
 
         char const *type = relation.tags().get_value_by_key("type");
         if (!type) {
-            m_outputs["relation_no_type_tag"].add(relation);
+            output(output_id::relation_no_type_tag).add(relation);
             return;
         }
 
         if (relation.tags().size() == 1) {
-            m_outputs["relation_only_type_tag"].add(relation);
+            output(output_id::relation_only_type_tag).add(relation);
         }
 
         if (check_self_ref(relation)) {
-            m_outputs["relation_references_self"].add(relation);
+            output(output_id::relation_references_self).add(relation);
         }
 
         if (!std::strcmp(type, "multipolygon")) {
@@ -260,6 +347,8 @@ public:
 
     [[nodiscard]] stats_type const &stats() const noexcept { return m_stats; }
 
+    RelationGraph &graph() noexcept { return m_graph; }
+
     void close()
     {
         m_outputs.for_all([](Output &output) { output.close_writer_rel(); });
@@ -279,7 +368,10 @@ static void print_help()
               << "                          this time (format: "
                  "yyyy-mm-ddThh:mm:ssZ)\n"
               << "  -h, --help              This help message\n"
-              << "  -q, --quiet             Work quietly\n";
+              << "  -q, --quiet             Work quietly\n"
+              << "  -t, --threads=NUM       Number of threads used for "
+                 "building the\n"
+              << "                          relation graph (default: 1)\n";
 }
 
 static options_type parse_command_line(int argc, char *argv[])
@@ -289,12 +381,14 @@ static options_type parse_command_line(int argc, char *argv[])
         {"before", required_argument, nullptr, 'b'},
         {"help", no_argument, nullptr, 'h'},
         {"quiet", no_argument, nullptr, 'q'},
+        {"threads", required_argument, nullptr, 't'},
         {nullptr, 0, nullptr, 0}};
 
     options_type options;
 
     while (true) {
-        int const c = getopt_long(argc, argv, "a:b:hq", long_options, nullptr);
+        int const c =
+            getopt_long(argc, argv, "a:b:hqt:", long_options, nullptr);
         if (c == -1) {
             break;
         }
@@ -322,6 +416,13 @@ static options_type parse_command_line(int argc, char *argv[])
         case 'q':
             options.verbose = false;
             break;
+        case 't':
+            options.num_threads = std::atoi(optarg);
+            if (options.num_threads < 1) {
+                std::cerr << "Number of threads must be at least 1\n";
+                std::exit(2);
+            }
+            break;
         default:
             std::exit(2);
         }
@@ -339,6 +440,53 @@ static options_type parse_command_line(int argc, char *argv[])
     return options;
 }
 
+/**
+ * Read the relations again and add those with problems found in the
+ * relation graph to the outputs.
+ */
+static void add_graph_problems(osmium::io::File const &file,
+                               options_type const &options,
+                               RelationGraph const &graph,
+                               relation_graph_analysis const &analysis,
+                               Outputs *outputs)
+{
+    auto const output = [&](output_id id) -> Output & {
+        return (*outputs)[static_cast<std::size_t>(id)];
+    };
+
+    osmium::io::Reader reader{file, osmium::osm_entity_bits::relation};
+    osmium::ProgressBar progress_bar{reader.file_size(), display_progress()};
+
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        progress_bar.update(reader.offset());
+        for (auto const &relation : buffer.select<osmium::Relation>()) {
+            if (relation.timestamp() >= options.before_time) {
+                continue;
+            }
+
+            auto const v = graph.index_of(relation.positive_id());
+            if (v == RelationGraph::invalid_index) {
+                continue;
+            }
+
+            if (analysis.in_cycle[v]) {
+                output(output_id::relation_cycle).add(relation);
+            }
+
+            if (analysis.depth[v] > max_relation_nesting_depth) {
+                output(output_id::relation_deep_nesting).add(relation);
+            }
+
+            if (analysis.unreachable[v]) {
+                output(output_id::relation_unreachable).add(relation);
+            }
+        }
+    }
+
+    progress_bar.done();
+    reader.close();
+}
+
 static void write_data_files(std::string const &input_filename,
                              Outputs *outputs)
 {
@@ -380,6 +528,9 @@ try {
              << options.before_time
              << " (change with --age, -a or --before, -b)\n";
     }
+    vout << "  Using " << options.num_threads
+         << " thread(s) for building the relation graph (change with "
+            "--threads, -t)\n";
 
     const osmium::io::File file{input_filename};
     osmium::io::Reader reader{file, osmium::osm_entity_bits::relation};
@@ -393,26 +544,9 @@ try {
     header.set("generator", program_name);
 
     Outputs outputs{output_dirname, "geoms-relation-problems", header};
-    outputs.add_output("relation_no_members", false, false);
-    outputs.add_output("relation_no_tag");
-    outputs.add_output("relation_only_type_tag");
-    outputs.add_output("relation_no_type_tag");
-    outputs.add_output("relation_large");
-    outputs.add_output("relation_references_self");
-    outputs.add_output("multipolygon_node_member", true, false);
-    outputs.add_output("multipolygon_relation_member", false, false);
-    outputs.add_output("multipolygon_unknown_role", false, true);
-    outputs.add_output("multipolygon_empty_role", false, true);
-    outputs.add_output("multipolygon_area_tag", false, true);
-    outputs.add_output("multipolygon_boundary_administrative_tag", false, true);
-    outputs.add_output("multipolygon_boundary_other_tag", false, true);
-    outputs.add_output("multipolygon_old_style", false, false);
-    outputs.add_output("multipolygon_single_way", false, true);
-    outputs.add_output("multipolygon_duplicate_way", false, true);
-    outputs.add_output("boundary_empty_role", false, true);
-    outputs.add_output("boundary_duplicate_way", false, true);
-    outputs.add_output("boundary_area_tag", false, true);
-    outputs.add_output("boundary_no_boundary_tag", false, true);
+    for (auto const &def : output_defs) {
+        outputs.add_output(def.name, def.points, def.lines);
+    }
 
     LastTimestampHandler last_timestamp_handler;
     CheckHandler handler{&outputs, options};
@@ -426,6 +560,27 @@ try {
     progress_bar.done();
     reader.close();
 
+    vout << "Building relation graph...\n";
+    auto &graph = handler.graph();
+    graph.build(options.num_threads);
+    vout << "  Graph has " << graph.num_vertices() << " relations and "
+         << graph.num_edges() << " relation members.\n";
+
+    vout << "Checking relation graph for cycles and deep nesting...\n";
+    auto const analysis = analyze_graph(graph);
+
+    auto const has_problems = [](std::vector<bool> const &flags) {
+        return std::find(flags.cbegin(), flags.cend(), true) != flags.cend();
+    };
+    if (has_problems(analysis.in_cycle) || has_problems(analysis.unreachable) ||
+        std::any_of(analysis.depth.cbegin(), analysis.depth.cend(),
+                    [](RelationGraph::index_type depth) {
+                        return depth > max_relation_nesting_depth;
+                    })) {
+        vout << "Reading relations again to add relation graph problems...\n";
+        add_graph_problems(file, options, graph, analysis, &outputs);
+    }
+
     outputs.for_all([&](Output &output) { output.prepare(); });
 
     vout << "Writing out data files...\n";
@@ -1,5 +1,6 @@
 
 #include "utils.hpp"
+#include "writer-multiplexer.hpp"
 
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
@@ -59,55 +60,55 @@ class CheckHandler : public osmium::handler::Handler
     options_type m_options;
     stats_type m_stats;
 
-    osmium::io::Writer m_writer_nwr_key_empty;
-    osmium::io::Writer m_writer_nwr_key_short;
-    osmium::io::Writer m_writer_nwr_key_long;
-    osmium::io::Writer m_writer_nwr_key_role;
-    osmium::io::Writer m_writer_nwr_key_bad_chars;
-    osmium::io::Writer m_writer_nwr_key_unusual_chars;
+    WriterMultiplexer m_writers;
 
-    osmium::io::Writer m_writer_nwr_value_empty;
-    osmium::io::Writer m_writer_nwr_value_whitespace;
+    // indexes of the outputs in m_writers
+    std::size_t m_out_nwr_key_empty;
+    std::size_t m_out_nwr_key_short;
+    std::size_t m_out_nwr_key_long;
+    std::size_t m_out_nwr_key_role;
+    std::size_t m_out_nwr_key_bad_chars;
+    std::size_t m_out_nwr_key_unusual_chars;
 
-    osmium::io::Writer m_writer_nw_tag_type_multipolygon;
-    osmium::io::Writer m_writer_nw_tag_type_boundary;
+    std::size_t m_out_nwr_value_empty;
+    std::size_t m_out_nwr_value_whitespace;
 
-    osmium::io::Writer m_writer_nr_tag_natural_coastline;
+    std::size_t m_out_nw_tag_type_multipolygon;
+    std::size_t m_out_nw_tag_type_boundary;
 
-    osmium::io::Writer m_writer_r_tag_boundary_multipolygon;
+    std::size_t m_out_nr_tag_natural_coastline;
+
+    std::size_t m_out_r_tag_boundary_multipolygon;
 
 public:
     CheckHandler(std::string const &directory, options_type const &options,
                  osmium::io::Header const &header)
     : m_options(options),
-      m_writer_nwr_key_empty(directory + "/nwr-key-empty.osm.pbf", header,
-                             osmium::io::overwrite::allow),
-      m_writer_nwr_key_short(directory + "/nwr-key-short.osm.pbf", header,
-                             osmium::io::overwrite::allow),
-      m_writer_nwr_key_long(directory + "/nwr-key-long.osm.pbf", header,
-                            osmium::io::overwrite::allow),
-      m_writer_nwr_key_role(directory + "/nwr-key-role.osm.pbf", header,
-                            osmium::io::overwrite::allow),
-      m_writer_nwr_key_bad_chars(directory + "/nwr-key-bad-chars.osm.pbf",
-                                 header, osmium::io::overwrite::allow),
-      m_writer_nwr_key_unusual_chars(directory +
-                                         "/nwr-key-unusual-chars.osm.pbf",
-                                     header, osmium::io::overwrite::allow),
-      m_writer_nwr_value_empty(directory + "/nwr-value-empty.osm.pbf", header,
-                               osmium::io::overwrite::allow),
-      m_writer_nwr_value_whitespace(directory + "/nwr-value-whitespace.osm.pbf",
-                                    header, osmium::io::overwrite::allow),
-      m_writer_nw_tag_type_multipolygon(directory +
-                                            "/nw-tag-type-multipolygon.osm.pbf",
-                                        header, osmium::io::overwrite::allow),
-      m_writer_nw_tag_type_boundary(directory + "/nw-tag-type-boundary.osm.pbf",
-                                    header, osmium::io::overwrite::allow),
-      m_writer_nr_tag_natural_coastline(directory +
-                                            "/nr-tag-natural-coastline.osm.pbf",
-                                        header, osmium::io::overwrite::allow),
-      m_writer_r_tag_boundary_multipolygon(
-          directory + "/r-tag-boundary-multipolygon.osm.pbf", header,
-          osmium::io::overwrite::allow)
+      m_writers(header),
+      m_out_nwr_key_empty(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-key-empty.osm.pbf"})),
+      m_out_nwr_key_short(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-key-short.osm.pbf"})),
+      m_out_nwr_key_long(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-key-long.osm.pbf"})),
+      m_out_nwr_key_role(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-key-role.osm.pbf"})),
+      m_out_nwr_key_bad_chars(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-key-bad-chars.osm.pbf"})),
+      m_out_nwr_key_unusual_chars(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-key-unusual-chars.osm.pbf"})),
+      m_out_nwr_value_empty(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-value-empty.osm.pbf"})),
+      m_out_nwr_value_whitespace(m_writers.add_output(
+          osmium::io::File{directory + "/nwr-value-whitespace.osm.pbf"})),
+      m_out_nw_tag_type_multipolygon(m_writers.add_output(
+          osmium::io::File{directory + "/nw-tag-type-multipolygon.osm.pbf"})),
+      m_out_nw_tag_type_boundary(m_writers.add_output(
+          osmium::io::File{directory + "/nw-tag-type-boundary.osm.pbf"})),
+      m_out_nr_tag_natural_coastline(m_writers.add_output(
+          osmium::io::File{directory + "/nr-tag-natural-coastline.osm.pbf"})),
+      m_out_r_tag_boundary_multipolygon(m_writers.add_output(
+          osmium::io::File{directory + "/r-tag-boundary-multipolygon.osm.pbf"}))
     {}
 
     void osm_object(osmium::OSMObject const &object)
@@ -120,35 +121,35 @@ public:
             auto const key_len = std::strlen(tag.key());
             if (key_len == 0) {
                 ++m_stats.nwr_key_empty;
-                m_writer_nwr_key_empty(object);
+                m_writers(m_out_nwr_key_empty, object);
             } else if (key_len == 1) {
                 ++m_stats.nwr_key_short;
-                m_writer_nwr_key_short(object);
+                m_writers(m_out_nwr_key_short, object);
             } else if (key_len > 80) {
                 ++m_stats.nwr_key_long;
-                m_writer_nwr_key_long(object);
+                m_writers(m_out_nwr_key_long, object);
             } else if (!std::strcmp(tag.key(), "role")) {
                 ++m_stats.nwr_key_role;
-                m_writer_nwr_key_role(object);
+                m_writers(m_out_nwr_key_role, object);
             }
 
             auto const key_len_bad_chars =
                 std::strcspn(tag.key(), bad_characters);
             if (key_len != key_len_bad_chars) {
                 ++m_stats.nwr_key_bad_chars;
-                m_writer_nwr_key_bad_chars(object);
+                m_writers(m_out_nwr_key_bad_chars, object);
             } else {
                 auto const key_len_common_chars =
                     std::strspn(tag.key(), usual_characters);
                 if (key_len != key_len_common_chars) {
                     ++m_stats.nwr_key_unusual_chars;
-                    m_writer_nwr_key_unusual_chars(object);
+                    m_writers(m_out_nwr_key_unusual_chars, object);
                 }
             }
 
             if (tag.value()[0] == '\0') {
                 ++m_stats.nwr_value_empty;
-                m_writer_nwr_value_empty(object);
+                m_writers(m_out_nwr_value_empty, object);
                 continue;
             }
 
@@ -156,7 +157,7 @@ public:
             if (isspace(tag.value()[0]) ||
                 isspace(tag.value()[value_len - 1])) {
                 ++m_stats.nwr_value_whitespace;
-                m_writer_nwr_value_whitespace(object);
+                m_writers(m_out_nwr_value_whitespace, object);
             }
         }
     }
@@ -173,18 +174,18 @@ public:
         if (type) {
             if (!std::strcmp(type, "multipolygon")) {
                 ++m_stats.n_tag_type_multipolygon;
-                m_writer_nw_tag_type_multipolygon(node);
+                m_writers(m_out_nw_tag_type_multipolygon, node);
             }
             if (!std::strcmp(type, "boundary")) {
                 ++m_stats.n_tag_type_boundary;
-                m_writer_nw_tag_type_boundary(node);
+                m_writers(m_out_nw_tag_type_boundary, node);
             }
         }
 
         char const *natural = node.tags().get_value_by_key("natural");
         if (natural && !std::strcmp(natural, "coastline")) {
             ++m_stats.n_tag_natural_coastline;
-            m_writer_nr_tag_natural_coastline(node);
+            m_writers(m_out_nr_tag_natural_coastline, node);
         }
     }
 
@@ -200,11 +201,11 @@ public:
         if (type) {
             if (!std::strcmp(type, "multipolygon")) {
                 ++m_stats.w_tag_type_multipolygon;
-                m_writer_nw_tag_type_multipolygon(way);
+                m_writers(m_out_nw_tag_type_multipolygon, way);
             }
             if (!std::strcmp(type, "boundary")) {
                 ++m_stats.w_tag_type_boundary;
-                m_writer_nw_tag_type_boundary(way);
+                m_writers(m_out_nw_tag_type_boundary, way);
             }
         }
     }
@@ -220,7 +221,7 @@ public:
         char const *natural = relation.tags().get_value_by_key("natural");
         if (natural && !std::strcmp(natural, "coastline")) {
             ++m_stats.r_tag_natural_coastline;
-            m_writer_nr_tag_natural_coastline(relation);
+            m_writers(m_out_nr_tag_natural_coastline, relation);
         }
 
         char const *type = relation.tags().get_value_by_key("type");
@@ -228,30 +229,12 @@ public:
             char const *boundary = relation.tags().get_value_by_key("boundary");
             if (boundary && !std::strcmp(boundary, "administrative")) {
                 ++m_stats.r_tag_boundary_multipolygon;
-                m_writer_r_tag_boundary_multipolygon(relation);
+                m_writers(m_out_r_tag_boundary_multipolygon, relation);
             }
         }
     }
 
-    void close()
-    {
-        m_writer_nwr_key_empty.close();
-        m_writer_nwr_key_short.close();
-        m_writer_nwr_key_long.close();
-        m_writer_nwr_key_role.close();
-        m_writer_nwr_key_bad_chars.close();
-        m_writer_nwr_key_unusual_chars.close();
-
-        m_writer_nwr_value_empty.close();
-        m_writer_nwr_value_whitespace.close();
-
-        m_writer_nw_tag_type_multipolygon.close();
-        m_writer_nw_tag_type_boundary.close();
-
-        m_writer_nr_tag_natural_coastline.close();
-
-        m_writer_r_tag_boundary_multipolygon.close();
-    }
+    void close() { m_writers.close(); }
 
     stats_type const &stats() const noexcept { return m_stats; }
 
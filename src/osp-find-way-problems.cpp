@@ -1,31 +1,48 @@
 
+#include "bucket.hpp"
+#include "geom-kernels.hpp"
 #include "utils.hpp"
+#include "way-problems-state.hpp"
+#include "writer-multiplexer.hpp"
 
 #include <gdalcpp.hpp>
 
 #include <osmium/geom/haversine.hpp>
 #include <osmium/geom/ogr.hpp>
+#include <osmium/geom/util.hpp>
+#include <osmium/index/id_set.hpp>
+#include <osmium/index/map/all.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
 #include <osmium/io/file.hpp>
 #include <osmium/osm/entity_bits.hpp>
 #include <osmium/osm/object.hpp>
 #include <osmium/osm/undirected_segment.hpp>
+#include <osmium/thread/pool.hpp>
 #include <osmium/util/memory.hpp>
 #include <osmium/util/progress_bar.hpp>
+#include <osmium/util/string.hpp>
 #include <osmium/util/verbose_output.hpp>
 #include <osmium/visitor.hpp>
 
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <functional>
+#include <future>
 #include <getopt.h>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <queue>
 #include <string>
+#include <tuple>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
@@ -38,6 +55,12 @@ struct options_type
     std::size_t max_nodes = 1800;
     double max_angle = 0.03;
     double max_segment_length = 100000.0;
+    int num_threads = 1;
+    uint32_t checks = 0; // bits from problem_flags
+    std::vector<std::string> crossing_keys; // empty: no crossing ways check
+    bool write_state = false;
+    bool update = false;
+    std::string locations_index; // osmium index spec used with --update
 };
 
 struct stats_type
@@ -54,6 +77,25 @@ struct stats_type
     uint64_t close_nodes = 0;
     uint64_t many_nodes = 0;
     uint64_t long_segment = 0;
+    uint64_t crossing_points = 0;
+
+    stats_type &operator+=(stats_type const &other) noexcept
+    {
+        way_nodes += other.way_nodes;
+        self_intersection += other.self_intersection;
+        spike += other.spike;
+        acute_angle += other.acute_angle;
+        duplicate_segment += other.duplicate_segment;
+        no_node += other.no_node;
+        single_node += other.single_node;
+        same_node += other.same_node;
+        duplicate_node += other.duplicate_node;
+        close_nodes += other.close_nodes;
+        many_nodes += other.many_nodes;
+        long_segment += other.long_segment;
+        crossing_points += other.crossing_points;
+        return *this;
+    }
 };
 
 static osmium::Location intersection(osmium::Segment const &s1,
@@ -116,177 +158,966 @@ static bool y_range_overlap(osmium::UndirectedSegment const &s1,
     return !(tmin > omax || omin > tmax);
 }
 
-static void open_writer(std::unique_ptr<osmium::io::Writer> &wptr,
-                        std::string const &dir, std::string const &name)
+// Overlapping pairs in at least this many segments are found using the
+// SegmentSweep, in fewer segments with a simple nested loop.
+static constexpr std::size_t const min_segments_for_sweep_line = 1000;
+
+/**
+ * Finds all pairs of segments whose bounding boxes overlap. This is the same
+ * set of pairs the nested loop in for_each_overlapping_pair() looks at, but
+ * it is found in O(n log n + k) instead of O(n^2) for long ways.
+ *
+ * The segments are swept in x direction. Segments are inserted into the
+ * active set when the sweep line reaches their first x coordinate, and
+ * removed from it (using an event queue ordered by their second x
+ * coordinate) when the sweep line has passed them. The active set is an
+ * interval tree ordered by y: An implicit balanced binary tree over all
+ * distinct y coordinates where each segment is stored in the highest node
+ * whose y coordinate is inside the y range of the segment.
+ */
+class SegmentSweep
+{
+
+    using index_type = uint32_t;
+
+    std::vector<osmium::UndirectedSegment> const &m_segments;
+
+    // Sorted distinct y coordinates of all segment ends. These are the
+    // keys of the tree nodes.
+    std::vector<int32_t> m_keys;
+
+    // Active segments stored in each tree node as doubly linked lists.
+    // Holds the first segment for each node or `none`.
+    std::vector<index_type> m_head;
+
+    // Number of active segments in the subtree below each tree node.
+    std::vector<index_type> m_subtree_count;
+
+    // Tree node and list neighbours for each active segment.
+    std::vector<index_type> m_node;
+    std::vector<index_type> m_next;
+    std::vector<index_type> m_prev;
+
+    // Ranges of tree nodes still to be visited in query().
+    std::vector<std::pair<index_type, index_type>> m_stack;
+
+    static constexpr index_type const none =
+        std::numeric_limits<index_type>::max();
+
+    static int32_t min_y(osmium::UndirectedSegment const &s) noexcept
+    {
+        return std::min(s.first().y(), s.second().y());
+    }
+
+    static int32_t max_y(osmium::UndirectedSegment const &s) noexcept
+    {
+        return std::max(s.first().y(), s.second().y());
+    }
+
+    // Walk down the tree to the node for the y range [ymin, ymax] calling
+    // func for each node on the way.
+    template <typename TFunc>
+    index_type find_node(int32_t ymin, int32_t ymax, TFunc &&func) const
+    {
+        index_type lo = 0;
+        auto hi = static_cast<index_type>(m_keys.size());
+        while (true) {
+            assert(lo < hi);
+            index_type const mid = lo + (hi - lo) / 2;
+            std::forward<TFunc>(func)(mid);
+            if (m_keys[mid] < ymin) {
+                lo = mid + 1;
+            } else if (m_keys[mid] > ymax) {
+                hi = mid;
+            } else {
+                return mid;
+            }
+        }
+    }
+
+    void insert(index_type n)
+    {
+        auto const &s = m_segments[n];
+        index_type const node =
+            find_node(min_y(s), max_y(s),
+                      [&](index_type idx) { ++m_subtree_count[idx]; });
+        m_node[n] = node;
+        m_prev[n] = none;
+        m_next[n] = m_head[node];
+        if (m_head[node] != none) {
+            m_prev[m_head[node]] = n;
+        }
+        m_head[node] = n;
+    }
+
+    void remove(index_type n)
+    {
+        auto const &s = m_segments[n];
+        find_node(min_y(s), max_y(s),
+                  [&](index_type idx) { --m_subtree_count[idx]; });
+        if (m_prev[n] == none) {
+            m_head[m_node[n]] = m_next[n];
+        } else {
+            m_next[m_prev[n]] = m_next[n];
+        }
+        if (m_next[n] != none) {
+            m_prev[m_next[n]] = m_prev[n];
+        }
+    }
+
+    // Call func for all active segments whose y range overlaps the y range
+    // of segment n.
+    template <typename TFunc>
+    void query(index_type n, TFunc &&func)
+    {
+        auto const ymin = min_y(m_segments[n]);
+        auto const ymax = max_y(m_segments[n]);
+
+        m_stack.emplace_back(0, static_cast<index_type>(m_keys.size()));
+
+        while (!m_stack.empty()) {
+            auto const range = m_stack.back();
+            m_stack.pop_back();
+            if (range.first >= range.second) {
+                continue;
+            }
+            index_type const mid =
+                range.first + (range.second - range.first) / 2;
+            if (m_subtree_count[mid] == 0) {
+                continue;
+            }
+            for (index_type other = m_head[mid]; other != none;
+                 other = m_next[other]) {
+                if (min_y(m_segments[other]) <= ymax &&
+                    max_y(m_segments[other]) >= ymin) {
+                    std::forward<TFunc>(func)(other);
+                }
+            }
+            if (ymin < m_keys[mid]) {
+                m_stack.emplace_back(range.first, mid);
+            }
+            if (ymax > m_keys[mid]) {
+                m_stack.emplace_back(mid + 1, range.second);
+            }
+        }
+    }
+
+public:
+    using pair_type = std::pair<index_type, index_type>;
+
+    // The segments must be sorted.
+    explicit SegmentSweep(
+        std::vector<osmium::UndirectedSegment> const &segments)
+    : m_segments(segments), m_node(segments.size()),
+      m_next(segments.size()), m_prev(segments.size())
+    {
+        assert(std::is_sorted(segments.cbegin(), segments.cend()));
+
+        m_keys.reserve(segments.size() * 2);
+        for (auto const &segment : segments) {
+            m_keys.push_back(segment.first().y());
+            m_keys.push_back(segment.second().y());
+        }
+        std::sort(m_keys.begin(), m_keys.end());
+        m_keys.erase(std::unique(m_keys.begin(), m_keys.end()), m_keys.end());
+
+        m_head.resize(m_keys.size(), none);
+        m_subtree_count.resize(m_keys.size());
+    }
+
+    /**
+     * Return all pairs (i, j) with i < j of indexes into the segments
+     * vector whose bounding boxes overlap. The result is sorted, so the
+     * pairs are in the same order the nested loop would see them.
+     */
+    std::vector<pair_type> overlapping_pairs()
+    {
+        std::vector<pair_type> pairs;
+
+        // event queue with the segments to remove ordered by their
+        // second x coordinate
+        std::priority_queue<std::pair<int32_t, index_type>,
+                            std::vector<std::pair<int32_t, index_type>>,
+                            std::greater<>>
+            events;
+
+        for (index_type n = 0; n < m_segments.size(); ++n) {
+            auto const x = m_segments[n].first().x();
+            while (!events.empty() && events.top().first < x) {
+                remove(events.top().second);
+                events.pop();
+            }
+            query(n, [&](index_type other) { pairs.emplace_back(other, n); });
+            insert(n);
+            events.emplace(m_segments[n].second().x(), n);
+        }
+
+        std::sort(pairs.begin(), pairs.end());
+
+        return pairs;
+    }
+
+}; // class SegmentSweep
+
+/**
+ * Call func(i, j) for all pairs (i < j) of indexes into the sorted segments
+ * vector where the bounding boxes of the segments overlap. The pairs are
+ * found with a nested loop for few segments and the SegmentSweep otherwise.
+ */
+template <typename TFunc>
+static void for_each_overlapping_pair(
+    std::vector<osmium::UndirectedSegment> const &segments, TFunc &&func)
+{
+    if (segments.size() < min_segments_for_sweep_line) {
+        for (std::size_t i = 0; i + 1 < segments.size(); ++i) {
+            osmium::UndirectedSegment const &s1 = segments[i];
+            for (std::size_t j = i + 1; j < segments.size(); ++j) {
+                osmium::UndirectedSegment const &s2 = segments[j];
+                if (s1 != s2) {
+                    if (outside_x_range(s2, s1)) {
+                        break;
+                    }
+                    if (!y_range_overlap(s1, s2)) {
+                        continue;
+                    }
+                }
+                func(i, j);
+            }
+        }
+    } else {
+        SegmentSweep sweep{segments};
+        for (auto const &pair : sweep.overlapping_pairs()) {
+            func(pair.first, pair.second);
+        }
+    }
+}
+
+static osmium::io::File output_file(std::string const &dir,
+                                    std::string const &name)
 {
     osmium::io::File file{dir + "/" + name + ".osm.pbf"};
     file.set("locations_on_ways");
+    return file;
+}
 
+static osmium::io::Header output_header()
+{
     osmium::io::Header header;
     header.set("generator", program_name);
+    return header;
+}
 
-    wptr = std::make_unique<osmium::io::Writer>(file, header,
-                                                osmium::io::overwrite::allow);
+static void open_writer(std::unique_ptr<osmium::io::Writer> &wptr,
+                        std::string const &dir, std::string const &name)
+{
+    wptr = std::make_unique<osmium::io::Writer>(
+        output_file(dir, name), output_header(), osmium::io::overwrite::allow);
 }
 
-static bool all_same_nodes(osmium::WayNodeList const &wnl) noexcept
+// Zoom level of the tile grid used for finding crossing ways. The world is
+// split into 2^zoom x 2^zoom tiles (about 10 km wide at the equator).
+static constexpr unsigned int const crossing_tile_zoom = 12;
+
+static constexpr uint32_t const crossing_tiles = 1U << crossing_tile_zoom;
+
+// The tiles are spread over this many bucket files.
+// must change build_bucket_filename() function if you change this
+static constexpr unsigned int const num_crossing_buckets = 1U << 8U;
+
+// Margin (in coordinate units) around each tile used when deciding which
+// tiles a segment is written to. It must be larger than the rounding error
+// of the location returned by intersection(), so that crossing_tile()
+// always returns a tile both segments were written to.
+static constexpr int64_t const crossing_tile_margin = 2;
+
+/**
+ * A segment of a way stored in the bucket file for a tile it overlaps.
+ */
+struct tile_segment
 {
-    osmium::object_id_type const ref = wnl[0].ref();
+    osmium::object_id_type way_id;
+    uint32_t tile;
+    int32_t layer;
+    osmium::Location first;
+    osmium::Location second;
+};
 
-    for (auto const &wn : wnl) {
-        if (ref != wn.ref()) {
-            return false;
-        }
+/**
+ * Two different ways crossing each other at a location where they don't
+ * have a common node.
+ */
+struct crossing_type
+{
+    osmium::object_id_type way1_id;
+    osmium::object_id_type way2_id;
+    osmium::Location location;
+};
+
+static uint32_t tile_coordinate(int32_t coordinate, int32_t range) noexcept
+{
+    int64_t const c =
+        ((static_cast<int64_t>(coordinate) + range) << crossing_tile_zoom) /
+        (2 * static_cast<int64_t>(range));
+    if (c < 0) {
+        return 0;
     }
+    if (c >= crossing_tiles) {
+        return crossing_tiles - 1;
+    }
+    return static_cast<uint32_t>(c);
+}
 
-    return true;
+static uint32_t tile_x(int32_t x) noexcept
+{
+    return tile_coordinate(x, 180 * osmium::detail::coordinate_precision);
 }
 
-static bool duplicate_nodes(osmium::WayNodeList const &wnl) noexcept
+static uint32_t tile_y(int32_t y) noexcept
 {
-    osmium::object_id_type prev_ref = 0;
+    return tile_coordinate(y, 90 * osmium::detail::coordinate_precision);
+}
+
+static std::pair<int32_t, int32_t>
+y_range(osmium::UndirectedSegment const &segment) noexcept
+{
+    return std::minmax(segment.first().y(), segment.second().y());
+}
 
-    for (auto const &wn : wnl) {
-        if (prev_ref == wn.ref()) {
-            return true;
+// The smallest y coordinate in the row of tiles ty.
+static int64_t tile_y_begin(uint32_t ty) noexcept
+{
+    int64_t const range = 90 * osmium::detail::coordinate_precision;
+    int64_t const tiles = crossing_tiles;
+    return (ty * 2 * range + tiles - 1) / tiles - range;
+}
+
+/**
+ * Call func with the number of each tile the segment goes through (plus
+ * the margin). For each row of tiles only the columns between the x
+ * coordinates of the segment where it enters and leaves the row are used,
+ * so long diagonal segments only get the tiles along their way, not all
+ * tiles in their bounding box.
+ */
+template <typename TFunc>
+static void for_each_tile(osmium::UndirectedSegment const &segment,
+                          TFunc &&func)
+{
+    int64_t const px = segment.first().x();
+    int64_t const py = segment.first().y();
+    int64_t const qx = segment.second().x();
+    int64_t const qy = segment.second().y();
+    auto const yr = y_range(segment);
+
+    // x coordinate of the segment at y (horizontal segments cover all
+    // their x range)
+    auto const x_at = [&](int64_t y, int64_t x_if_horizontal) {
+        if (py == qy) {
+            return static_cast<double>(x_if_horizontal);
+        }
+        return static_cast<double>(px) + static_cast<double>(y - py) *
+                                             static_cast<double>(qx - px) /
+                                             static_cast<double>(qy - py);
+    };
+
+    uint32_t const ty0 =
+        tile_y(static_cast<int32_t>(yr.first - crossing_tile_margin));
+    uint32_t const ty1 =
+        tile_y(static_cast<int32_t>(yr.second + crossing_tile_margin));
+
+    for (uint32_t ty = ty0; ty <= ty1; ++ty) {
+        auto const row_y0 = std::max(
+            tile_y_begin(ty) - crossing_tile_margin, int64_t{yr.first});
+        auto const row_y1 = std::min(
+            tile_y_begin(ty + 1) - 1 + crossing_tile_margin,
+            int64_t{yr.second});
+        if (row_y0 > row_y1) {
+            continue;
+        }
+
+        // Segments are ordered, so px <= qx.
+        auto const xa = x_at(row_y0, px);
+        auto const xb = x_at(row_y1, qx);
+        auto const row_x0 = std::max(
+            static_cast<int64_t>(std::floor(std::min(xa, xb))), px);
+        auto const row_x1 = std::min(
+            static_cast<int64_t>(std::ceil(std::max(xa, xb))), qx);
+
+        uint32_t const tx0 =
+            tile_x(static_cast<int32_t>(row_x0 - crossing_tile_margin));
+        uint32_t const tx1 =
+            tile_x(static_cast<int32_t>(row_x1 + crossing_tile_margin));
+        for (uint32_t tx = tx0; tx <= tx1; ++tx) {
+            func((ty << crossing_tile_zoom) | tx);
         }
-        prev_ref = wn.ref();
     }
+}
 
-    return false;
+/**
+ * Return the tile a crossing of two segments at the location is reported
+ * in. This is the tile with the location, clamped to the tiles both
+ * segments are in, so that every crossing is reported exactly once even
+ * if rounding moved the location slightly outside a segment.
+ */
+static uint32_t crossing_tile(osmium::Location location,
+                              osmium::UndirectedSegment const &s1,
+                              osmium::UndirectedSegment const &s2) noexcept
+{
+    auto const y1 = y_range(s1);
+    auto const y2 = y_range(s2);
+
+    uint32_t const x = std::clamp(
+        tile_x(location.x()),
+        tile_x(std::max(s1.first().x(), s2.first().x())),
+        tile_x(std::min(s1.second().x(), s2.second().x())));
+    uint32_t const y =
+        std::clamp(tile_y(location.y()), tile_y(std::max(y1.first, y2.first)),
+                   tile_y(std::min(y1.second, y2.second)));
+
+    return (y << crossing_tile_zoom) | x;
 }
 
-static std::vector<osmium::UndirectedSegment>
-create_segment_list(osmium::WayNodeList const &wnl)
+static int32_t layer_of(osmium::Way const &way) noexcept
 {
-    assert(!wnl.empty());
+    char const *layer = way.tags()["layer"];
+    if (layer) {
+        return std::atoi(layer);
+    }
+    return 0;
+}
 
-    std::vector<osmium::UndirectedSegment> segments;
-    segments.reserve(wnl.size() - 1);
+/**
+ * Finds crossings between different ways. All segments of the ways are
+ * written to the buckets of all tiles on a grid they overlap. Afterwards
+ * the buckets are read back one after the other (possibly in parallel)
+ * and the segments in each tile are checked for crossings with the same
+ * sweep used for self-intersections. So only the segments from one bucket
+ * must fit into memory at a time.
+ *
+ * Only ways with one of the configured keys take part, and only ways in
+ * the same layer (from the "layer" tag) are checked against each other.
+ */
+class CrossingFinder
+{
 
-    for (auto it1 = wnl.cbegin(), it2 = std::next(it1); it2 != wnl.cend();
-         ++it1, ++it2) {
-        auto const loc1 = it1->location();
-        auto const loc2 = it2->location();
-        if (loc1 != loc2) {
-            segments.emplace_back(loc1, loc2);
+    std::string m_dirname;
+
+    std::vector<std::string> m_keys;
+
+    osmium::Timestamp m_before_time;
+
+    std::vector<Bucket<tile_segment>> m_buckets;
+
+    static std::string build_filename(std::string const &dirname,
+                                      unsigned int n)
+    {
+        return build_bucket_filename(dirname, "crossing_segments", n);
+    }
+
+    bool wanted(osmium::Way const &way) const noexcept
+    {
+        if (way.timestamp() >= m_before_time) {
+            return false;
         }
+
+        return std::any_of(m_keys.cbegin(), m_keys.cend(),
+                           [&](std::string const &key) {
+                               return way.tags().has_key(key.c_str());
+                           });
     }
 
-    return segments;
-}
+    static void
+    find_in_tile(tile_segment const *records,
+                 std::vector<osmium::UndirectedSegment> const &segments,
+                 std::vector<crossing_type> &crossings)
+    {
+        uint32_t const tile = records[0].tile;
+
+        for_each_overlapping_pair(segments, [&](std::size_t i, std::size_t j) {
+            auto const &r1 = records[i];
+            auto const &r2 = records[j];
+            if (r1.way_id == r2.way_id || r1.layer != r2.layer) {
+                return;
+            }
+
+            osmium::Location const location =
+                intersection(segments[i], segments[j]);
+            if (!location ||
+                crossing_tile(location, segments[i], segments[j]) != tile) {
+                return;
+            }
+
+            crossings.push_back({std::min(r1.way_id, r2.way_id),
+                                 std::max(r1.way_id, r2.way_id), location});
+        });
+    }
+
+public:
+    CrossingFinder(std::string dirname, std::vector<std::string> keys,
+                   osmium::Timestamp before_time)
+    : m_dirname(std::move(dirname)), m_keys(std::move(keys)),
+      m_before_time(before_time)
+    {
+        m_buckets.reserve(num_crossing_buckets);
+        for (unsigned int i = 0; i < num_crossing_buckets; ++i) {
+            m_buckets.emplace_back(build_filename(m_dirname, i));
+        }
+    }
+
+    void add_way(osmium::Way const &way)
+    {
+        if (!wanted(way)) {
+            return;
+        }
+
+        tile_segment ts{way.id(), 0, layer_of(way), {}, {}};
+
+        auto const &nodes = way.nodes();
+        for (std::size_t i = 1; i < nodes.size(); ++i) {
+            auto const &loc1 = nodes[i - 1].location();
+            auto const &loc2 = nodes[i].location();
+            if (!loc1.valid() || !loc2.valid() || loc1 == loc2) {
+                continue;
+            }
+
+            osmium::UndirectedSegment const segment{loc1, loc2};
+            ts.first = segment.first();
+            ts.second = segment.second();
+            for_each_tile(segment, [&](uint32_t tile) {
+                ts.tile = tile;
+                m_buckets[tile & (num_crossing_buckets - 1)].set(ts);
+            });
+        }
+    }
+
+    void add_buffer(osmium::memory::Buffer const &buffer)
+    {
+        for (auto const &way : buffer.select<osmium::Way>()) {
+            add_way(way);
+        }
+    }
+
+    void flush()
+    {
+        for (auto &bucket : m_buckets) {
+            bucket.flush();
+        }
+    }
+
+    [[nodiscard]] std::size_t num_buckets() const noexcept
+    {
+        return m_buckets.size();
+    }
+
+    /**
+     * Find all crossings in bucket n. The bucket file is removed
+     * afterwards. This can be called from several threads at the same
+     * time for different buckets. The result is sorted.
+     */
+    std::vector<crossing_type> find_in_bucket(unsigned int n) const
+    {
+        std::vector<crossing_type> crossings;
+        std::vector<osmium::UndirectedSegment> segments;
+
+        process_bucket_file<tile_segment>(
+            build_filename(m_dirname, n), [&](auto &mapping) {
+                std::sort(mapping.begin(), mapping.end(),
+                          [](tile_segment const &a, tile_segment const &b) {
+                              return std::tie(a.tile, a.first, a.second,
+                                              a.way_id) <
+                                     std::tie(b.tile, b.first, b.second,
+                                              b.way_id);
+                          });
+
+                auto *it = mapping.begin();
+                while (it != mapping.end()) {
+                    auto *const end = std::find_if(
+                        it, mapping.end(), [&](tile_segment const &ts) {
+                            return ts.tile != it->tile;
+                        });
+
+                    segments.clear();
+                    for (auto *r = it; r != end; ++r) {
+                        segments.emplace_back(r->first, r->second);
+                    }
+                    find_in_tile(it, segments, crossings);
+
+                    it = end;
+                }
+            });
+
+        std::sort(crossings.begin(), crossings.end(),
+                  [](crossing_type const &a, crossing_type const &b) {
+                      return std::tie(a.way1_id, a.way2_id, a.location) <
+                             std::tie(b.way1_id, b.way2_id, b.location);
+                  });
+
+        return crossings;
+    }
+
+}; // class CrossingFinder
 
 static constexpr int const min_diff_for_close_nodes = 10;
 
-static bool has_close_nodes(osmium::WayNodeList const &wnl)
+/**
+ * Bits used in way_problems::flags to mark which problems were found.
+ */
+enum problem_flags : uint32_t
+{
+    problem_no_node = 1U << 0U,
+    problem_single_node = 1U << 1U,
+    problem_same_node = 1U << 2U,
+    problem_duplicate_node = 1U << 3U,
+    problem_long_segment = 1U << 4U,
+    problem_spike = 1U << 5U,
+    problem_acute_angle = 1U << 6U,
+    problem_self_intersection = 1U << 7U,
+    problem_close_nodes = 1U << 8U,
+    problem_many_nodes = 1U << 9U,
+    problem_duplicate_segment = 1U << 10U
+};
+
+/**
+ * The checks. Each check has the flag from problem_flags it reports, the
+ * name used on the command line and in the output file names and a function
+ * to get its counter from the stats.
+ */
+struct check_self_intersection
+{
+    static constexpr uint32_t const flag = problem_self_intersection;
+    static constexpr char const *const name = "self-intersection";
+    static uint64_t stat(stats_type const &s) noexcept
+    {
+        return s.self_intersection;
+    }
+};
+
+struct check_spike
 {
-    if (wnl.size() < 2) {
-        return false;
+    static constexpr uint32_t const flag = problem_spike;
+    static constexpr char const *const name = "spike";
+    static uint64_t stat(stats_type const &s) noexcept { return s.spike; }
+};
+
+struct check_acute_angle
+{
+    static constexpr uint32_t const flag = problem_acute_angle;
+    static constexpr char const *const name = "acute-angle";
+    static uint64_t stat(stats_type const &s) noexcept
+    {
+        return s.acute_angle;
     }
+};
 
-    osmium::Location location;
+struct check_duplicate_segment
+{
+    static constexpr uint32_t const flag = problem_duplicate_segment;
+    static constexpr char const *const name = "duplicate-segment";
+    static uint64_t stat(stats_type const &s) noexcept
+    {
+        return s.duplicate_segment;
+    }
+};
+
+struct check_no_node
+{
+    static constexpr uint32_t const flag = problem_no_node;
+    static constexpr char const *const name = "no-node";
+    static uint64_t stat(stats_type const &s) noexcept { return s.no_node; }
+};
+
+struct check_single_node
+{
+    static constexpr uint32_t const flag = problem_single_node;
+    static constexpr char const *const name = "single-node";
+    static uint64_t stat(stats_type const &s) noexcept
+    {
+        return s.single_node;
+    }
+};
+
+struct check_same_node
+{
+    static constexpr uint32_t const flag = problem_same_node;
+    static constexpr char const *const name = "same-node";
+    static uint64_t stat(stats_type const &s) noexcept { return s.same_node; }
+};
+
+struct check_duplicate_node
+{
+    static constexpr uint32_t const flag = problem_duplicate_node;
+    static constexpr char const *const name = "duplicate-node";
+    static uint64_t stat(stats_type const &s) noexcept
+    {
+        return s.duplicate_node;
+    }
+};
+
+struct check_close_nodes
+{
+    static constexpr uint32_t const flag = problem_close_nodes;
+    static constexpr char const *const name = "close-nodes";
+    static uint64_t stat(stats_type const &s) noexcept
+    {
+        return s.close_nodes;
+    }
+};
 
-    for (auto const &wn : wnl) {
-        auto const dx = std::abs(location.x() - wn.location().x());
-        auto const dy = std::abs(location.y() - wn.location().y());
-        if (dx < min_diff_for_close_nodes && dy < min_diff_for_close_nodes) {
-            return true;
+struct check_many_nodes
+{
+    static constexpr uint32_t const flag = problem_many_nodes;
+    static constexpr char const *const name = "many-nodes";
+    static uint64_t stat(stats_type const &s) noexcept { return s.many_nodes; }
+};
+
+struct check_long_segment
+{
+    static constexpr uint32_t const flag = problem_long_segment;
+    static constexpr char const *const name = "long-segment";
+    static uint64_t stat(stats_type const &s) noexcept
+    {
+        return s.long_segment;
+    }
+};
+
+/**
+ * A set of checks combined at compile time. The WayChecker is instantiated
+ * with a check set and leaves out all work not needed for it.
+ */
+template <typename... TChecks>
+struct check_set
+{
+    static constexpr uint32_t const mask = (0U | ... | TChecks::flag);
+
+    // Call func with an (empty) object of each check type.
+    template <typename TFunc>
+    static void for_each(TFunc &&func)
+    {
+        (func(TChecks{}), ...);
+    }
+};
+
+using all_checks =
+    check_set<check_self_intersection, check_spike, check_acute_angle,
+              check_duplicate_segment, check_no_node, check_single_node,
+              check_same_node, check_duplicate_node, check_close_nodes,
+              check_many_nodes, check_long_segment>;
+
+/**
+ * The check sets the WayChecker is instantiated for. When running with a
+ * set of checks from the command line, the smallest of these containing all
+ * those checks is used. The reporter makes sure only the problems from the
+ * checks asked for are written out.
+ */
+using check_sets = std::tuple<
+    all_checks,
+    check_set<check_no_node, check_single_node, check_same_node,
+              check_duplicate_node>,
+    check_set<check_spike, check_acute_angle>,
+    check_set<check_self_intersection, check_duplicate_segment>,
+    check_set<check_self_intersection>, check_set<check_spike>,
+    check_set<check_acute_angle>, check_set<check_duplicate_segment>,
+    check_set<check_no_node>, check_set<check_single_node>,
+    check_set<check_same_node>, check_set<check_duplicate_node>,
+    check_set<check_close_nodes>, check_set<check_many_nodes>,
+    check_set<check_long_segment>>;
+
+// Number of checks in a mask.
+static int count_checks(uint32_t mask) noexcept
+{
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        ++count;
+    }
+    return count;
+}
+
+// Index into check_sets of the smallest check set containing all checks
+// in the mask.
+template <std::size_t... Is>
+static std::size_t find_check_set(uint32_t checks,
+                                  std::index_sequence<Is...> /*unused*/)
+{
+    std::array<uint32_t, sizeof...(Is)> const masks = {
+        std::tuple_element_t<Is, check_sets>::mask...};
+
+    std::size_t best = 0;
+    for (std::size_t i = 0; i < masks.size(); ++i) {
+        if ((masks[i] & checks) == checks &&
+            count_checks(masks[i]) < count_checks(masks[best])) {
+            best = i;
         }
-        location = wn.location();
     }
+    return best;
+}
 
-    return false;
+// Call func with an (empty) object of the check set with the given index.
+template <typename TFunc, std::size_t... Is>
+static void with_check_set(std::size_t index, TFunc &&func,
+                           std::index_sequence<Is...> /*unused*/)
+{
+    ((index == Is ? func(std::tuple_element_t<Is, check_sets>{}) : void()),
+     ...);
 }
 
-class CheckHandler : public HandlerWithDB
+struct acute_angle_type
 {
+    osmium::Location prev;
+    osmium::Location curr;
+    osmium::Location next;
+    double angle;
+};
+
+/**
+ * All problems found in a single way. This is filled in by the WayChecker
+ * (possibly in a worker thread) and later written out by the
+ * ProblemReporter.
+ */
+struct way_problems
+{
+    osmium::Way const *way = nullptr;
+    uint32_t flags = 0;
+    osmium::Location spike_point;
+    std::vector<osmium::Location> spike_line;
+    std::vector<acute_angle_type> acute_angles;
+    std::vector<osmium::UndirectedSegment> duplicate_segments;
+    std::vector<osmium::Location> intersections;
+};
+
+/**
+ * A buffer of ways together with the problems found in them. The ways
+ * pointers in the problems point into the buffer. Moving the buffer doesn't
+ * move the data, so they stay valid as long as the buffer is alive.
+ */
+struct checked_buffer
+{
+    osmium::memory::Buffer buffer;
+    std::vector<way_problems> problems;
+    stats_type stats;
+};
+
+/**
+ * Results of the single pass over the nodes of a way done in
+ * WayChecker::analyze_nodes().
+ */
+struct node_analysis
+{
+    // All segments of the way, segments with the same location at both ends
+    // are left out.
+    std::vector<osmium::UndirectedSegment> segments;
+
+    // All angles smaller than the max_angle option.
+    std::vector<acute_angle_type> acute_angles;
+
+    // Number of segments, segments with the same location at both ends are
+    // not counted.
+    std::size_t num_segments = 0;
+
+    // Index of the middle node of the first spike, 0 if there is no spike.
+    std::size_t spike = 0;
+
+    // All nodes have the same id.
+    bool same_nodes = true;
+
+    // The same node id appears twice in a row.
+    bool duplicate_node = false;
+
+    // There is at least one segment longer than the max_segment_length option.
+    bool long_segment = false;
+
+    // There are two nodes in a row less than min_diff_for_close_nodes apart.
+    bool close_nodes = false;
+};
+
+/**
+ * Buffers used by the WayChecker while checking a way. They are kept
+ * between ways to avoid allocations.
+ */
+struct check_scratch
+{
+    std::vector<int32_t> x;
+    std::vector<int32_t> y;
+    std::vector<uint32_t> candidates;
+};
+
+/**
+ * Runs the checks in TCheckSet on ways. This doesn't change any state, so
+ * it can be used from several threads at the same time.
+ *
+ * Everything not needed for the checks in TCheckSet is removed at compile
+ * time. Problems are reported the same way they are reported when all
+ * checks are enabled. So if a way has a spike, it will not be checked for
+ * acute angles, even if the spike check is not enabled.
+ */
+template <typename TCheckSet>
+class WayChecker
+{
+
+    static constexpr bool enabled(uint32_t flag) noexcept
+    {
+        return (TCheckSet::mask & flag) != 0;
+    }
+
+    static constexpr uint32_t const mask = TCheckSet::mask;
+
+    // Do we need the segment list to look at pairs of segments?
+    static constexpr bool const need_segment_pairs =
+        (mask & (problem_self_intersection | problem_duplicate_segment)) != 0;
+
+    // Do we need to detect spikes and count the segments? All checks after
+    // the spike check are only done if there is no spike.
+    static constexpr bool const need_spikes =
+        (mask & (problem_spike | problem_acute_angle |
+                 problem_self_intersection | problem_duplicate_segment |
+                 problem_close_nodes | problem_many_nodes)) != 0;
+
+    // Do we need to look at the nodes at all?
+    static constexpr bool const need_analysis =
+        need_spikes || (mask & (problem_same_node | problem_duplicate_node |
+                                problem_long_segment)) != 0;
+
+    // Do we need the coordinates for the batch kernels?
+    static constexpr bool const need_coordinates =
+        (mask & (problem_long_segment | problem_acute_angle |
+                 problem_close_nodes)) != 0;
 
     options_type m_options;
-    stats_type m_stats;
 
-    gdalcpp::Layer m_layer_way_one_node;
-    gdalcpp::Layer m_layer_way_duplicate_nodes;
-    gdalcpp::Layer m_layer_way_intersection_points;
-    gdalcpp::Layer m_layer_way_intersection_lines;
-    gdalcpp::Layer m_layer_way_spike_points;
-    gdalcpp::Layer m_layer_way_spike_lines;
-    gdalcpp::Layer m_layer_way_acute_angle_points;
-    gdalcpp::Layer m_layer_way_acute_angle_lines;
-    gdalcpp::Layer m_layer_way_duplicate_segments;
-    gdalcpp::Layer m_layer_way_many_nodes;
-    gdalcpp::Layer m_layer_way_long_segments;
-
-    std::unique_ptr<osmium::io::Writer> m_writer_self_intersection;
-    std::unique_ptr<osmium::io::Writer> m_writer_spike;
-    std::unique_ptr<osmium::io::Writer> m_writer_acute_angle;
-    std::unique_ptr<osmium::io::Writer> m_writer_duplicate_segment;
-    std::unique_ptr<osmium::io::Writer> m_writer_no_node;
-    std::unique_ptr<osmium::io::Writer> m_writer_single_node;
-    std::unique_ptr<osmium::io::Writer> m_writer_same_node;
-    std::unique_ptr<osmium::io::Writer> m_writer_duplicate_node;
-    std::unique_ptr<osmium::io::Writer> m_writer_close_nodes;
-    std::unique_ptr<osmium::io::Writer> m_writer_many_nodes;
-    std::unique_ptr<osmium::io::Writer> m_writer_long_segment;
-
-    bool detect_spikes(osmium::Way const &way)
-    {
-        if (way.nodes().size() < 3) {
-            return false;
-        }
+    // Cosine of the max_angle option.
+    double m_cos_max_angle;
+
+    // Segments with a sum of x and y differences smaller than this can't
+    // be longer than the max_segment_length option.
+    double m_min_l1_long_segment;
 
-        auto const *first = way.nodes().cbegin();
-        auto const *last = way.nodes().cend();
+    // Add the spike with the middle node at the specified index to the
+    // problems. The spike is extended as long as the nodes on both sides
+    // have the same location.
+    static void add_spike(osmium::WayNodeList const &wnl, std::size_t index,
+                          way_problems &problems)
+    {
+        auto const *first = wnl.cbegin();
+        auto const *last = wnl.cend();
 
-        auto const *prev = first;
-        auto const *curr = prev + 1;
+        auto const *curr = first + index;
+        auto const *prev = curr - 1;
         auto const *next = curr + 1;
 
-        for (; next != last; ++prev, ++curr, ++next) {
-            if (prev->location() == next->location() &&
-                prev->location() != curr->location()) {
-                // found spike
-                auto const ts = way.timestamp().to_iso();
-                {
-                    gdalcpp::Feature feature{
-                        m_layer_way_spike_points,
-                        m_factory.create_point(curr->location())};
-                    feature.set_field("way_id", static_cast<int32_t>(way.id()));
-                    feature.set_field("timestamp", ts.c_str());
-                    feature.set_field("closed", way.is_closed());
-                    feature.add_to_layer();
-                }
+        problems.spike_point = curr->location();
 
-                if (prev != first) {
-                    auto const *p = prev - 1;
-                    auto const *n = next + 1;
-                    while (p != first && n != last &&
-                           p->location() == n->location()) {
-                        prev = p;
-                        next = n;
-                        --p;
-                        ++n;
-                    }
-                }
-
-                {
-                    std::unique_ptr<OGRLineString> linestring{
-                        new OGRLineString};
-                    for (; prev != next; ++prev) {
-                        linestring->addPoint(prev->location().lon(),
-                                             prev->location().lat());
-                    }
-                    gdalcpp::Feature feature{m_layer_way_spike_lines,
-                                             std::move(linestring)};
-                    feature.set_field("way_id", static_cast<int32_t>(way.id()));
-                    feature.set_field("timestamp", ts.c_str());
-                    feature.set_field("closed", way.is_closed());
-                    feature.add_to_layer();
-                }
-                return true;
+        if (prev != first) {
+            auto const *p = prev - 1;
+            auto const *n = next + 1;
+            while (p != first && n != last && p->location() == n->location()) {
+                prev = p;
+                next = n;
+                --p;
+                ++n;
             }
         }
 
-        return false;
+        for (; prev != next; ++prev) {
+            problems.spike_line.push_back(prev->location());
+        }
     }
 
     static double calc_angle(osmium::Location const &a,
@@ -309,165 +1140,533 @@ class CheckHandler : public HandlerWithDB
         return std::acos(cphi);
     }
 
-    bool detect_acute_angles(osmium::Way const &way)
+    /**
+     * Look at all the nodes of the way in a single pass and find everything
+     * the enabled checks need from the individual nodes and segments. The
+     * coordinates are copied into the scratch arrays on the way which are
+     * then used by the batch kernels for the close nodes, long segments
+     * and acute angles checks. The way must have at least two nodes.
+     */
+    node_analysis analyze_nodes(osmium::WayNodeList const &wnl,
+                                check_scratch &scratch) const
     {
-        if (way.nodes().size() < 3) {
-            return false;
+        assert(wnl.size() >= 2);
+
+        node_analysis result;
+        if constexpr (need_segment_pairs) {
+            result.segments.reserve(wnl.size() - 1);
         }
 
-        auto const *prev = way.nodes().cbegin();
-        auto const *curr = prev + 1;
-        auto const *next = curr + 1;
+        if constexpr (need_coordinates) {
+            scratch.x.clear();
+            scratch.y.clear();
+        }
 
-        bool result = false;
-
-        for (; next != way.nodes().end(); ++prev, ++curr, ++next) {
-            auto const angle = calc_angle(prev->location(), curr->location(),
-                                          next->location());
-            if (angle < m_options.max_angle) {
-                result = true;
-                auto const ts = way.timestamp().to_iso();
-                {
-                    gdalcpp::Feature feature{
-                        m_layer_way_acute_angle_points,
-                        m_factory.create_point(curr->location())};
-                    feature.set_field("way_id", static_cast<int32_t>(way.id()));
-                    feature.set_field("timestamp", ts.c_str());
-                    feature.set_field("closed", way.is_closed());
-                    feature.set_field("angle", angle);
-                    feature.add_to_layer();
+        auto const *nodes = wnl.cbegin();
+        [[maybe_unused]] osmium::object_id_type const first_ref =
+            nodes[0].ref();
+        [[maybe_unused]] osmium::object_id_type prev_ref = 0;
+
+        for (std::size_t i = 0; i < wnl.size(); ++i) {
+            if constexpr (enabled(problem_same_node) ||
+                          enabled(problem_duplicate_node)) {
+                osmium::object_id_type const ref = nodes[i].ref();
+                if (ref != first_ref) {
+                    result.same_nodes = false;
+                }
+                if (ref == prev_ref) {
+                    result.duplicate_node = true;
+                }
+                prev_ref = ref;
+            }
+
+            [[maybe_unused]] auto const &loc2 = nodes[i].location();
+            if constexpr (need_coordinates) {
+                scratch.x.push_back(loc2.x());
+                scratch.y.push_back(loc2.y());
+            }
+
+            if constexpr (need_spikes) {
+                if (i == 0) {
+                    continue;
+                }
+
+                // segment from node i-1 to node i
+                auto const &loc1 = nodes[i - 1].location();
+                if (loc1 != loc2) {
+                    ++result.num_segments;
+                    if constexpr (need_segment_pairs) {
+                        result.segments.emplace_back(loc1, loc2);
+                    }
+                }
+
+                if (i == 1) {
+                    continue;
+                }
+
+                // spike at node i-1 between nodes i-2 and i
+                auto const &loc0 = nodes[i - 2].location();
+                if (result.spike == 0 && loc0 == loc2 && loc0 != loc1) {
+                    result.spike = i - 1;
+                }
+            }
+        }
+
+        [[maybe_unused]] auto const *x = scratch.x.data();
+        [[maybe_unused]] auto const *y = scratch.y.data();
+
+        if constexpr (enabled(problem_close_nodes)) {
+            result.close_nodes =
+                has_close_nodes(x, y, wnl.size(), min_diff_for_close_nodes);
+        }
+
+        if constexpr (enabled(problem_long_segment)) {
+            scratch.candidates.clear();
+            find_long_segment_candidates(x, y, wnl.size(),
+                                         m_min_l1_long_segment,
+                                         scratch.candidates);
+            for (auto const i : scratch.candidates) {
+                auto const &loc1 = nodes[i].location();
+                auto const &loc2 = nodes[i + 1].location();
+                if (loc1 != loc2 &&
+                    osmium::geom::haversine::distance(loc1, loc2) >
+                        m_options.max_segment_length) {
+                    result.long_segment = true;
+                    break;
+                }
+            }
+        }
+
+        if constexpr (enabled(problem_acute_angle)) {
+            scratch.candidates.clear();
+            find_acute_angle_candidates(x, y, wnl.size(), m_cos_max_angle,
+                                        scratch.candidates);
+            for (auto const i : scratch.candidates) {
+                auto const &loc0 = nodes[i - 1].location();
+                auto const &loc1 = nodes[i].location();
+                auto const &loc2 = nodes[i + 1].location();
+                auto const angle = calc_angle(loc0, loc1, loc2);
+                if (angle < m_options.max_angle) {
+                    result.acute_angles.push_back({loc0, loc1, loc2, angle});
                 }
-                auto ogr_linestring = std::make_unique<OGRLineString>();
-                ogr_linestring->addPoint(prev->location().lon(),
-                                         prev->location().lat());
-                ogr_linestring->addPoint(curr->location().lon(),
-                                         curr->location().lat());
-                ogr_linestring->addPoint(next->location().lon(),
-                                         next->location().lat());
-
-                gdalcpp::Feature feature{m_layer_way_acute_angle_lines,
-                                         std::move(ogr_linestring)};
-                feature.set_field("way_id", static_cast<int32_t>(way.id()));
-                feature.set_field("timestamp", ts.c_str());
-                feature.set_field("closed", way.is_closed());
-                feature.set_field("angle", angle);
-                feature.add_to_layer();
             }
         }
 
         return result;
     }
 
+    // The segments must have overlapping bounding boxes.
+    static void check_segment_pair(osmium::UndirectedSegment const &s1,
+                                   osmium::UndirectedSegment const &s2,
+                                   way_problems &problems,
+                                   [[maybe_unused]] stats_type &stats)
+    {
+        if (s1 == s2) {
+            if constexpr (enabled(problem_duplicate_segment)) {
+                ++stats.duplicate_segment;
+                problems.duplicate_segments.push_back(s1);
+            }
+            return;
+        }
+
+        if constexpr (enabled(problem_self_intersection)) {
+            osmium::Location const i = intersection(s1, s2);
+            if (i) {
+                problems.intersections.push_back(i);
+            }
+        }
+    }
+
+    // Check all pairs of segments with overlapping bounding boxes for
+    // duplicate segments and self-intersections.
+    static void check_segment_pairs(
+        std::vector<osmium::UndirectedSegment> &segments,
+        way_problems &problems, stats_type &stats)
+    {
+        std::sort(segments.begin(), segments.end());
+
+        for_each_overlapping_pair(segments, [&](std::size_t i, std::size_t j) {
+            check_segment_pair(segments[i], segments[j], problems, stats);
+        });
+
+        if (!problems.duplicate_segments.empty()) {
+            problems.flags |= problem_duplicate_segment;
+        }
+        if (!problems.intersections.empty()) {
+            ++stats.self_intersection;
+            problems.flags |= problem_self_intersection;
+        }
+    }
+
 public:
-    CheckHandler(std::string const &output_dirname, options_type const &options)
-    : HandlerWithDB(output_dirname + "/geoms-way-problems.db"),
-      m_options(options), m_layer_way_one_node(m_dataset, "way_one_node",
-                                               wkbPoint, {"SPATIAL_INDEX=NO"}),
-      m_layer_way_duplicate_nodes(m_dataset, "way_duplicate_nodes", wkbPoint,
-                                  {"SPATIAL_INDEX=NO"}),
-      m_layer_way_intersection_points(m_dataset, "way_intersection_points",
-                                      wkbPoint, {"SPATIAL_INDEX=NO"}),
-      m_layer_way_intersection_lines(m_dataset, "way_intersection_lines",
-                                     wkbLineString, {"SPATIAL_INDEX=NO"}),
-      m_layer_way_spike_points(m_dataset, "way_spike_points", wkbPoint,
-                               {"SPATIAL_INDEX=NO"}),
-      m_layer_way_spike_lines(m_dataset, "way_spike_lines", wkbLineString,
-                              {"SPATIAL_INDEX=NO"}),
-      m_layer_way_acute_angle_points(m_dataset, "way_acute_angle_points",
-                                     wkbPoint, {"SPATIAL_INDEX=NO"}),
-      m_layer_way_acute_angle_lines(m_dataset, "way_acute_angle_lines",
-                                    wkbLineString, {"SPATIAL_INDEX=NO"}),
-      m_layer_way_duplicate_segments(m_dataset, "way_duplicate_segments",
-                                     wkbLineString, {"SPATIAL_INDEX=NO"}),
-      m_layer_way_many_nodes(m_dataset, "way_many_nodes", wkbLineString,
-                             {"SPATIAL_INDEX=NO"}),
-      m_layer_way_long_segments(m_dataset, "way_long_segments", wkbLineString,
-                                {"SPATIAL_INDEX=NO"})
-    {
-
-        m_layer_way_one_node.add_field("way_id", OFTInteger, 10);
-        m_layer_way_one_node.add_field("timestamp", OFTString, 20);
-        m_layer_way_one_node.add_field("node_id", OFTReal, 12);
-        m_layer_way_one_node.add_field("num_nodes", OFTInteger, 3);
-
-        m_layer_way_duplicate_nodes.add_field("way_id", OFTInteger, 10);
-        m_layer_way_duplicate_nodes.add_field("timestamp", OFTString, 20);
-        m_layer_way_duplicate_nodes.add_field("node_id", OFTReal, 12);
-        m_layer_way_duplicate_nodes.add_field("closed", OFTInteger, 1);
-
-        m_layer_way_intersection_points.add_field("way_id", OFTInteger, 10);
-        m_layer_way_intersection_points.add_field("timestamp", OFTString, 20);
-        m_layer_way_intersection_points.add_field("closed", OFTInteger, 1);
-        m_layer_way_intersection_lines.add_field("way_id", OFTInteger, 10);
-        m_layer_way_intersection_lines.add_field("timestamp", OFTString, 20);
-        m_layer_way_intersection_lines.add_field("closed", OFTInteger, 1);
-
-        m_layer_way_spike_points.add_field("way_id", OFTInteger, 10);
-        m_layer_way_spike_points.add_field("timestamp", OFTString, 20);
-        m_layer_way_spike_points.add_field("closed", OFTInteger, 1);
-        m_layer_way_spike_lines.add_field("way_id", OFTInteger, 10);
-        m_layer_way_spike_lines.add_field("timestamp", OFTString, 20);
-        m_layer_way_spike_lines.add_field("closed", OFTInteger, 1);
-
-        m_layer_way_acute_angle_points.add_field("way_id", OFTInteger, 10);
-        m_layer_way_acute_angle_points.add_field("timestamp", OFTString, 20);
-        m_layer_way_acute_angle_points.add_field("closed", OFTInteger, 1);
-        m_layer_way_acute_angle_points.add_field("angle", OFTReal, 20);
-        m_layer_way_acute_angle_lines.add_field("way_id", OFTInteger, 10);
-        m_layer_way_acute_angle_lines.add_field("timestamp", OFTString, 20);
-        m_layer_way_acute_angle_lines.add_field("closed", OFTInteger, 1);
-        m_layer_way_acute_angle_lines.add_field("angle", OFTReal, 20);
-
-        m_layer_way_duplicate_segments.add_field("way_id", OFTInteger, 10);
-        m_layer_way_duplicate_segments.add_field("timestamp", OFTString, 20);
-        m_layer_way_duplicate_segments.add_field("closed", OFTInteger, 1);
-
-        m_layer_way_many_nodes.add_field("way_id", OFTInteger, 10);
-        m_layer_way_many_nodes.add_field("timestamp", OFTString, 20);
-        m_layer_way_many_nodes.add_field("num_nodes", OFTInteger, 4);
-        m_layer_way_many_nodes.add_field("closed", OFTInteger, 1);
-
-        m_layer_way_long_segments.add_field("way_id", OFTInteger, 10);
-        m_layer_way_long_segments.add_field("timestamp", OFTString, 20);
-        m_layer_way_long_segments.add_field("closed", OFTInteger, 1);
-
-        open_writer(m_writer_self_intersection, output_dirname,
-                    "way-self-intersection");
-        open_writer(m_writer_spike, output_dirname, "way-spike");
-        open_writer(m_writer_acute_angle, output_dirname, "way-acute-angle");
-        open_writer(m_writer_duplicate_segment, output_dirname,
-                    "way-duplicate-segment");
-        open_writer(m_writer_no_node, output_dirname, "way-no-node");
-        open_writer(m_writer_single_node, output_dirname, "way-single-node");
-        open_writer(m_writer_same_node, output_dirname, "way-same-node");
-        open_writer(m_writer_duplicate_node, output_dirname,
-                    "way-duplicate-node"),
-            open_writer(m_writer_close_nodes, output_dirname,
-                        "way-close-nodes");
-        open_writer(m_writer_many_nodes, output_dirname, "way-many-nodes");
-        open_writer(m_writer_long_segment, output_dirname, "way-long-segment");
-    }
-
-    void way(osmium::Way const &way)
+    explicit WayChecker(options_type const &options)
+    : m_options(options), m_cos_max_angle(std::cos(options.max_angle)),
+      m_min_l1_long_segment(options.max_segment_length * (1.0 - 1.0e-9) /
+                            (osmium::geom::haversine::EARTH_RADIUS_IN_METERS *
+                             osmium::geom::deg_to_rad(
+                                 1.0 / osmium::detail::coordinate_precision)))
+    {}
+
+    void check(osmium::Way const &way, way_problems &problems,
+               stats_type &stats, check_scratch &scratch) const
     {
         if (way.timestamp() >= m_options.before_time) {
             return;
         }
 
         if (way.nodes().empty()) {
-            ++m_stats.no_node;
-            (*m_writer_no_node)(way);
+            if constexpr (enabled(problem_no_node)) {
+                ++stats.no_node;
+                problems.flags |= problem_no_node;
+            }
+            return;
+        }
+
+        stats.way_nodes += way.nodes().size();
+
+        if (way.nodes().size() == 1) {
+            if constexpr (enabled(problem_single_node)) {
+                ++stats.single_node;
+                problems.flags |= problem_single_node;
+            }
+            return;
+        }
+
+        if constexpr (!need_analysis) {
             return;
         }
 
-        m_stats.way_nodes += way.nodes().size();
+        auto analysis = analyze_nodes(way.nodes(), scratch);
+
+        if constexpr (enabled(problem_same_node) ||
+                      enabled(problem_duplicate_node)) {
+            if (analysis.same_nodes) {
+                if constexpr (enabled(problem_same_node)) {
+                    ++stats.same_node;
+                    problems.flags |= problem_same_node;
+                }
+                return;
+            }
+        }
+
+        if constexpr (enabled(problem_duplicate_node)) {
+            if (analysis.duplicate_node) {
+                ++stats.duplicate_node;
+                problems.flags |= problem_duplicate_node;
+            }
+        }
+
+        if constexpr (enabled(problem_long_segment)) {
+            if (analysis.long_segment) {
+                ++stats.long_segment;
+                problems.flags |= problem_long_segment;
+            }
+        }
+
+        if constexpr (!need_spikes) {
+            return;
+        }
+
+        if (analysis.num_segments < 2) {
+            return;
+        }
+
+        if (analysis.spike != 0) {
+            if constexpr (enabled(problem_spike)) {
+                add_spike(way.nodes(), analysis.spike, problems);
+                ++stats.spike;
+                problems.flags |= problem_spike;
+            }
+            return;
+        }
+
+        if constexpr (enabled(problem_acute_angle)) {
+            if (!analysis.acute_angles.empty()) {
+                problems.acute_angles = std::move(analysis.acute_angles);
+                ++stats.acute_angle;
+                problems.flags |= problem_acute_angle;
+            }
+        }
+
+        if constexpr (need_segment_pairs) {
+            check_segment_pairs(analysis.segments, problems, stats);
+        }
+
+        if constexpr (enabled(problem_close_nodes)) {
+            if (analysis.close_nodes) {
+                ++stats.close_nodes;
+                problems.flags |= problem_close_nodes;
+            }
+        }
+
+        if constexpr (enabled(problem_many_nodes)) {
+            if (way.nodes().size() > m_options.max_nodes) {
+                ++stats.many_nodes;
+                problems.flags |= problem_many_nodes;
+            }
+        }
+    }
+
+    checked_buffer check_buffer(osmium::memory::Buffer &&buffer) const
+    {
+        checked_buffer result{std::move(buffer), {}, {}};
+        check_scratch scratch;
+
+        for (auto const &way : result.buffer.select<osmium::Way>()) {
+            way_problems problems;
+            check(way, problems, result.stats, scratch);
+            if (problems.flags != 0) {
+                problems.way = &way;
+                result.problems.push_back(std::move(problems));
+            }
+        }
+
+        return result;
+    }
+
+}; // class WayChecker
+
+/**
+ * Writes out the problems found by the WayChecker to the database and the
+ * OSM files. Must be called with the ways in input order.
+ */
+class ProblemReporter : public HandlerWithDB
+{
+
+    stats_type m_stats;
+
+    // The checks asked for, bits from problem_flags.
+    uint32_t m_checks;
+
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_one_node;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_duplicate_nodes;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_intersection_points;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_intersection_lines;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_spike_points;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_spike_lines;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_acute_angle_points;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_acute_angle_lines;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_duplicate_segments;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_many_nodes;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_long_segments;
+    std::unique_ptr<gdalcpp::Layer> m_layer_way_crossing_points;
+
+    WriterMultiplexer m_writers{output_header()};
+
+    // Indexes of the outputs in m_writers, only set if the check is enabled.
+    std::size_t m_out_self_intersection = 0;
+    std::size_t m_out_spike = 0;
+    std::size_t m_out_acute_angle = 0;
+    std::size_t m_out_duplicate_segment = 0;
+    std::size_t m_out_no_node = 0;
+    std::size_t m_out_single_node = 0;
+    std::size_t m_out_same_node = 0;
+    std::size_t m_out_duplicate_node = 0;
+    std::size_t m_out_close_nodes = 0;
+    std::size_t m_out_many_nodes = 0;
+    std::size_t m_out_long_segment = 0;
+
+    void report_spike(osmium::Way const &way, way_problems const &problems,
+                      std::string const &ts)
+    {
+        {
+            gdalcpp::Feature feature{
+                *m_layer_way_spike_points,
+                m_factory.create_point(problems.spike_point)};
+            feature.set_field("way_id", static_cast<int32_t>(way.id()));
+            feature.set_field("timestamp", ts.c_str());
+            feature.set_field("closed", way.is_closed());
+            feature.add_to_layer();
+        }
+
+        {
+            std::unique_ptr<OGRLineString> linestring{new OGRLineString};
+            for (auto const &location : problems.spike_line) {
+                linestring->addPoint(location.lon(), location.lat());
+            }
+            gdalcpp::Feature feature{*m_layer_way_spike_lines,
+                                     std::move(linestring)};
+            feature.set_field("way_id", static_cast<int32_t>(way.id()));
+            feature.set_field("timestamp", ts.c_str());
+            feature.set_field("closed", way.is_closed());
+            feature.add_to_layer();
+        }
+    }
+
+    void report_acute_angles(osmium::Way const &way,
+                             way_problems const &problems,
+                             std::string const &ts)
+    {
+        for (auto const &aa : problems.acute_angles) {
+            {
+                gdalcpp::Feature feature{*m_layer_way_acute_angle_points,
+                                         m_factory.create_point(aa.curr)};
+                feature.set_field("way_id", static_cast<int32_t>(way.id()));
+                feature.set_field("timestamp", ts.c_str());
+                feature.set_field("closed", way.is_closed());
+                feature.set_field("angle", aa.angle);
+                feature.add_to_layer();
+            }
+            auto ogr_linestring = std::make_unique<OGRLineString>();
+            ogr_linestring->addPoint(aa.prev.lon(), aa.prev.lat());
+            ogr_linestring->addPoint(aa.curr.lon(), aa.curr.lat());
+            ogr_linestring->addPoint(aa.next.lon(), aa.next.lat());
+
+            gdalcpp::Feature feature{*m_layer_way_acute_angle_lines,
+                                     std::move(ogr_linestring)};
+            feature.set_field("way_id", static_cast<int32_t>(way.id()));
+            feature.set_field("timestamp", ts.c_str());
+            feature.set_field("closed", way.is_closed());
+            feature.set_field("angle", aa.angle);
+            feature.add_to_layer();
+        }
+    }
+
+    std::unique_ptr<gdalcpp::Layer> create_layer(char const *name,
+                                                 OGRwkbGeometryType type)
+    {
+        auto layer = std::make_unique<gdalcpp::Layer>(
+            m_dataset, name, type,
+            std::vector<std::string>{"SPATIAL_INDEX=NO"});
+        layer->add_field("way_id", OFTInteger, 10);
+        layer->add_field("timestamp", OFTString, 20);
+        return layer;
+    }
+
+    bool enabled(uint32_t flag) const noexcept
+    {
+        return (m_checks & flag) != 0;
+    }
+
+public:
+    /**
+     * Only the layers and files for the checks asked for are created.
+     */
+    ProblemReporter(std::string const &output_dirname, uint32_t checks,
+                    bool crossing_ways)
+    : HandlerWithDB(output_dirname + "/geoms-way-problems.db"),
+      m_checks(checks)
+    {
+        if (enabled(problem_single_node | problem_same_node)) {
+            m_layer_way_one_node = create_layer("way_one_node", wkbPoint);
+            m_layer_way_one_node->add_field("node_id", OFTReal, 12);
+            m_layer_way_one_node->add_field("num_nodes", OFTInteger, 3);
+        }
+
+        if (enabled(problem_duplicate_node)) {
+            m_layer_way_duplicate_nodes =
+                create_layer("way_duplicate_nodes", wkbPoint);
+            m_layer_way_duplicate_nodes->add_field("node_id", OFTReal, 12);
+            m_layer_way_duplicate_nodes->add_field("closed", OFTInteger, 1);
+            m_out_duplicate_node = m_writers.add_output(
+                output_file(output_dirname, "way-duplicate-node"));
+        }
+
+        if (enabled(problem_self_intersection)) {
+            m_layer_way_intersection_points =
+                create_layer("way_intersection_points", wkbPoint);
+            m_layer_way_intersection_points->add_field("closed", OFTInteger,
+                                                       1);
+            m_layer_way_intersection_lines =
+                create_layer("way_intersection_lines", wkbLineString);
+            m_layer_way_intersection_lines->add_field("closed", OFTInteger,
+                                                      1);
+            m_out_self_intersection = m_writers.add_output(
+                output_file(output_dirname, "way-self-intersection"));
+        }
+
+        if (enabled(problem_spike)) {
+            m_layer_way_spike_points =
+                create_layer("way_spike_points", wkbPoint);
+            m_layer_way_spike_points->add_field("closed", OFTInteger, 1);
+            m_layer_way_spike_lines =
+                create_layer("way_spike_lines", wkbLineString);
+            m_layer_way_spike_lines->add_field("closed", OFTInteger, 1);
+            m_out_spike = m_writers.add_output(
+                output_file(output_dirname, "way-spike"));
+        }
+
+        if (enabled(problem_acute_angle)) {
+            m_layer_way_acute_angle_points =
+                create_layer("way_acute_angle_points", wkbPoint);
+            m_layer_way_acute_angle_points->add_field("closed", OFTInteger,
+                                                      1);
+            m_layer_way_acute_angle_points->add_field("angle", OFTReal, 20);
+            m_layer_way_acute_angle_lines =
+                create_layer("way_acute_angle_lines", wkbLineString);
+            m_layer_way_acute_angle_lines->add_field("closed", OFTInteger, 1);
+            m_layer_way_acute_angle_lines->add_field("angle", OFTReal, 20);
+            m_out_acute_angle = m_writers.add_output(
+                output_file(output_dirname, "way-acute-angle"));
+        }
+
+        if (enabled(problem_duplicate_segment)) {
+            m_layer_way_duplicate_segments =
+                create_layer("way_duplicate_segments", wkbLineString);
+            m_layer_way_duplicate_segments->add_field("closed", OFTInteger,
+                                                      1);
+            m_out_duplicate_segment = m_writers.add_output(
+                output_file(output_dirname, "way-duplicate-segment"));
+        }
+
+        if (enabled(problem_many_nodes)) {
+            m_layer_way_many_nodes =
+                create_layer("way_many_nodes", wkbLineString);
+            m_layer_way_many_nodes->add_field("num_nodes", OFTInteger, 4);
+            m_layer_way_many_nodes->add_field("closed", OFTInteger, 1);
+            m_out_many_nodes = m_writers.add_output(
+                output_file(output_dirname, "way-many-nodes"));
+        }
+
+        if (enabled(problem_long_segment)) {
+            m_layer_way_long_segments =
+                create_layer("way_long_segments", wkbLineString);
+            m_layer_way_long_segments->add_field("closed", OFTInteger, 1);
+            m_out_long_segment = m_writers.add_output(
+                output_file(output_dirname, "way-long-segment"));
+        }
+
+        if (crossing_ways) {
+            m_layer_way_crossing_points = std::make_unique<gdalcpp::Layer>(
+                m_dataset, "way_crossing_points", wkbPoint,
+                std::vector<std::string>{"SPATIAL_INDEX=NO"});
+            m_layer_way_crossing_points->add_field("way1_id", OFTInteger, 10);
+            m_layer_way_crossing_points->add_field("way2_id", OFTInteger, 10);
+        }
+
+        if (enabled(problem_no_node)) {
+            m_out_no_node = m_writers.add_output(
+                output_file(output_dirname, "way-no-node"));
+        }
+        if (enabled(problem_single_node)) {
+            m_out_single_node = m_writers.add_output(
+                output_file(output_dirname, "way-single-node"));
+        }
+        if (enabled(problem_same_node)) {
+            m_out_same_node = m_writers.add_output(
+                output_file(output_dirname, "way-same-node"));
+        }
+        if (enabled(problem_close_nodes)) {
+            m_out_close_nodes = m_writers.add_output(
+                output_file(output_dirname, "way-close-nodes"));
+        }
+    }
+
+    void report(way_problems const &problems)
+    {
+        osmium::Way const &way = *problems.way;
+        auto const flags = problems.flags & m_checks;
+
+        if (flags & problem_no_node) {
+            m_writers(m_out_no_node, way);
+            return;
+        }
 
         auto const ts = way.timestamp().to_iso();
 
-        if (way.nodes().size() == 1) {
-            ++m_stats.single_node;
-            (*m_writer_single_node)(way);
-            gdalcpp::Feature feature{m_layer_way_one_node,
+        if (flags & problem_single_node) {
+            m_writers(m_out_single_node, way);
+            gdalcpp::Feature feature{*m_layer_way_one_node,
                                      m_factory.create_point(way.nodes()[0])};
             feature.set_field("way_id", static_cast<int32_t>(way.id()));
             feature.set_field("node_id",
@@ -478,10 +1677,9 @@ public:
             return;
         }
 
-        if (all_same_nodes(way.nodes())) {
-            ++m_stats.same_node;
-            (*m_writer_same_node)(way);
-            gdalcpp::Feature feature{m_layer_way_one_node,
+        if (flags & problem_same_node) {
+            m_writers(m_out_same_node, way);
+            gdalcpp::Feature feature{*m_layer_way_one_node,
                                      m_factory.create_point(way.nodes()[0])};
             feature.set_field("way_id", static_cast<int32_t>(way.id()));
             feature.set_field("node_id",
@@ -493,10 +1691,9 @@ public:
             return;
         }
 
-        if (duplicate_nodes(way.nodes())) {
-            ++m_stats.duplicate_node;
-            (*m_writer_duplicate_node)(way);
-            gdalcpp::Feature feature{m_layer_way_duplicate_nodes,
+        if (flags & problem_duplicate_node) {
+            m_writers(m_out_duplicate_node, way);
+            gdalcpp::Feature feature{*m_layer_way_duplicate_nodes,
                                      m_factory.create_point(way.nodes()[0])};
             feature.set_field("way_id", static_cast<int32_t>(way.id()));
             feature.set_field("node_id",
@@ -506,78 +1703,50 @@ public:
             feature.add_to_layer();
         }
 
-        auto segments = create_segment_list(way.nodes());
-
-        for (auto const &segment : segments) {
-            auto const distance = osmium::geom::haversine::distance(
-                segment.first(), segment.second());
-            if (distance > m_options.max_segment_length) {
-                ++m_stats.long_segment;
-                (*m_writer_long_segment)(way);
-                gdalcpp::Feature feature{m_layer_way_long_segments,
-                                         m_factory.create_linestring(way)};
-                feature.set_field("way_id", static_cast<int32_t>(way.id()));
-                feature.set_field("timestamp", ts.c_str());
-                feature.set_field("closed", way.is_closed());
-                feature.add_to_layer();
-                break;
-            }
-        }
-
-        if (segments.size() < 2) {
-            return;
+        if (flags & problem_long_segment) {
+            m_writers(m_out_long_segment, way);
+            gdalcpp::Feature feature{*m_layer_way_long_segments,
+                                     m_factory.create_linestring(way)};
+            feature.set_field("way_id", static_cast<int32_t>(way.id()));
+            feature.set_field("timestamp", ts.c_str());
+            feature.set_field("closed", way.is_closed());
+            feature.add_to_layer();
         }
 
-        if (detect_spikes(way)) {
-            ++m_stats.spike;
-            (*m_writer_spike)(way);
+        if (flags & problem_spike) {
+            m_writers(m_out_spike, way);
+            report_spike(way, problems, ts);
             return;
         }
 
-        if (detect_acute_angles(way)) {
-            ++m_stats.acute_angle;
-            (*m_writer_acute_angle)(way);
+        if (flags & problem_acute_angle) {
+            m_writers(m_out_acute_angle, way);
+            report_acute_angles(way, problems, ts);
         }
 
-        std::sort(segments.begin(), segments.end());
-
-        std::vector<osmium::Location> intersections;
-        for (auto it1 = segments.cbegin(); it1 != segments.cend() - 1; ++it1) {
-            osmium::UndirectedSegment const &s1 = *it1;
-            for (auto it2 = it1 + 1; it2 != segments.cend(); ++it2) {
-                osmium::UndirectedSegment const &s2 = *it2;
-                if (s1 == s2) {
-                    ++m_stats.duplicate_segment;
-                    (*m_writer_duplicate_segment)(way);
-                    std::unique_ptr<OGRLineString> linestring{
-                        new OGRLineString{}};
-                    linestring->addPoint(s1.first().lon(), s1.first().lat());
-                    linestring->addPoint(s1.second().lon(), s1.second().lat());
-                    gdalcpp::Feature feature{m_layer_way_duplicate_segments,
-                                             std::move(linestring)};
-                    feature.set_field("way_id", static_cast<int32_t>(way.id()));
-                    feature.set_field("timestamp", ts.c_str());
-                    feature.set_field("closed", way.is_closed());
-                    feature.add_to_layer();
-                } else {
-                    if (outside_x_range(s2, s1)) {
-                        break;
-                    }
-                    if (y_range_overlap(s1, s2)) {
-                        osmium::Location const i = intersection(s1, s2);
-                        if (i) {
-                            intersections.push_back(i);
-                        }
-                    }
-                }
+        if (flags & problem_duplicate_segment) {
+            for (auto const &segment : problems.duplicate_segments) {
+                m_writers(m_out_duplicate_segment, way);
+                std::unique_ptr<OGRLineString> linestring{
+                    new OGRLineString{}};
+                linestring->addPoint(segment.first().lon(),
+                                     segment.first().lat());
+                linestring->addPoint(segment.second().lon(),
+                                     segment.second().lat());
+                gdalcpp::Feature feature{*m_layer_way_duplicate_segments,
+                                         std::move(linestring)};
+                feature.set_field("way_id", static_cast<int32_t>(way.id()));
+                feature.set_field("timestamp", ts.c_str());
+                feature.set_field("closed", way.is_closed());
+                feature.add_to_layer();
             }
         }
-        if (!intersections.empty()) {
-            ++m_stats.self_intersection;
-            (*m_writer_self_intersection)(way);
 
-            for (auto const &location : intersections) {
-                gdalcpp::Feature feature{m_layer_way_intersection_points,
+        if (flags & problem_self_intersection) {
+            m_writers(m_out_self_intersection, way);
+
+            for (auto const &location : problems.intersections) {
+                gdalcpp::Feature feature{*m_layer_way_intersection_points,
                                          m_factory.create_point(location)};
                 feature.set_field("way_id", static_cast<int32_t>(way.id()));
                 feature.set_field("timestamp", ts.c_str());
@@ -586,7 +1755,7 @@ public:
             }
 
             {
-                gdalcpp::Feature feature{m_layer_way_intersection_lines,
+                gdalcpp::Feature feature{*m_layer_way_intersection_lines,
                                          m_factory.create_linestring(way)};
                 feature.set_field("way_id", static_cast<int32_t>(way.id()));
                 feature.set_field("timestamp", ts.c_str());
@@ -595,15 +1764,13 @@ public:
             }
         }
 
-        if (has_close_nodes(way.nodes())) {
-            ++m_stats.close_nodes;
-            (*m_writer_close_nodes)(way);
+        if (flags & problem_close_nodes) {
+            m_writers(m_out_close_nodes, way);
         }
 
-        if (way.nodes().size() > m_options.max_nodes) {
-            ++m_stats.many_nodes;
-            (*m_writer_many_nodes)(way);
-            gdalcpp::Feature feature{m_layer_way_many_nodes,
+        if (flags & problem_many_nodes) {
+            m_writers(m_out_many_nodes, way);
+            gdalcpp::Feature feature{*m_layer_way_many_nodes,
                                      m_factory.create_linestring(way)};
             feature.set_field("way_id", static_cast<int32_t>(way.id()));
             feature.set_field("timestamp", ts.c_str());
@@ -614,24 +1781,33 @@ public:
         }
     }
 
-    void close()
+    void report(std::vector<crossing_type> const &crossings)
+    {
+        m_stats.crossing_points += crossings.size();
+        for (auto const &crossing : crossings) {
+            gdalcpp::Feature feature{*m_layer_way_crossing_points,
+                                     m_factory.create_point(crossing.location)};
+            feature.set_field("way1_id",
+                              static_cast<int32_t>(crossing.way1_id));
+            feature.set_field("way2_id",
+                              static_cast<int32_t>(crossing.way2_id));
+            feature.add_to_layer();
+        }
+    }
+
+    void report(checked_buffer const &cb)
     {
-        (*m_writer_self_intersection).close();
-        (*m_writer_spike).close();
-        (*m_writer_acute_angle).close();
-        (*m_writer_duplicate_segment).close();
-        (*m_writer_no_node).close();
-        (*m_writer_single_node).close();
-        (*m_writer_same_node).close();
-        (*m_writer_duplicate_node).close();
-        (*m_writer_close_nodes).close();
-        (*m_writer_many_nodes).close();
-        (*m_writer_long_segment).close();
+        m_stats += cb.stats;
+        for (auto const &problems : cb.problems) {
+            report(problems);
+        }
     }
 
+    void close() { m_writers.close(); }
+
     [[nodiscard]] stats_type const &stats() const noexcept { return m_stats; }
 
-}; // class CheckHandler
+}; // class ProblemReporter
 
 static void print_help()
 {
@@ -644,10 +1820,53 @@ static void print_help()
                  "before\n"
               << "                          this time (format: "
                  "yyyy-mm-ddThh:mm:ssZ)\n"
+              << "  -c, --checks=LIST       Comma-separated list of checks to "
+                 "run (default: all)\n"
               << "  -h, --help              This help message\n"
+              << "  -l, --locations=INDEX   Node location index used with "
+                 "--update\n"
+              << "                          (format: TYPE,FILENAME, for "
+                 "example\n"
+              << "                          dense_file_array,locations.idx)\n"
               << "  -m, --max-nodes=NUM     Report ways with more nodes than "
                  "this (default: 1800).\n"
-              << "  -q, --quiet             Work quietly\n";
+              << "  -q, --quiet             Work quietly\n"
+              << "  -t, --threads=NUM       Number of threads used for "
+                 "checking (default: 1)\n"
+              << "  -u, --update            Update the results in OUTPUT-DIR "
+                 "from the change\n"
+              << "                          file OSM-FILE\n"
+              << "  -w, --write-state       Write the state needed for "
+                 "--update\n"
+              << "  -x, --crossing-ways=KEYS\n"
+              << "                          Find crossings between ways with "
+                 "any of these\n"
+              << "                          comma-separated keys\n"
+              << "\nChecks:\n";
+    all_checks::for_each(
+        [](auto check) { std::cout << "  " << check.name << '\n'; });
+}
+
+static uint32_t parse_checks(char const *list)
+{
+    uint32_t checks = 0;
+
+    for (auto const &name : osmium::split_string(list, ',')) {
+        uint32_t flag = 0;
+        all_checks::for_each([&](auto check) {
+            if (name == check.name) {
+                flag = check.flag;
+            }
+        });
+        if (flag == 0) {
+            std::cerr << "Unknown check '" << name << "'. Call '"
+                      << program_name << " --help' for a list of checks.\n";
+            std::exit(2);
+        }
+        checks |= flag;
+    }
+
+    return checks;
 }
 
 static options_type parse_command_line(int argc, char *argv[])
@@ -655,16 +1874,22 @@ static options_type parse_command_line(int argc, char *argv[])
     static struct option long_options[] = {
         {"age", required_argument, nullptr, 'a'},
         {"before", required_argument, nullptr, 'b'},
+        {"checks", required_argument, nullptr, 'c'},
         {"help", no_argument, nullptr, 'h'},
+        {"locations", required_argument, nullptr, 'l'},
         {"max-nodes", no_argument, nullptr, 'm'},
         {"quiet", no_argument, nullptr, 'q'},
+        {"threads", required_argument, nullptr, 't'},
+        {"update", no_argument, nullptr, 'u'},
+        {"write-state", no_argument, nullptr, 'w'},
+        {"crossing-ways", required_argument, nullptr, 'x'},
         {nullptr, 0, nullptr, 0}};
 
     options_type options;
 
     while (true) {
-        int const c =
-            getopt_long(argc, argv, "a:b:hm:q", long_options, nullptr);
+        int const c = getopt_long(argc, argv, "a:b:c:hl:m:qt:uwx:",
+                                  long_options, nullptr);
         if (c == -1) {
             break;
         }
@@ -686,9 +1911,15 @@ static options_type parse_command_line(int argc, char *argv[])
             }
             options.before_time = osmium::Timestamp{optarg};
             break;
+        case 'c':
+            options.checks = parse_checks(optarg);
+            break;
         case 'h':
             print_help();
             std::exit(0);
+        case 'l':
+            options.locations_index = optarg;
+            break;
         case 'm':
             options.max_nodes = std::atoi(optarg);
             break;
@@ -698,6 +1929,22 @@ static options_type parse_command_line(int argc, char *argv[])
         case 'q':
             options.verbose = false;
             break;
+        case 't':
+            options.num_threads = std::atoi(optarg);
+            if (options.num_threads < 1) {
+                std::cerr << "Number of threads must be at least 1\n";
+                std::exit(2);
+            }
+            break;
+        case 'u':
+            options.update = true;
+            break;
+        case 'w':
+            options.write_state = true;
+            break;
+        case 'x':
+            options.crossing_keys = osmium::split_string(optarg, ',', true);
+            break;
         default:
             std::exit(2);
         }
@@ -712,9 +1959,680 @@ static options_type parse_command_line(int argc, char *argv[])
         std::exit(2);
     }
 
+    if (options.update) {
+        if (options.checks != 0 || !options.crossing_keys.empty() ||
+            options.before_time != osmium::end_of_time() ||
+            options.write_state) {
+            std::cerr << "You can not use -c, -x, -a, -b, or -w together "
+                         "with -u,--update\n";
+            std::exit(2);
+        }
+        if (options.locations_index.empty()) {
+            std::cerr << "Option -l,--locations is needed with "
+                         "-u,--update\n";
+            std::exit(2);
+        }
+    } else if (!options.locations_index.empty()) {
+        std::cerr << "Option -l,--locations is only used with -u,--update\n";
+        std::exit(2);
+    }
+
+    if (options.write_state && (!options.crossing_keys.empty() ||
+                                options.before_time != osmium::end_of_time())) {
+        std::cerr << "You can not use -x, -a, or -b together with "
+                     "-w,--write-state\n";
+        std::exit(2);
+    }
+
+    if (options.checks == 0) {
+        options.checks = all_checks::mask;
+    }
+
     return options;
 }
 
+// Names of all checks in the mask.
+static std::string check_names(uint32_t checks)
+{
+    std::string names;
+    all_checks::for_each([&](auto check) {
+        if (checks & check.flag) {
+            if (!names.empty()) {
+                names += ',';
+            }
+            names += check.name;
+        }
+    });
+    return names;
+}
+
+// Remember the problems of a way in the state.
+static void add_way_state(StateWriter &state_writer,
+                          way_problems const &problems, uint32_t checks)
+{
+    auto const flags = problems.flags & checks;
+    if (flags != 0) {
+        state_writer.add_problem(
+            {problems.way->id(), flags,
+             static_cast<uint32_t>(problems.duplicate_segments.size())});
+    }
+}
+
+// Calculate the stats from the problems of all ways in the state.
+static stats_type stats_from_state(state_header const &header,
+                                   std::vector<way_state> const &problems)
+{
+    stats_type stats;
+    stats.way_nodes = header.way_nodes;
+
+    for (auto const &p : problems) {
+        if (p.flags & problem_self_intersection) {
+            ++stats.self_intersection;
+        }
+        if (p.flags & problem_spike) {
+            ++stats.spike;
+        }
+        if (p.flags & problem_acute_angle) {
+            ++stats.acute_angle;
+        }
+        if (p.flags & problem_duplicate_segment) {
+            stats.duplicate_segment += p.duplicate_segments;
+        }
+        if (p.flags & problem_no_node) {
+            ++stats.no_node;
+        }
+        if (p.flags & problem_single_node) {
+            ++stats.single_node;
+        }
+        if (p.flags & problem_same_node) {
+            ++stats.same_node;
+        }
+        if (p.flags & problem_duplicate_node) {
+            ++stats.duplicate_node;
+        }
+        if (p.flags & problem_close_nodes) {
+            ++stats.close_nodes;
+        }
+        if (p.flags & problem_many_nodes) {
+            ++stats.many_nodes;
+        }
+        if (p.flags & problem_long_segment) {
+            ++stats.long_segment;
+        }
+    }
+
+    return stats;
+}
+
+static void write_way_stats(std::string const &output_dirname,
+                            osmium::Timestamp const &timestamp,
+                            options_type const &options,
+                            stats_type const &stats)
+{
+    write_stats(output_dirname + "/stats-way-problems.db", timestamp,
+                [&](std::function<void(char const *, uint64_t)> &add) {
+                    add("way_nodes", stats.way_nodes);
+                    all_checks::for_each([&](auto check) {
+                        if (options.checks & check.flag) {
+                            std::string name{"way_"};
+                            name += check.name;
+                            std::replace(name.begin(), name.end(), '-', '_');
+                            add(name.c_str(), check.stat(stats));
+                        }
+                    });
+                    if (!options.crossing_keys.empty()) {
+                        add("way_crossing_points", stats.crossing_points);
+                    }
+                });
+}
+
+template <typename TCheckSet>
+static void check_ways(options_type const &options, osmium::io::Reader &reader,
+                       LastTimestampHandler &last_timestamp_handler,
+                       ProblemReporter &handler,
+                       CrossingFinder *crossing_finder,
+                       StateWriter *state_writer)
+{
+    WayChecker<TCheckSet> const checker{options};
+
+    // Called for every buffer in input order before it is checked.
+    auto const add_buffer = [&](osmium::memory::Buffer const &buffer) {
+        osmium::apply(buffer, last_timestamp_handler);
+        if (crossing_finder) {
+            crossing_finder->add_buffer(buffer);
+        }
+        if (state_writer) {
+            state_writer->add_buffer(buffer);
+        }
+    };
+
+    // Called for every checked buffer in input order.
+    auto const report = [&](checked_buffer const &cb) {
+        handler.report(cb);
+        if (state_writer) {
+            for (auto const &problems : cb.problems) {
+                add_way_state(*state_writer, problems, options.checks);
+            }
+        }
+    };
+
+    osmium::ProgressBar progress_bar{reader.file_size(), display_progress()};
+    if (options.num_threads == 1) {
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            progress_bar.update(reader.offset());
+            add_buffer(buffer);
+            report(checker.check_buffer(std::move(buffer)));
+        }
+    } else {
+        // Buffers are checked in the thread pool, the results are written
+        // out in input order from this thread. The queue limits the number
+        // of buffers in flight.
+        osmium::thread::Pool pool{options.num_threads};
+        std::deque<std::future<checked_buffer>> queue;
+        auto const max_queue_size =
+            static_cast<std::size_t>(options.num_threads) * 4;
+
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            progress_bar.update(reader.offset());
+            add_buffer(buffer);
+            queue.push_back(
+                pool.submit([&checker, b = std::move(buffer)]() mutable {
+                    return checker.check_buffer(std::move(b));
+                }));
+            if (queue.size() >= max_queue_size) {
+                report(queue.front().get());
+                queue.pop_front();
+            }
+        }
+
+        for (auto &future : queue) {
+            report(future.get());
+        }
+    }
+    progress_bar.done();
+}
+
+// Find crossings in all buckets and report them. Returns the ids of all
+// ways with crossings.
+static osmium::index::IdSetDense<osmium::unsigned_object_id_type>
+find_crossings(options_type const &options, CrossingFinder &crossing_finder,
+               ProblemReporter &handler)
+{
+    osmium::index::IdSetDense<osmium::unsigned_object_id_type> way_ids;
+
+    auto const report = [&](std::vector<crossing_type> const &crossings) {
+        for (auto const &crossing : crossings) {
+            way_ids.set(static_cast<osmium::unsigned_object_id_type>(
+                crossing.way1_id));
+            way_ids.set(static_cast<osmium::unsigned_object_id_type>(
+                crossing.way2_id));
+        }
+        handler.report(crossings);
+    };
+
+    crossing_finder.flush();
+    auto const num_buckets =
+        static_cast<unsigned int>(crossing_finder.num_buckets());
+
+    if (options.num_threads == 1) {
+        for (unsigned int n = 0; n < num_buckets; ++n) {
+            report(crossing_finder.find_in_bucket(n));
+        }
+    } else {
+        // Only a few buckets are in flight at the same time, so only their
+        // segments have to be in memory.
+        osmium::thread::Pool pool{options.num_threads};
+        std::deque<std::future<std::vector<crossing_type>>> queue;
+        auto const max_queue_size =
+            static_cast<std::size_t>(options.num_threads);
+
+        for (unsigned int n = 0; n < num_buckets; ++n) {
+            queue.push_back(pool.submit([&crossing_finder, n]() {
+                return crossing_finder.find_in_bucket(n);
+            }));
+            if (queue.size() > max_queue_size) {
+                report(queue.front().get());
+                queue.pop_front();
+            }
+        }
+
+        for (auto &future : queue) {
+            report(future.get());
+        }
+    }
+
+    return way_ids;
+}
+
+// Copy all ways with crossings from the input file into an OSM file.
+static void copy_crossing_ways(
+    osmium::io::File const &file, std::string const &output_dirname,
+    osmium::index::IdSetDense<osmium::unsigned_object_id_type> const &way_ids)
+{
+    std::unique_ptr<osmium::io::Writer> writer;
+    open_writer(writer, output_dirname, "way-crossing-ways");
+
+    osmium::io::Reader reader{file, osmium::osm_entity_bits::way};
+    osmium::ProgressBar progress_bar{reader.file_size(), display_progress()};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        progress_bar.update(reader.offset());
+        for (auto const &way : buffer.select<osmium::Way>()) {
+            if (way_ids.get(way.positive_id())) {
+                (*writer)(way);
+            }
+        }
+    }
+    progress_bar.done();
+
+    reader.close();
+    writer->close();
+}
+
+// The newest version of all nodes and ways in a change file.
+struct change_set
+{
+    osmium::memory::Buffer buffer{1024 * 1024,
+                                  osmium::memory::Buffer::auto_grow::yes};
+
+    // sorted by id
+    std::vector<osmium::Node const *> nodes;
+
+    // sorted by id
+    std::vector<osmium::Way const *> ways;
+};
+
+// Sort objects by id and keep only the newest version of each object.
+template <typename T>
+static void keep_latest_versions(std::vector<T const *> &objects)
+{
+    std::sort(objects.begin(), objects.end(), [](T const *a, T const *b) {
+        return std::make_tuple(a->id(), a->version()) <
+               std::make_tuple(b->id(), b->version());
+    });
+    auto const last = std::unique(
+        objects.rbegin(), objects.rend(),
+        [](T const *a, T const *b) { return a->id() == b->id(); });
+    objects.erase(objects.begin(), last.base());
+}
+
+static void read_change_file(std::string const &filename, change_set &changes)
+{
+    osmium::io::Reader reader{filename, osmium::osm_entity_bits::node |
+                                            osmium::osm_entity_bits::way};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        changes.buffer.add_buffer(buffer);
+        changes.buffer.commit();
+    }
+    reader.close();
+
+    for (auto const &node : changes.buffer.select<osmium::Node>()) {
+        changes.nodes.push_back(&node);
+    }
+    for (auto const &way : changes.buffer.select<osmium::Way>()) {
+        changes.ways.push_back(&way);
+    }
+    keep_latest_versions(changes.nodes);
+    keep_latest_versions(changes.ways);
+}
+
+template <typename T>
+static T const *find_object(std::vector<T const *> const &objects,
+                            osmium::object_id_type id)
+{
+    auto const it = std::lower_bound(
+        objects.cbegin(), objects.cend(), id,
+        [](T const *object, osmium::object_id_type i) {
+            return object->id() < i;
+        });
+    if (it == objects.cend() || (*it)->id() != id) {
+        return nullptr;
+    }
+    return *it;
+}
+
+// Replace all features of the ways with the ids in the database by the
+// features from the update database.
+static void merge_database(std::string const &filename,
+                           std::string const &update_filename,
+                           std::vector<osmium::object_id_type> const &way_ids)
+{
+    GDALDatasetUniquePtr dataset{GDALDataset::Open(
+        filename.c_str(), GDAL_OF_VECTOR | GDAL_OF_UPDATE)}; // NOLINT
+    if (!dataset) {
+        throw std::runtime_error{"Can't open database '" + filename + "'"};
+    }
+    GDALDatasetUniquePtr update{
+        GDALDataset::Open(update_filename.c_str(), GDAL_OF_VECTOR)};
+    if (!update) {
+        throw std::runtime_error{"Can't open database '" + update_filename +
+                                 "'"};
+    }
+
+    std::vector<std::string> layer_names;
+    for (int i = 0; i < dataset->GetLayerCount(); ++i) {
+        auto *layer = dataset->GetLayer(i);
+        if (layer->GetLayerDefn()->GetFieldIndex("way_id") >= 0) {
+            layer_names.emplace_back(layer->GetName());
+        }
+    }
+
+    auto const exec = [&](std::string const &sql) {
+        dataset->ReleaseResultSet(
+            dataset->ExecuteSQL(sql.c_str(), nullptr, nullptr));
+    };
+
+    dataset->StartTransaction();
+
+    exec("CREATE TABLE rechecked_ways (way_id INTEGER PRIMARY KEY)");
+    constexpr std::size_t const batch_size = 1000;
+    for (std::size_t i = 0; i < way_ids.size(); i += batch_size) {
+        std::string sql{"INSERT INTO rechecked_ways (way_id) VALUES "};
+        auto const end = std::min(i + batch_size, way_ids.size());
+        for (std::size_t j = i; j < end; ++j) {
+            if (j != i) {
+                sql += ',';
+            }
+            sql += '(';
+            sql += std::to_string(way_ids[j]);
+            sql += ')';
+        }
+        exec(sql);
+    }
+
+    for (auto const &name : layer_names) {
+        exec("DELETE FROM \"" + name +
+             "\" WHERE way_id IN (SELECT way_id FROM rechecked_ways)");
+
+        auto *layer = dataset->GetLayerByName(name.c_str());
+        auto *update_layer = update->GetLayerByName(name.c_str());
+        if (!layer || !update_layer) {
+            continue;
+        }
+        update_layer->ResetReading();
+        while (OGRFeatureUniquePtr feature{update_layer->GetNextFeature()}) {
+            OGRFeatureUniquePtr copy{
+                OGRFeature::CreateFeature(layer->GetLayerDefn())};
+            copy->SetFrom(feature.get());
+            if (layer->CreateFeature(copy.get()) != OGRERR_NONE) {
+                throw std::runtime_error{"Can't add feature to layer '" +
+                                         name + "'"};
+            }
+        }
+    }
+
+    exec("DROP TABLE rechecked_ways");
+
+    dataset->CommitTransaction();
+}
+
+// Replace the ways with the ids in the OSM file written by a full run by
+// the ways in the OSM file with the same name from the update directory.
+static void merge_osm_file(std::string const &output_dirname,
+                           std::string const &update_dirname,
+                           std::string const &name,
+                           std::vector<osmium::object_id_type> const &way_ids)
+{
+    osmium::memory::Buffer new_ways{1024 * 1024,
+                                    osmium::memory::Buffer::auto_grow::yes};
+    {
+        osmium::io::Reader reader{update_dirname + "/" + name + ".osm.pbf",
+                                  osmium::osm_entity_bits::way};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            new_ways.add_buffer(buffer);
+            new_ways.commit();
+        }
+        reader.close();
+    }
+
+    std::unique_ptr<osmium::io::Writer> writer;
+    open_writer(writer, output_dirname, name + "-new");
+
+    auto const ways = new_ways.select<osmium::Way>();
+    auto it = ways.cbegin();
+
+    osmium::io::Reader reader{output_dirname + "/" + name + ".osm.pbf",
+                              osmium::osm_entity_bits::way};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        for (auto const &way : buffer.select<osmium::Way>()) {
+            for (; it != ways.cend() && it->id() < way.id(); ++it) {
+                (*writer)(*it);
+            }
+            if (!std::binary_search(way_ids.cbegin(), way_ids.cend(),
+                                    way.id())) {
+                (*writer)(way);
+            }
+        }
+    }
+    reader.close();
+
+    for (; it != ways.cend(); ++it) {
+        (*writer)(*it);
+    }
+    writer->close();
+
+    rename_file(output_dirname + "/" + name + "-new.osm.pbf",
+                output_dirname + "/" + name + ".osm.pbf");
+}
+
+static std::vector<node_way> node_ways_of(osmium::Way const &way)
+{
+    std::vector<node_way> records;
+    records.reserve(way.nodes().size());
+    for (auto const &node_ref : way.nodes()) {
+        records.push_back({node_ref.ref(), way.id()});
+    }
+    return records;
+}
+
+/**
+ * Update the results of a full run written with --write-state from a
+ * change file. Only the ways changed in the change file and the ways
+ * referencing changed nodes are checked again.
+ */
+static void update_from_change_file(options_type const &options,
+                                    std::string const &change_filename,
+                                    std::string const &output_dirname,
+                                    osmium::util::VerboseOutput &vout)
+{
+    std::string const state_dirname{output_dirname + "/state"};
+    std::string const update_dirname{output_dirname + "/update"};
+
+    auto header = read_state_header(state_dirname);
+    vout << "  State was written with checks: "
+         << check_names(header.checks) << '\n';
+
+    vout << "Reading change file...\n";
+    change_set changes;
+    read_change_file(change_filename, changes);
+    vout << "  " << changes.nodes.size() << " changed nodes, "
+         << changes.ways.size() << " changed ways.\n";
+
+    std::vector<osmium::object_id_type> changed_node_ids;
+    changed_node_ids.reserve(changes.nodes.size());
+    for (auto const *node : changes.nodes) {
+        changed_node_ids.push_back(node->id());
+    }
+
+    std::vector<osmium::object_id_type> changed_way_ids;
+    changed_way_ids.reserve(changes.ways.size());
+    for (auto const *way : changes.ways) {
+        changed_way_ids.push_back(way->id());
+    }
+
+    vout << "Finding ways affected by changed nodes...\n";
+    auto const node_way_ids =
+        find_state_ways_for_nodes(state_dirname, changed_node_ids);
+    std::vector<osmium::object_id_type> way_ids;
+    std::set_union(changed_way_ids.cbegin(), changed_way_ids.cend(),
+                   node_way_ids.cbegin(), node_way_ids.cend(),
+                   std::back_inserter(way_ids));
+    vout << "  " << way_ids.size() << " ways to check again.\n";
+
+    vout << "Reading affected ways from state...\n";
+    osmium::memory::Buffer old_ways{1024 * 1024,
+                                    osmium::memory::Buffer::auto_grow::yes};
+    read_state_ways(state_dirname, way_ids, [&](osmium::Way const &way) {
+        old_ways.add_item(way);
+        old_ways.commit();
+    });
+    std::vector<osmium::Way const *> old_way_ptrs;
+    for (auto const &way : old_ways.select<osmium::Way>()) {
+        old_way_ptrs.push_back(&way);
+    }
+    keep_latest_versions(old_way_ptrs);
+
+    // Newest version of all affected ways (sorted by id) without deleted
+    // ways.
+    osmium::memory::Buffer ways{1024 * 1024,
+                                osmium::memory::Buffer::auto_grow::yes};
+    for (auto const id : way_ids) {
+        auto const *way = find_object(changes.ways, id);
+        if (!way) {
+            way = find_object(old_way_ptrs, id);
+        }
+        if (way && way->visible()) {
+            ways.add_item(*way);
+            ways.commit();
+        }
+    }
+
+    vout << "Looking up node locations...\n";
+    auto location_index =
+        osmium::index::MapFactory<osmium::unsigned_object_id_type,
+                                  osmium::Location>::instance()
+            .create_map(options.locations_index);
+    uint64_t missing_locations = 0;
+    for (auto &way : ways.select<osmium::Way>()) {
+        for (auto &node_ref : way.nodes()) {
+            auto const *node = find_object(changes.nodes, node_ref.ref());
+            if (node) {
+                node_ref.set_location(node->location());
+            } else {
+                node_ref.set_location(location_index->get_noexcept(
+                    static_cast<osmium::unsigned_object_id_type>(
+                        node_ref.ref())));
+            }
+            if (!node_ref.location().valid()) {
+                ++missing_locations;
+            }
+        }
+    }
+    location_index.reset();
+    if (missing_locations > 0) {
+        vout << "  " << missing_locations << " node locations not found.\n";
+    }
+
+    vout << "Checking ways...\n";
+    create_state_directory(update_dirname);
+    std::string const database_name{update_dirname +
+                                    "/geoms-way-problems.db"};
+    ::unlink(database_name.c_str());
+
+    std::vector<way_state> new_problems;
+    {
+        options_type check_options{options};
+        check_options.checks = header.checks;
+
+        ProblemReporter handler{update_dirname, header.checks, false};
+
+        constexpr auto const num_check_sets = std::tuple_size_v<check_sets>;
+        with_check_set(
+            find_check_set(header.checks,
+                           std::make_index_sequence<num_check_sets>{}),
+            [&](auto check_set) {
+                WayChecker<decltype(check_set)> const checker{check_options};
+                auto const cb = checker.check_buffer(std::move(ways));
+                handler.report(cb);
+                for (auto const &problems : cb.problems) {
+                    auto const flags = problems.flags & header.checks;
+                    if (flags != 0) {
+                        new_problems.push_back(
+                            {problems.way->id(), flags,
+                             static_cast<uint32_t>(
+                                 problems.duplicate_segments.size())});
+                    }
+                }
+            },
+            std::make_index_sequence<num_check_sets>{});
+
+        handler.close();
+    }
+    vout << "  " << new_problems.size() << " ways with problems.\n";
+
+    vout << "Merging results...\n";
+    merge_database(output_dirname + "/geoms-way-problems.db", database_name,
+                   way_ids);
+    all_checks::for_each([&](auto check) {
+        if (header.checks & check.flag) {
+            merge_osm_file(output_dirname, update_dirname,
+                           std::string{"way-"} + check.name, way_ids);
+        }
+    });
+
+    vout << "Updating state...\n";
+    auto const old_problems = read_state_problems(state_dirname);
+    std::vector<way_state> kept_problems;
+    std::copy_if(old_problems.cbegin(), old_problems.cend(),
+                 std::back_inserter(kept_problems),
+                 [&](way_state const &p) {
+                     return !std::binary_search(way_ids.cbegin(),
+                                                way_ids.cend(), p.way_id);
+                 });
+    std::vector<way_state> problems;
+    std::merge(kept_problems.cbegin(), kept_problems.cend(),
+               new_problems.cbegin(), new_problems.cend(),
+               std::back_inserter(problems));
+    write_state_problems(state_dirname, problems);
+
+    // Only changed ways have different node references, the other affected
+    // ways only have moved nodes.
+    std::vector<node_way> removed;
+    std::vector<node_way> added;
+    osmium::memory::Buffer changed_ways{
+        1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    for (auto const *way : changes.ways) {
+        if (auto const *old_way = find_object(old_way_ptrs, way->id())) {
+            auto const records = node_ways_of(*old_way);
+            removed.insert(removed.end(), records.cbegin(), records.cend());
+            header.way_nodes -= old_way->nodes().size();
+        }
+        if (way->visible()) {
+            auto const records = node_ways_of(*way);
+            added.insert(added.end(), records.cbegin(), records.cend());
+            header.way_nodes += way->nodes().size();
+            changed_ways.add_item(*way);
+            changed_ways.commit();
+        }
+    }
+    std::sort(removed.begin(), removed.end());
+    std::sort(added.begin(), added.end());
+    update_state_node_ways(state_dirname, removed, added);
+    update_state_ways(state_dirname, changed_way_ids, changed_ways);
+
+    LastTimestampHandler last_timestamp_handler;
+    osmium::apply(changes.buffer, last_timestamp_handler);
+    header.last_timestamp =
+        std::max(header.last_timestamp,
+                 last_timestamp_handler.get_timestamp().seconds_since_epoch());
+    write_state_header(state_dirname, header);
+
+    vout << "Writing out stats...\n";
+    options_type stats_options{options};
+    stats_options.checks = header.checks;
+    write_way_stats(output_dirname, osmium::Timestamp{header.last_timestamp},
+                    stats_options, stats_from_state(header, problems));
+
+    ::unlink(database_name.c_str());
+    all_checks::for_each([&](auto check) {
+        if (header.checks & check.flag) {
+            auto const filename = update_dirname + "/way-" +
+                                  std::string{check.name} + ".osm.pbf";
+            ::unlink(filename.c_str());
+        }
+    });
+    ::rmdir(update_dirname.c_str());
+}
+
 int main(int argc, char *argv[])
 try {
     auto const options = parse_command_line(argc, argv);
@@ -728,6 +2646,23 @@ try {
     vout << "Command line options:\n";
     vout << "  Reading from file '" << input_filename << "'\n";
     vout << "  Writing to directory '" << output_dirname << "'\n";
+
+    if (options.update) {
+        vout << "  Updating results from change file using location index '"
+             << options.locations_index << "'\n";
+        update_from_change_file(options, input_filename, output_dirname, vout);
+
+        const osmium::MemoryUsage memory_usage;
+        if (memory_usage.peak() != 0) {
+            vout << "Peak memory usage: " << memory_usage.peak()
+                 << " MBytes\n";
+        }
+
+        vout << "Done with " << program_name << ".\n";
+
+        return 0;
+    }
+
     if (options.before_time == osmium::end_of_time()) {
         vout << "  Get all objects independent of change timestamp (change "
                 "with --age, -a or --before, -b)\n";
@@ -736,6 +2671,26 @@ try {
              << options.before_time
              << " (change with --age, -a or --before, -b)\n";
     }
+    vout << "  Using " << options.num_threads
+         << " thread(s) for checking (change with --threads, -t)\n";
+    vout << "  Checks: " << check_names(options.checks)
+         << " (change with --checks, -c)\n";
+    if (options.crossing_keys.empty()) {
+        vout << "  Not looking for crossing ways (change with "
+                "--crossing-ways, -x)\n";
+    } else {
+        vout << "  Looking for crossing ways with keys:";
+        for (auto const &key : options.crossing_keys) {
+            vout << ' ' << key;
+        }
+        vout << " (change with --crossing-ways, -x)\n";
+    }
+    if (options.write_state) {
+        vout << "  Writing state for updates\n";
+    } else {
+        vout << "  Not writing state for updates (change with "
+                "--write-state, -w)\n";
+    }
 
     const osmium::io::File file{input_filename};
     osmium::io::Reader reader{file, osmium::osm_entity_bits::way};
@@ -746,37 +2701,62 @@ try {
     }
 
     LastTimestampHandler last_timestamp_handler;
-    CheckHandler handler{output_dirname, options};
+    ProblemReporter handler{output_dirname, options.checks,
+                            !options.crossing_keys.empty()};
+
+    std::unique_ptr<CrossingFinder> crossing_finder;
+    if (!options.crossing_keys.empty()) {
+        crossing_finder = std::make_unique<CrossingFinder>(
+            output_dirname, options.crossing_keys, options.before_time);
+    }
+
+    std::unique_ptr<StateWriter> state_writer;
+    if (options.write_state) {
+        state_writer = std::make_unique<StateWriter>(output_dirname + "/state");
+    }
+
+    constexpr auto const num_check_sets = std::tuple_size_v<check_sets>;
+    auto const check_set_index = find_check_set(
+        options.checks, std::make_index_sequence<num_check_sets>{});
 
     vout << "Reading ways and checking for problems...\n";
-    osmium::ProgressBar progress_bar{reader.file_size(), display_progress()};
-    while (osmium::memory::Buffer buffer = reader.read()) {
-        progress_bar.update(reader.offset());
-        osmium::apply(buffer, last_timestamp_handler, handler);
+    with_check_set(
+        check_set_index,
+        [&](auto check_set) {
+            vout << "  Using compiled-in check set: "
+                 << check_names(decltype(check_set)::mask) << '\n';
+            check_ways<decltype(check_set)>(options, reader,
+                                            last_timestamp_handler, handler,
+                                            crossing_finder.get(),
+                                            state_writer.get());
+        },
+        std::make_index_sequence<num_check_sets>{});
+
+    reader.close();
+
+    if (crossing_finder) {
+        vout << "Looking for crossing ways...\n";
+        auto const way_ids = find_crossings(options, *crossing_finder, handler);
+        vout << "  Found " << handler.stats().crossing_points
+             << " crossings.\n";
+        crossing_finder.reset();
+
+        vout << "Copying ways with crossings...\n";
+        copy_crossing_ways(file, output_dirname, way_ids);
     }
-    progress_bar.done();
 
     handler.close();
-    reader.close();
 
-    vout << "Writing out stats...\n";
     auto const last_time{last_timestamp_handler.get_timestamp()};
-    write_stats(
-        output_dirname + "/stats-way-problems.db", last_time,
-        [&](std::function<void(char const *, uint64_t)> &add) {
-            add("way_nodes", handler.stats().way_nodes);
-            add("way_self_intersection", handler.stats().self_intersection);
-            add("way_spike", handler.stats().spike);
-            add("way_acute_angle", handler.stats().acute_angle);
-            add("way_duplicate_segment", handler.stats().duplicate_segment);
-            add("way_no_node", handler.stats().no_node);
-            add("way_single_node", handler.stats().single_node);
-            add("way_same_node", handler.stats().same_node);
-            add("way_duplicate_node", handler.stats().duplicate_node);
-            add("way_close_nodes", handler.stats().close_nodes);
-            add("way_many_nodes", handler.stats().many_nodes);
-            add("way_long_segment", handler.stats().long_segment);
-        });
+
+    if (state_writer) {
+        vout << "Writing state...\n";
+        state_writer->close(options.checks, last_time.seconds_since_epoch());
+        state_writer.reset();
+    }
+
+    vout << "Writing out stats...\n";
+    write_way_stats(output_dirname, last_time, options, handler.stats());
 
     const osmium::MemoryUsage memory_usage;
     if (memory_usage.peak() != 0) {
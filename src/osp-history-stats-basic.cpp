@@ -2,6 +2,7 @@
 #include "app.hpp"
 #include "date-convert.hpp"
 #include "db.hpp"
+#include "parallel-diff.hpp"
 #include "stats-basic.hpp"
 #include "util.hpp"
 
@@ -10,6 +11,7 @@
 #include <osmium/io/any_input.hpp>
 #include <osmium/util/verbose_output.hpp>
 
+#include <algorithm>
 #include <array>
 #include <cstdlib>
 #include <cstring>
@@ -175,6 +177,33 @@ public:
         }
     }
 
+    /**
+     * Add the stats from a handler which has seen other objects. Variables
+     * named max_* are maxima per day, all others are sums.
+     */
+    void merge(StatsHandler const &other)
+    {
+        std::array<bool, num_variables> is_max{};
+        for (std::size_t i = 0; i < num_variables; ++i) {
+            is_max[i] = std::strncmp(name_strings[i], "max_", 4) == 0;
+        }
+
+        if (m_stats.size() < other.m_stats.size()) {
+            m_stats.resize(other.m_stats.size());
+        }
+        for (std::size_t time = 0; time < other.m_stats.size(); ++time) {
+            for (std::size_t i = 0; i < num_variables; ++i) {
+                auto &value = m_stats[time][i];
+                auto const other_value = other.m_stats[time][i];
+                if (is_max[i]) {
+                    value = std::max(value, other_value);
+                } else {
+                    value += other_value;
+                }
+            }
+        }
+    }
+
     void write_database()
     {
         auto db = open_database(m_db_file_name, true);
@@ -216,20 +245,33 @@ public:
 
 class App : public BasicApp
 {
+    int m_num_threads = 1;
+
 public:
     App()
     : BasicApp("osp-history-stats-basic",
                "Generate basic statistics from OSM history file",
                with_output::db)
-    {}
+    {
+        add_option("-t,--threads", m_num_threads,
+                   "Number of threads for processing (default: 1)")
+            ->type_name("NUM")
+            ->check(CLI::PositiveNumber);
+    }
 
     void run()
     {
-        StatsHandler handler{std::time(nullptr), output()};
+        auto const now = std::time(nullptr);
+        StatsHandler handler{now, output()};
         osmium::io::Reader reader{input()};
 
         vout() << "Processing data...\n";
-        osmium::apply_diff(reader, handler);
+        apply_diff_parallel(
+            reader, m_num_threads,
+            [&]() { return StatsHandler{now, output()}; },
+            [&](StatsHandler &&chunk_handler) {
+                handler.merge(chunk_handler);
+            });
         reader.close();
         vout() << "Done processing.\n";
 
@@ -1,6 +1,7 @@
 
 #include "app.hpp"
 #include "db.hpp"
+#include "parallel-diff.hpp"
 
 #include <osmium/diff_handler.hpp>
 #include <osmium/diff_visitor.hpp>
@@ -53,6 +54,13 @@ public:
         }
     }
 
+    void merge(StatsHandler const &other)
+    {
+        for (auto const &p : other.m_userpairs) {
+            m_userpairs[p.first] += p.second;
+        }
+    }
+
     void write_graph(std::string const &filename)
     {
         std::ofstream out{filename};
@@ -69,12 +77,19 @@ public:
 
 class App : public BasicApp
 {
+    int m_num_threads = 1;
+
 public:
     App()
     : BasicApp("osp-history-stats-users",
                "Generate user statistics from OSM history file",
                with_output::dir)
-    {}
+    {
+        add_option("-t,--threads", m_num_threads,
+                   "Number of threads for processing (default: 1)")
+            ->type_name("NUM")
+            ->check(CLI::PositiveNumber);
+    }
 
     void run()
     {
@@ -82,7 +97,11 @@ public:
         osmium::io::Reader reader{input()};
 
         vout() << "Processing data...\n";
-        osmium::apply_diff(reader, handler);
+        apply_diff_parallel(
+            reader, m_num_threads, []() { return StatsHandler{}; },
+            [&](StatsHandler &&chunk_handler) {
+                handler.merge(chunk_handler);
+            });
         reader.close();
 
         handler.write_graph(output() + "/osmcoedit.dot");
@@ -1,6 +1,7 @@
 
+#include "referenced-ids.hpp"
+
 #include <osmium/builder/osm_object_builder.hpp>
-#include <osmium/index/id_set.hpp>
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
 
@@ -17,6 +18,7 @@ int main(int argc, char *argv[])
     try {
         std::string input_filename;
         std::string output_directory;
+        std::string ref_cache;
         bool help = false;
 
         // clang-format off
@@ -24,6 +26,9 @@ int main(int argc, char *argv[])
             = lyra::opt(output_directory, "DIR")
                 ["-o"]["--output-dir"]
                 ("output directory")
+            | lyra::opt(ref_cache, "FILE")
+                ["-r"]["--ref-cache"]
+                ("cache file for referenced ids")
             | lyra::help(help)
             | lyra::arg(input_filename, "FILENAME")
                 ("input file");
@@ -47,46 +52,10 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> in_way;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type>
-            in_multiple_ways;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> in_relation;
-
         osmium::io::File const input_file{input_filename};
 
-        osmium::io::Reader reader1{input_file,
-                                   osmium::osm_entity_bits::way |
-                                       osmium::osm_entity_bits::relation};
-        while (auto const buffer = reader1.read()) {
-            for (auto const &object : buffer.select<osmium::OSMObject>()) {
-                if (object.type() == osmium::item_type::way) {
-                    auto const &way = static_cast<osmium::Way const &>(object);
-                    if (way.nodes().empty()) {
-                        continue;
-                    }
-                    auto const *it = way.nodes().begin();
-                    if (way.is_closed()) {
-                        ++it;
-                    }
-                    for (; it != way.nodes().end(); ++it) {
-                        if (in_way.get(it->positive_ref())) {
-                            in_multiple_ways.set(it->positive_ref());
-                        } else {
-                            in_way.set(it->positive_ref());
-                        }
-                    }
-                } else {
-                    for (auto const &member :
-                         static_cast<osmium::Relation const &>(object)
-                             .members()) {
-                        if (member.type() == osmium::item_type::node) {
-                            in_relation.set(member.positive_ref());
-                        }
-                    }
-                }
-            }
-        }
-        reader1.close();
+        ReferencedIds ids;
+        ids.load_or_create(input_file, ref_cache, 1);
 
         constexpr std::size_t const initial_buffer_size = 1024;
         osmium::memory::Buffer outbuffer{initial_buffer_size};
@@ -97,9 +66,10 @@ int main(int argc, char *argv[])
         while (auto const buffer = reader2.read()) {
             for (auto const &object : buffer.select<osmium::OSMObject>()) {
                 if (object.type() == osmium::item_type::node) {
-                    bool const in_mw =
-                        in_multiple_ways.get(object.positive_id());
-                    bool const in_rel = in_relation.get(object.positive_id());
+                    bool const in_mw = ids.get(ref_set::multiple_way_nodes,
+                                               object.positive_id());
+                    bool const in_rel =
+                        ids.get(ref_set::member_nodes, object.positive_id());
                     if (!object.tags().empty() || (!in_mw && !in_rel)) {
                         writer(object);
                     } else {
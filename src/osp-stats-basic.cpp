@@ -1,7 +1,9 @@
 
 #include "app.hpp"
 #include "db.hpp"
+#include "parallel-diff.hpp"
 #include "stats-basic.hpp"
+#include "thread-util.hpp"
 #include "util.hpp"
 
 #include <osmium/diff_handler.hpp>
@@ -9,17 +11,27 @@
 #include <osmium/handler.hpp>
 #include <osmium/index/nwr_array.hpp>
 #include <osmium/io/any_input.hpp>
+#include <osmium/osm/object_comparisons.hpp>
 #include <osmium/osm/timestamp.hpp>
+#include <osmium/thread/pool.hpp>
 #include <osmium/util/progress_bar.hpp>
 #include <osmium/util/verbose_output.hpp>
 #include <osmium/visitor.hpp>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstring>
+#include <ctime>
 #include <exception>
+#include <filesystem>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <utility>
+#include <unistd.h>
 #include <vector>
 
 /* ========================================================================= */
@@ -45,6 +57,41 @@ public:
         ++vec[i];
     }
 
+    void decr(osmium::item_type type, std::size_t i) noexcept
+    {
+        auto &vec = m_data(type);
+        if (i < vec.size() && vec[i] > 0) {
+            --vec[i];
+        }
+    }
+
+    /// The largest value with a count or 0 if there is none.
+    [[nodiscard]] std::size_t max_value(osmium::item_type type) const noexcept
+    {
+        auto const &vec = m_data(type);
+        for (auto i = vec.size(); i > 0; --i) {
+            if (vec[i - 1] > 0) {
+                return i - 1;
+            }
+        }
+        return 0;
+    }
+
+    void merge(Histogram const &other)
+    {
+        for (auto const t : {osmium::item_type::node, osmium::item_type::way,
+                             osmium::item_type::relation}) {
+            auto &vec = m_data(t);
+            auto const &other_vec = other.m_data(t);
+            if (vec.size() < other_vec.size()) {
+                vec.resize(other_vec.size());
+            }
+            for (std::size_t i = 0; i < other_vec.size(); ++i) {
+                vec[i] += other_vec[i];
+            }
+        }
+    }
+
     void init_db(Sqlite::Database *db) const
     {
         db->exec(std::string{"CREATE TABLE hist_"} + m_name +
@@ -52,6 +99,33 @@ public:
                  " INTEGER, num INTEGER);");
     }
 
+    void read_db(Sqlite::Database *db, std::string const &ts)
+    {
+        auto const sql = "SELECT object_type, " + m_column_name +
+                         ", num FROM hist_" + m_name + " WHERE ts = ?";
+
+        Sqlite::Statement stmt{*db, sql.c_str()};
+        stmt.bind_text(ts);
+        while (stmt.read()) {
+            auto const type = osmium::char_to_item_type(stmt.get_text(0)[0]);
+            auto const i = std::stoull(stmt.get_text(1));
+            auto &vec = m_data(type);
+            if (vec.size() <= i) {
+                vec.resize(i + 1);
+            }
+            vec[i] = std::stoull(stmt.get_text(2));
+        }
+    }
+
+    void delete_from_db(Sqlite::Database *db, std::string const &ts) const
+    {
+        auto const sql = "DELETE FROM hist_" + m_name + " WHERE ts = ?";
+
+        Sqlite::Statement stmt{*db, sql.c_str()};
+        stmt.bind_text(ts);
+        stmt.execute();
+    }
+
     void write_db(Sqlite::Database *db, std::string const &ts) const
     {
         auto const sql = "INSERT INTO hist_" + m_name + " (ts, object_type, " +
@@ -85,6 +159,11 @@ class StatsHandler : public osmium::handler::Handler, public stats_basic
     Histogram m_hist_nodes{"way_nodes", "nodes"};
     osmium::Timestamp m_max_timestamp{};
 
+    // Number of changed objects since the last full run for which the
+    // stats depending on the contents of the old version could not be
+    // updated.
+    uint64_t m_unresolved_changes = 0;
+
     uint64_t &v(names n) noexcept { return m_variables[n]; }
 
     void update_max(uint64_t value, names max) noexcept
@@ -192,6 +271,29 @@ public:
         }
     }
 
+    /**
+     * Add the stats from another handler which has seen different objects.
+     * Variables named max_* are maxima, all others are sums. The derived
+     * stats are calculated after merging.
+     */
+    void merge(StatsHandler const &other)
+    {
+        for (std::size_t i = 0; i < num_variables; ++i) {
+            if (std::strncmp(name_strings[i], "max_", 4) == 0) {
+                m_variables[i] =
+                    std::max(m_variables[i], other.m_variables[i]);
+            } else {
+                m_variables[i] += other.m_variables[i];
+            }
+        }
+        m_hist_versions.merge(other.m_hist_versions);
+        m_hist_members.merge(other.m_hist_members);
+        m_hist_nodes.merge(other.m_hist_nodes);
+        if (other.m_max_timestamp > m_max_timestamp) {
+            m_max_timestamp = other.m_max_timestamp;
+        }
+    }
+
     void calculate_derived_stats() noexcept
     {
         v(objects) = v(nodes) + v(ways) + v(relations);
@@ -203,64 +305,443 @@ public:
             v(sum_node_version) + v(sum_way_version) + v(sum_relation_version);
     }
 
-    void write_database(std::string const &dbname)
+    /**
+     * Read the stats from the latest snapshot in a database written by an
+     * earlier run as starting point for an update.
+     */
+    void read_state(Sqlite::Database *db)
     {
-        auto db = open_database(dbname, true); // XXX TODO optional
-        db.exec(create_table("stats"));
-        m_hist_versions.init_db(&db);
-        m_hist_nodes.init_db(&db);
-        m_hist_members.init_db(&db);
+        std::string sql{"SELECT ts"};
+        for (auto const *column : name_strings) {
+            sql += ", ";
+            sql += column;
+        }
+        sql += " FROM stats ORDER BY ts DESC LIMIT 1";
+
+        Sqlite::Statement stmt{*db, sql.c_str()};
+        if (!stmt.read()) {
+            throw std::runtime_error{"No stats in state database"};
+        }
+        auto const ts = stmt.get_text(0);
+        m_max_timestamp = osmium::Timestamp{ts};
+        for (std::size_t i = 0; i < num_variables; ++i) {
+            auto const column = static_cast<int>(i + 1);
+            m_variables[i] = std::stoull(stmt.get_text(column));
+        }
+
+        m_hist_versions.read_db(db, ts);
+        m_hist_nodes.read_db(db, ts);
+        m_hist_members.read_db(db, ts);
+
+        // Databases from older versions don't have the state table.
+        Sqlite::Statement has_state{
+            *db, "SELECT name FROM sqlite_master WHERE type = 'table' AND "
+                 "name = 'state'"};
+        if (!has_state.read()) {
+            return;
+        }
+        Sqlite::Statement state{
+            *db, "SELECT value FROM state WHERE key = 'unresolved_changes'"};
+        if (state.read()) {
+            m_unresolved_changes = std::stoull(state.get_text(0));
+        }
+    }
+
+    [[nodiscard]] uint64_t unresolved_changes() const noexcept
+    {
+        return m_unresolved_changes;
+    }
+
+    /// Number of objects, only valid after calculate_derived_stats().
+    [[nodiscard]] uint64_t num_objects() const noexcept
+    {
+        return m_variables[objects];
+    }
+
+    /**
+     * Remove the old version of a changed object. Only the version is
+     * known, so only the stats depending on the object type and version
+     * are updated, the change is counted as unresolved.
+     */
+    void remove_old_version(osmium::item_type type,
+                            osmium::object_version_type version) noexcept
+    {
+        switch (type) {
+        case osmium::item_type::node:
+            --v(nodes);
+            v(sum_node_version) -= version;
+            break;
+        case osmium::item_type::way:
+            --v(ways);
+            v(sum_way_version) -= version;
+            break;
+        case osmium::item_type::relation:
+            --v(relations);
+            v(sum_relation_version) -= version;
+            break;
+        default:
+            break;
+        }
+        m_hist_versions.decr(type, version);
+        ++m_unresolved_changes;
+    }
+
+    /**
+     * Add the new version of a changed object, but only the stats not
+     * depending on its contents, because the contents of the old version
+     * have not been removed.
+     */
+    void add_new_version(osmium::OSMObject const &object) noexcept
+    {
+        update_common_stats(object);
+        switch (object.type()) {
+        case osmium::item_type::node:
+            ++v(nodes);
+            v(sum_node_version) += object.version();
+            update_max(object.id(), max_node_id);
+            break;
+        case osmium::item_type::way:
+            ++v(ways);
+            v(sum_way_version) += object.version();
+            update_max(object.id(), max_way_id);
+            break;
+        case osmium::item_type::relation:
+            ++v(relations);
+            v(sum_relation_version) += object.version();
+            update_max(object.id(), max_relation_id);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /// Recalculate the maximum versions from the version histogram.
+    void update_max_versions() noexcept
+    {
+        v(max_node_version) =
+            m_hist_versions.max_value(osmium::item_type::node);
+        v(max_way_version) = m_hist_versions.max_value(osmium::item_type::way);
+        v(max_relation_version) =
+            m_hist_versions.max_value(osmium::item_type::relation);
+    }
+
+    void init_database(Sqlite::Database *db)
+    {
+        db->exec(create_table("stats"));
+        m_hist_versions.init_db(db);
+        m_hist_nodes.init_db(db);
+        m_hist_members.init_db(db);
+        db->exec("CREATE TABLE state (key VARCHAR, value INT64);");
+    }
+
+    void write_state(Sqlite::Database *db)
+    {
+        Sqlite::Statement stmt{
+            *db, "INSERT INTO state (key, value) VALUES (?, ?)"};
+        stmt.bind_text("unresolved_changes");
+        stmt.bind_int64(static_cast<int64_t>(m_unresolved_changes));
+        stmt.execute();
+    }
+
+    void write_snapshot(Sqlite::Database *db, std::string const &ts)
+    {
+        db->begin_transaction();
+        write_variables(db, ts);
+        m_hist_versions.write_db(db, ts);
+        m_hist_nodes.write_db(db, ts);
+        m_hist_members.write_db(db, ts);
+        db->commit();
+    }
 
+    /**
+     * Add the stats as a new snapshot to a database written by an earlier
+     * run and replace the state, all in one transaction. A snapshot with
+     * the same timestamp already in the database is replaced.
+     */
+    void append_to_database(Sqlite::Database *db)
+    {
         auto const ts = m_max_timestamp.to_iso();
 
-        db.begin_transaction();
-        write_variables(&db, ts);
-        m_hist_versions.write_db(&db, ts);
-        m_hist_nodes.write_db(&db, ts);
-        m_hist_members.write_db(&db, ts);
-        db.commit();
+        // Databases from older versions don't have the state table.
+        db->exec("CREATE TABLE IF NOT EXISTS state "
+                 "(key VARCHAR, value INT64);");
+
+        db->begin_transaction();
+        Sqlite::Statement delete_stats{*db, "DELETE FROM stats WHERE ts = ?"};
+        delete_stats.bind_text(ts);
+        delete_stats.execute();
+        m_hist_versions.delete_from_db(db, ts);
+        m_hist_nodes.delete_from_db(db, ts);
+        m_hist_members.delete_from_db(db, ts);
+        db->exec("DELETE FROM state;");
+
+        write_variables(db, ts);
+        m_hist_versions.write_db(db, ts);
+        m_hist_nodes.write_db(db, ts);
+        m_hist_members.write_db(db, ts);
+        write_state(db);
+        db->commit();
+    }
+
+    void write_database(std::string const &dbname)
+    {
+        auto db = open_database(dbname, true); // XXX TODO optional
+        init_database(&db);
+        write_snapshot(&db, m_max_timestamp.to_iso());
+        write_state(&db);
     }
 
 }; // class StatsHandler
 
 class FilterHandler : public osmium::diff_handler::DiffHandler
 {
-    StatsHandler *m_handler;
-    osmium::Timestamp m_timestamp;
+    std::vector<StatsHandler> m_handlers;
+    std::vector<osmium::Timestamp> const *m_timestamps;
+
+    // The range of timestamps (and handlers) for which this version of the
+    // object is visible. This is the same as calling is_visible_at() for
+    // all timestamps, but because the timestamps are sorted, it is enough
+    // to look for the start and end time of the version.
+    [[nodiscard]] std::pair<std::size_t, std::size_t>
+    visible_range(osmium::DiffObject const &diff) const
+    {
+        if (!diff.curr().visible()) {
+            return {0, 0};
+        }
+        auto const first = std::lower_bound(
+            m_timestamps->cbegin(), m_timestamps->cend(), diff.start_time());
+        auto const last =
+            std::lower_bound(first, m_timestamps->cend(), diff.end_time());
+        return {first - m_timestamps->cbegin(),
+                last - m_timestamps->cbegin()};
+    }
 
 public:
-    FilterHandler(StatsHandler *handler, osmium::Timestamp timestamp) noexcept
-    : m_handler(handler), m_timestamp(timestamp)
+    // The timestamps must be sorted, there is one StatsHandler for each.
+    explicit FilterHandler(std::vector<osmium::Timestamp> const &timestamps)
+    : m_handlers(timestamps.size()), m_timestamps(&timestamps)
     {}
 
-    void node(osmium::DiffNode const &diff_node) const
+    std::vector<StatsHandler> &handlers() noexcept { return m_handlers; }
+
+    void merge(FilterHandler const &other)
     {
-        if (diff_node.is_visible_at(m_timestamp)) {
-            m_handler->node(diff_node.curr());
+        for (std::size_t n = 0; n < m_handlers.size(); ++n) {
+            m_handlers[n].merge(other.m_handlers[n]);
         }
     }
 
-    void way(osmium::DiffWay const &diff_way) const
+    void node(osmium::DiffNode const &diff_node)
     {
-        if (diff_way.is_visible_at(m_timestamp)) {
-            m_handler->way(diff_way.curr());
+        auto const range = visible_range(diff_node);
+        for (auto n = range.first; n < range.second; ++n) {
+            m_handlers[n].node(diff_node.curr());
         }
     }
 
-    void relation(osmium::DiffRelation const &diff_relation) const
+    void way(osmium::DiffWay const &diff_way)
     {
-        if (diff_relation.is_visible_at(m_timestamp)) {
-            m_handler->relation(diff_relation.curr());
+        auto const range = visible_range(diff_way);
+        for (auto n = range.first; n < range.second; ++n) {
+            m_handlers[n].way(diff_way.curr());
+        }
+    }
+
+    void relation(osmium::DiffRelation const &diff_relation)
+    {
+        auto const range = visible_range(diff_relation);
+        for (auto n = range.first; n < range.second; ++n) {
+            m_handlers[n].relation(diff_relation.curr());
         }
     }
 
 }; // class FilterHandler
 
+/**
+ * Process the data with one StatsHandler per thread. The threads take
+ * turns reading buffers from the reader (which decompresses in its own
+ * threads) and work on them in parallel. The results of all threads are
+ * merged into the handler at the end.
+ */
+static void process_parallel(osmium::io::Reader &reader, StatsHandler *handler,
+                             int num_threads,
+                             osmium::ProgressBar *progress_bar)
+{
+    auto const num_shards = static_cast<std::size_t>(num_threads);
+    std::vector<StatsHandler> shards(num_shards);
+
+    std::mutex mutex;
+    std::atomic<bool> failed{false};
+
+    osmium::thread::Pool pool{num_threads};
+    run_chunks(&pool, num_shards, [&](std::size_t n) {
+        try {
+            while (!failed) {
+                osmium::memory::Buffer buffer;
+                {
+                    std::lock_guard<std::mutex> const lock{mutex};
+                    buffer = reader.read();
+                    progress_bar->update(reader.offset());
+                }
+                if (!buffer) {
+                    return;
+                }
+                osmium::apply(buffer, shards[n]);
+            }
+        } catch (...) {
+            failed = true;
+            throw;
+        }
+    });
+
+    for (auto const &shard : shards) {
+        handler->merge(shard);
+    }
+}
+
+/**
+ * Update the stats with the changes from a change file. All versions of
+ * an object in the change file are looked at together: If the first
+ * version is version 1, the object is new and all stats are updated with
+ * its last version. Otherwise the object existed before with the version
+ * before the first one. This old version is removed and the last version
+ * is added (if it is not a deletion), but for both only the stats that
+ * depend on type, id, and version can be updated.
+ */
+static void update_from_changes(std::string const &filename,
+                                StatsHandler *handler)
+{
+    auto const buffer = osmium::io::read_file(filename);
+
+    std::vector<osmium::OSMObject const *> objects;
+    for (auto const &object : buffer.select<osmium::OSMObject>()) {
+        objects.push_back(&object);
+    }
+    std::sort(objects.begin(), objects.end(),
+              osmium::object_order_type_id_version{});
+
+    auto it = objects.cbegin();
+    while (it != objects.cend()) {
+        auto const &first = **it;
+        auto last = it;
+        while (std::next(last) != objects.cend() &&
+               (*std::next(last))->type() == first.type() &&
+               (*std::next(last))->id() == first.id()) {
+            ++last;
+        }
+        auto const &object = **last;
+
+        if (first.version() > 1) {
+            handler->remove_old_version(first.type(), first.version() - 1);
+            if (object.visible()) {
+                handler->add_new_version(object);
+            }
+        } else if (object.visible()) {
+            osmium::apply_item(object, *handler);
+        }
+
+        it = std::next(last);
+    }
+
+    handler->update_max_versions();
+}
+
+static osmium::Timestamp parse_timestamp(std::string const &str)
+{
+    try {
+        return osmium::Timestamp{str};
+    } catch (std::invalid_argument const &) {
+        throw CLI::ValidationError{"--timestamps",
+                                   "Invalid timestamp '" + str + "'"};
+    }
+}
+
+static int days_in_month(int year, int month) noexcept
+{
+    constexpr static std::array<int, 12> const days{31, 28, 31, 30, 31, 30,
+                                                    31, 31, 30, 31, 30, 31};
+    if (month == 1 && ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0)) {
+        return 29;
+    }
+    return days[static_cast<std::size_t>(month)];
+}
+
+// Add count days, months, or years to the timestamp. For months and years
+// the day is clamped to the length of the resulting month, so one month
+// after January 31st is the last day of February, not some day in March.
+static osmium::Timestamp add_period(osmium::Timestamp timestamp,
+                                    std::string const &period, int count)
+{
+    auto const time = static_cast<std::time_t>(timestamp.seconds_since_epoch());
+    std::tm tm{};
+    gmtime_r(&time, &tm);
+    if (period == "day") {
+        tm.tm_mday += count;
+    } else if (period == "month" || period == "year") {
+        auto const months = tm.tm_year * 12 + tm.tm_mon +
+                            (period == "month" ? count : count * 12);
+        tm.tm_year = months / 12;
+        tm.tm_mon = months % 12;
+        tm.tm_mday = std::min(tm.tm_mday,
+                              days_in_month(tm.tm_year + 1900, tm.tm_mon));
+    } else {
+        throw CLI::ValidationError{"--timestamps",
+                                   "Unknown period '" + period +
+                                       "' (use 'day', 'month', or 'year')"};
+    }
+    return osmium::Timestamp{timegm(&tm)};
+}
+
+/**
+ * Parse the arguments of the --timestamps option. Each one is either a
+ * single timestamp or a range FROM/TO/PERIOD with all timestamps from FROM
+ * up to and including TO, one PERIOD ('day', 'month', or 'year') apart.
+ * Returns the sorted timestamps without duplicates.
+ */
+static std::vector<osmium::Timestamp>
+parse_timestamps(std::vector<std::string> const &specs)
+{
+    std::vector<osmium::Timestamp> timestamps;
+
+    for (auto const &spec : specs) {
+        auto const pos1 = spec.find('/');
+        if (pos1 == std::string::npos) {
+            timestamps.push_back(parse_timestamp(spec));
+            continue;
+        }
+        auto const pos2 = spec.find('/', pos1 + 1);
+        if (pos2 == std::string::npos) {
+            throw CLI::ValidationError{"--timestamps",
+                                       "Range must be FROM/TO/PERIOD"};
+        }
+        auto const from = parse_timestamp(spec.substr(0, pos1));
+        auto const to = parse_timestamp(spec.substr(pos1 + 1, pos2 - pos1 - 1));
+        auto const period = spec.substr(pos2 + 1);
+        for (int n = 0;; ++n) {
+            auto const timestamp = add_period(from, period, n);
+            if (timestamp > to) {
+                break;
+            }
+            timestamps.push_back(timestamp);
+        }
+    }
+
+    std::sort(timestamps.begin(), timestamps.end());
+    timestamps.erase(std::unique(timestamps.begin(), timestamps.end()),
+                     timestamps.end());
+
+    return timestamps;
+}
+
 /* ========================================================================= */
 
 class App : public BasicApp
 {
     osmium::Timestamp m_timestamp{};
+    std::vector<std::string> m_timestamp_specs;
+    std::string m_state;
+    double m_max_unresolved = 1.0;
+    int m_num_threads = 1;
 
 public:
     App()
@@ -268,22 +749,120 @@ public:
                "Generate basic statistics from OSM data or history file",
                with_output::db)
     {
-        add_option("-t,--timestamp", m_timestamp,
-                   "Timestamp for stats from history file (ISO format)")
-            ->type_name("TIMESTAMP");
+        auto *const timestamp_option =
+            add_option("-t,--timestamp", m_timestamp,
+                       "Timestamp for stats from history file (ISO format)")
+                ->type_name("TIMESTAMP");
+        add_option("--timestamps", m_timestamp_specs,
+                   "Timestamps or ranges FROM/TO/PERIOD for stats from "
+                   "history file, one snapshot each")
+            ->type_name("TIMESTAMP")
+            ->excludes(timestamp_option);
+        add_option("-s,--state", m_state,
+                   "Update stats from this database with the change file")
+            ->type_name("SQLITE-DB-FILE")
+            ->excludes(timestamp_option)
+            ->excludes("--timestamps");
+        add_option("--max-unresolved", m_max_unresolved,
+                   "Refuse update if more than this percentage of objects "
+                   "have unresolved changes (default: 1)")
+            ->type_name("PERCENT")
+            ->check(CLI::NonNegativeNumber);
+        add_option("--threads", m_num_threads,
+                   "Number of threads for processing (default: 1)")
+            ->type_name("NUM")
+            ->check(CLI::PositiveNumber);
+    }
+
+    void update()
+    {
+        if (!std::filesystem::exists(m_state)) {
+            throw std::runtime_error{"State database '" + m_state +
+                                     "' does not exist"};
+        }
+
+        StatsHandler handler;
+
+        vout() << "Reading state from database '" << m_state << "'...\n";
+        {
+            auto db = open_database(m_state, false);
+            handler.read_state(&db);
+        }
+        auto const unresolved_before = handler.unresolved_changes();
+
+        vout() << "Reading change file...\n";
+        update_from_changes(input(), &handler);
+        vout() << "Done processing.\n";
+        handler.calculate_derived_stats();
+
+        auto const unresolved = handler.unresolved_changes();
+        if (unresolved > 0) {
+            vout() << fmt::format(
+                "Warning: {} changes of existing objects could not be fully "
+                "resolved ({} since the last full run). Stats depending on "
+                "tags, way nodes, and relation members are not exact.\n",
+                unresolved - unresolved_before, unresolved);
+        }
+        auto const max_unresolved = static_cast<double>(handler.num_objects()) *
+                                    m_max_unresolved / 100.0;
+        if (static_cast<double>(unresolved) > max_unresolved) {
+            throw std::runtime_error{fmt::format(
+                "{} unresolved changes since the last full run, more than "
+                "{}% of all objects. Do a full run instead of an update.",
+                unresolved, m_max_unresolved)};
+        }
+
+        // The new snapshot is added to a copy of the state database which
+        // then replaces the output database, so the state is never lost,
+        // even if the output database is the same file.
+        auto const tmp_name =
+            fmt::format("{}.tmp.{}", output(), static_cast<long>(::getpid()));
+        vout() << "Writing results to database '" << output() << "'...\n";
+        try {
+            std::filesystem::copy_file(
+                m_state, tmp_name,
+                std::filesystem::copy_options::overwrite_existing);
+            {
+                auto db = open_database(tmp_name, false);
+                handler.append_to_database(&db);
+            }
+            std::filesystem::rename(tmp_name, output());
+        } catch (...) {
+            std::filesystem::remove(tmp_name);
+            throw;
+        }
     }
 
     void run()
     {
+        if (!m_state.empty()) {
+            update();
+            return;
+        }
+
+        std::vector<osmium::Timestamp> timestamps;
         if (m_timestamp) {
             vout() << "        Timestamp: " << m_timestamp.to_iso() << "\n";
+            timestamps.push_back(m_timestamp);
+        } else if (!m_timestamp_specs.empty()) {
+            timestamps = parse_timestamps(m_timestamp_specs);
+            if (timestamps.empty()) {
+                throw CLI::ValidationError{"--timestamps", "No timestamps"};
+            }
+            vout() << fmt::format("        Timestamps: {} from {} to {}\n",
+                                  timestamps.size(),
+                                  timestamps.front().to_iso(),
+                                  timestamps.back().to_iso());
         }
-        StatsHandler handler;
+
+        // One handler for each timestamp or one for the whole file.
+        std::vector<StatsHandler> handlers(
+            std::max(timestamps.size(), std::size_t{1}));
 
         vout() << "Opening input file...\n";
         osmium::io::Reader reader{input(), osmium::osm_entity_bits::object};
 
-        if (m_timestamp.valid()) {
+        if (!timestamps.empty()) {
             if (!reader.header().has_multiple_object_versions()) {
                 reader.close();
                 throw std::runtime_error{
@@ -292,8 +871,14 @@ public:
             }
             vout() << "...this is an OSM file with history.\n";
             vout() << "Processing data...\n";
-            FilterHandler filter_handler{&handler, m_timestamp};
-            osmium::apply_diff(reader, filter_handler);
+            FilterHandler filter_handler{timestamps};
+            apply_diff_parallel(
+                reader, m_num_threads,
+                [&]() { return FilterHandler{timestamps}; },
+                [&](FilterHandler &&chunk_handler) {
+                    filter_handler.merge(chunk_handler);
+                });
+            handlers = std::move(filter_handler.handlers());
         } else {
             if (reader.header().has_multiple_object_versions()) {
                 vout() << "Warning: File has multiple object versions. Use "
@@ -304,9 +889,14 @@ public:
             vout() << "Processing data...\n";
             osmium::ProgressBar progress_bar{reader.file_size(),
                                              vout().verbose()};
-            while (auto buffer = reader.read()) {
-                progress_bar.update(reader.offset());
-                osmium::apply(buffer, handler);
+            if (m_num_threads > 1) {
+                process_parallel(reader, &handlers.front(), m_num_threads,
+                                 &progress_bar);
+            } else {
+                while (auto buffer = reader.read()) {
+                    progress_bar.update(reader.offset());
+                    osmium::apply(buffer, handlers.front());
+                }
             }
             progress_bar.done();
         }
@@ -314,9 +904,21 @@ public:
         reader.close();
         vout() << "Done processing.\n";
 
-        handler.calculate_derived_stats();
+        for (auto &handler : handlers) {
+            handler.calculate_derived_stats();
+        }
         vout() << "Writing results to database '" << output() << "'...\n";
-        handler.write_database(output());
+        if (m_timestamp_specs.empty()) {
+            handlers.front().write_database(output());
+            return;
+        }
+
+        // Snapshots are written with the timestamp they are for.
+        auto db = open_database(output(), true);
+        handlers.front().init_database(&db);
+        for (std::size_t n = 0; n < handlers.size(); ++n) {
+            handlers[n].write_snapshot(&db, timestamps[n].to_iso());
+        }
     }
 }; // class App
 
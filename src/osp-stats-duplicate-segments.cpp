@@ -1,5 +1,6 @@
 
-#include <osmium/index/id_set.hpp>
+#include "referenced-ids.hpp"
+
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
 #include <osmium/util/verbose_output.hpp>
@@ -56,6 +57,7 @@ int main(int argc, char *argv[])
     try {
         std::string input_filename;
         std::string output_directory{"."};
+        std::string ref_cache;
         bool help = false;
 
         // clang-format off
@@ -63,6 +65,9 @@ int main(int argc, char *argv[])
             = lyra::opt(output_directory, "DIR")
                 ["-o"]["--output-dir"]
                 ("output directory")
+            | lyra::opt(ref_cache, "FILE")
+                ["-r"]["--ref-cache"]
+                ("cache file for referenced ids")
             | lyra::help(help)
             | lyra::arg(input_filename, "FILENAME")
                 ("input file");
@@ -88,34 +93,11 @@ int main(int argc, char *argv[])
 
         osmium::VerboseOutput vout{true};
 
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type>
-            in_multiple_ways;
-
         vout << "Reading nodes in ways...\n";
 
-        {
-            osmium::index::IdSetDense<osmium::unsigned_object_id_type> in_way;
-            osmium::io::Reader reader1{input_file,
-                                       osmium::osm_entity_bits::way};
-            while (auto const buffer = reader1.read()) {
-                for (auto const &way : buffer.select<osmium::Way>()) {
-                    if (way.nodes().empty()) {
-                        continue;
-                    }
-                    auto const *it = way.nodes().begin();
-                    if (way.is_closed()) {
-                        ++it;
-                    }
-                    for (; it != way.nodes().end(); ++it) {
-                        if (in_way.get(it->positive_ref())) {
-                            in_multiple_ways.set(it->positive_ref());
-                        } else {
-                            in_way.set(it->positive_ref());
-                        }
-                    }
-                }
-            }
-            reader1.close();
+        ReferencedIds ids;
+        if (ids.load_or_create(input_file, ref_cache, 1)) {
+            vout << "Loaded nodes in ways from cache file.\n";
         }
 
         vout << "Reading segments...\n";
@@ -130,8 +112,10 @@ int main(int argc, char *argv[])
                     for (++it; it != way.nodes().end(); ++it) {
                         auto const id1 = (it - 1)->ref();
                         auto const id2 = it->ref();
-                        if (in_multiple_ways.get(id1) &&
-                            in_multiple_ways.get(id2)) {
+                        if (ids.get(ref_set::multiple_way_nodes,
+                                    (it - 1)->positive_ref()) &&
+                            ids.get(ref_set::multiple_way_nodes,
+                                    it->positive_ref())) {
                             segments.emplace_back(id1, id2);
                         }
                     }
@@ -1,4 +1,6 @@
 
+#include "parallel-diff.hpp"
+
 #include <osmium/diff_handler.hpp>
 #include <osmium/diff_visitor.hpp>
 #include <osmium/io/any_input.hpp>
@@ -40,6 +42,13 @@ public:
         }
     }
 
+    void merge(const StatsHandler& other) noexcept {
+        count_node_changes += other.count_node_changes;
+        count_node_changes_same_location += other.count_node_changes_same_location;
+        count_node_changes_tagged += other.count_node_changes_tagged;
+        count_node_changes_same_location_tagged += other.count_node_changes_same_location_tagged;
+    }
+
     void print_result() {
         std::cout << "node changes:            " << std::setw(12) << count_node_changes << '\n';
         std::cout << " same location:          " << std::setw(12) << count_node_changes_same_location << '\n';
@@ -55,11 +64,15 @@ int main(int argc, char *argv[])
 {
     try {
         std::string input_filename;
+        int num_threads = 1;
         bool help = false;
 
         // clang-format off
         auto const cli
             = lyra::help(help)
+            | lyra::opt(num_threads, "NUM")
+                ["-t"]["--threads"]
+                ("number of threads for processing (default: 1)")
             | lyra::arg(input_filename, "FILENAME")
                 ("input file");
         // clang-format on
@@ -83,7 +96,11 @@ int main(int argc, char *argv[])
         StatsHandler statshandler{};
 
         osmium::io::Reader reader{input_filename, osmium::osm_entity_bits::node};
-        osmium::apply_diff(reader, statshandler);
+        apply_diff_parallel(reader, num_threads,
+                            []() { return StatsHandler{}; },
+                            [&](StatsHandler&& handler) {
+                                statshandler.merge(handler);
+                            });
         reader.close();
 
         statshandler.print_result();
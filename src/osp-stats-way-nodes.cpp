@@ -1,5 +1,6 @@
 
-#include <osmium/index/id_set.hpp>
+#include "referenced-ids.hpp"
+
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
 
@@ -23,6 +24,7 @@ int main(int argc, char *argv[])
     try {
         std::string input_filename;
         std::string output_directory;
+        std::string ref_cache;
         bool help = false;
 
         // clang-format off
@@ -30,6 +32,9 @@ int main(int argc, char *argv[])
             = lyra::opt(output_directory, "DIR")
                 ["-o"]["--output-dir"]
                 ("output directory")
+            | lyra::opt(ref_cache, "FILE")
+                ["-r"]["--ref-cache"]
+                ("cache file for referenced ids")
             | lyra::help(help)
             | lyra::arg(input_filename, "FILENAME")
                 ("input file");
@@ -51,51 +56,13 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> in_way;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type>
-            in_multiple_ways;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> in_relation;
-
         osmium::io::File const input_file{input_filename};
 
-        std::uint64_t count_ways = 0;
-        std::uint64_t count_relations = 0;
-
-        osmium::io::Reader reader1{input_file,
-                                   osmium::osm_entity_bits::way |
-                                       osmium::osm_entity_bits::relation};
-        while (auto const buffer = reader1.read()) {
-            for (auto const &object : buffer.select<osmium::OSMObject>()) {
-                if (object.type() == osmium::item_type::way) {
-                    ++count_ways;
-                    auto const &way = static_cast<osmium::Way const &>(object);
-                    if (way.nodes().empty()) {
-                        continue;
-                    }
-                    auto const *it = way.nodes().begin();
-                    if (way.is_closed()) {
-                        ++it;
-                    }
-                    for (; it != way.nodes().end(); ++it) {
-                        if (in_way.get(it->positive_ref())) {
-                            in_multiple_ways.set(it->positive_ref());
-                        } else {
-                            in_way.set(it->positive_ref());
-                        }
-                    }
-                } else {
-                    ++count_relations;
-                    for (auto const &member :
-                         static_cast<osmium::Relation const &>(object)
-                             .members()) {
-                        if (member.type() == osmium::item_type::node) {
-                            in_relation.set(member.positive_ref());
-                        }
-                    }
-                }
-            }
-        }
-        reader1.close();
+        ReferencedIds ids;
+        ids.load_or_create(input_file, ref_cache, 1);
+
+        std::uint64_t const count_ways = ids.count_ways();
+        std::uint64_t const count_relations = ids.count_relations();
 
         std::uint64_t count_nodes = 0;
         std::uint64_t count_nodes_with_tags = 0;
@@ -118,7 +85,7 @@ int main(int argc, char *argv[])
                 if (!node.tags().empty()) {
                     ++count_nodes_with_tags;
                 }
-                if (in_way.get(node.positive_id())) {
+                if (ids.get(ref_set::way_nodes, node.positive_id())) {
                     ++count_nodes_in_way;
                     if (!node.tags().empty()) {
                         ++count_nodes_with_tags_in_way;
@@ -126,11 +93,12 @@ int main(int argc, char *argv[])
                             (*writer_nodes_with_tags_in_way)(node);
                         }
                     }
-                    if (in_multiple_ways.get(node.positive_id())) {
+                    if (ids.get(ref_set::multiple_way_nodes,
+                                node.positive_id())) {
                         ++count_nodes_in_multiple_ways;
                     }
                 }
-                if (in_relation.get(node.positive_id())) {
+                if (ids.get(ref_set::member_nodes, node.positive_id())) {
                     ++count_nodes_in_relation;
                 }
             }
@@ -10,30 +10,40 @@
 #include <osmium/io/file.hpp>
 #include <osmium/io/header.hpp>
 
+#include <algorithm>
+#include <cstddef>
 #include <iostream>
 #include <map>
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 class Output
 {
 
+    // The mark is stored in the top bit of the relation id, relation ids
+    // are always smaller than 2^63.
     struct mem_rel_mapping
     {
 
         osmium::unsigned_object_id_type member_id;
-        osmium::unsigned_object_id_type relation_id;
+        osmium::unsigned_object_id_type relation_id : 63;
+        osmium::unsigned_object_id_type mark : 1;
 
         mem_rel_mapping(osmium::unsigned_object_id_type mem_id,
-                        osmium::unsigned_object_id_type rel_id = 0)
-        : member_id(mem_id), relation_id(rel_id)
+                        osmium::unsigned_object_id_type rel_id = 0,
+                        bool is_marked = false)
+        : member_id(mem_id),
+          relation_id(rel_id & ((uint64_t{1} << 63U) - 1)),
+          mark(is_marked ? 1U : 0U)
         {}
 
         bool operator<(mem_rel_mapping const &other) const noexcept
         {
-            return std::tie(member_id, relation_id) <
-                   std::tie(other.member_id, other.relation_id);
+            return member_id < other.member_id ||
+                   (member_id == other.member_id &&
+                    relation_id < other.relation_id);
         }
 
     }; // struct mem_rel_mapping
@@ -41,9 +51,6 @@ class Output
     using id_map_type = std::vector<mem_rel_mapping>;
 
     std::string m_name;
-    std::map<osmium::unsigned_object_id_type,
-             std::vector<osmium::unsigned_object_id_type>>
-        m_marks;
     osmium::geom::OGRFactory<> &m_factory;
     std::unique_ptr<gdalcpp::Layer> m_layer_points;
     std::unique_ptr<gdalcpp::Layer> m_layer_lines;
@@ -56,6 +63,15 @@ class Output
 
     osmium::nwr_array<id_map_type> m_id_maps;
 
+    // Position in the id maps for the merge join in write_to_all().
+    osmium::nwr_array<id_map_type::const_iterator> m_cursors;
+
+    // Last id seen for each type to detect unsorted input.
+    osmium::nwr_array<osmium::unsigned_object_id_type> m_last_ids{};
+
+    // Set to false as soon as an object is seen out of order.
+    bool m_sorted_input = true;
+
     static std::string underscore_to_dash(std::string const &str)
     {
         std::string out;
@@ -67,17 +83,6 @@ class Output
         return out;
     }
 
-    bool check_mark(osmium::unsigned_object_id_type rel_id,
-                    osmium::unsigned_object_id_type obj_id)
-    {
-        if (m_marks.count(rel_id) == 0) {
-            return false;
-        }
-        auto const &vec = m_marks[rel_id];
-        auto const range = std::equal_range(vec.begin(), vec.end(), obj_id);
-        return range.first != range.second;
-    }
-
     void
     add_features_to_layers(osmium::OSMObject const &object,
                            std::pair<id_map_type::const_iterator,
@@ -115,8 +120,7 @@ class Output
                     feature.set_field("way_id",
                                       static_cast<int32_t>(object.id()));
                     feature.set_field("timestamp", ts.c_str());
-                    feature.set_field("mark",
-                                      check_mark(rel_id, object.positive_id()));
+                    feature.set_field("mark", static_cast<int>(it->mark));
                     feature.add_to_layer();
                 } catch (osmium::geometry_error &e) {
                     std::cerr << "Geometry error writing out way "
@@ -127,11 +131,19 @@ class Output
         }
     }
 
-    void add_members_to_index(osmium::Relation const &relation)
+    // Marks are ids of ways, sorted.
+    void add_members_to_index(
+        osmium::Relation const &relation,
+        std::vector<osmium::unsigned_object_id_type> const &marks)
     {
         for (auto const &member : relation.members()) {
+            bool const is_marked =
+                !marks.empty() && member.type() == osmium::item_type::way &&
+                std::binary_search(marks.cbegin(), marks.cend(),
+                                   member.positive_ref());
             m_id_maps(member.type())
-                .emplace_back(member.positive_ref(), relation.positive_id());
+                .emplace_back(member.positive_ref(), relation.positive_id(),
+                              is_marked);
         }
     }
 
@@ -170,31 +182,91 @@ public:
 
     std::int64_t counter() const noexcept { return m_counter; }
 
+    /**
+     * Add a relation to this output. Marks are the (sorted) ids of member
+     * ways which will get the "mark" field set in the lines layer.
+     */
     void add(osmium::Relation const &relation, uint64_t increment = 1,
              std::vector<osmium::unsigned_object_id_type> const &marks = {})
     {
         m_counter += increment;
         m_writer_rel(relation);
-        add_members_to_index(relation);
-        if (!marks.empty()) {
-            m_marks.emplace(relation.positive_id(), marks);
+        add_members_to_index(relation, marks);
+    }
+
+    /**
+     * Add a point with the location of a problem in the relation directly
+     * to the points layer. These points have the "mark" field set.
+     */
+    void add_problem_point(osmium::Relation const &relation,
+                           osmium::object_id_type node_id,
+                           osmium::Location location)
+    {
+        if (!m_layer_points) {
+            return;
+        }
+
+        try {
+            gdalcpp::Feature feature{*m_layer_points,
+                                     m_factory.create_point(location)};
+            const auto ts = relation.timestamp().to_iso();
+            feature.set_field("rel_id", static_cast<int32_t>(relation.id()));
+            feature.set_field("node_id", static_cast<double>(node_id));
+            feature.set_field("timestamp", ts.c_str());
+            feature.set_field("mark", 1);
+            feature.add_to_layer();
+        } catch (osmium::invalid_location const &) {
+            // ignore problems without valid location
         }
     }
 
     using id_pair = std::pair<osmium::unsigned_object_id_type,
                               osmium::unsigned_object_id_type>;
 
+    /**
+     * Write out the object if it is a member of any of the relations added
+     * to this output. Must be called after prepare(). As long as the
+     * objects come in order of their (type and) id, a cursor into the
+     * sorted id map is moved forward for each object, so the whole pass
+     * over the input is linear. If an object is seen out of order, this
+     * falls back to a binary search.
+     */
     void write_to_all(osmium::OSMObject const &object)
     {
         auto const &map = m_id_maps(object.type());
-        auto const range = std::equal_range(
-            map.begin(), map.end(), mem_rel_mapping{object.positive_id()},
-            [](auto const &a, auto const &b) {
-                return a.member_id < b.member_id;
-            });
-        if (range.first != range.second) {
+        auto const id = object.positive_id();
+
+        if (m_sorted_input && id < m_last_ids(object.type())) {
+            m_sorted_input = false;
+        }
+        m_last_ids(object.type()) = id;
+
+        if (!m_sorted_input) {
+            auto const range = std::equal_range(
+                map.begin(), map.end(), mem_rel_mapping{id},
+                [](auto const &a, auto const &b) {
+                    return a.member_id < b.member_id;
+                });
+            if (range.first != range.second) {
+                m_writer_all(object);
+                add_features_to_layers(object, range);
+            }
+            return;
+        }
+
+        auto &cursor = m_cursors(object.type());
+        while (cursor != map.end() && cursor->member_id < id) {
+            ++cursor;
+        }
+
+        auto end = cursor;
+        while (end != map.end() && end->member_id == id) {
+            ++end;
+        }
+
+        if (end != cursor) {
             m_writer_all(object);
-            add_features_to_layers(object, range);
+            add_features_to_layers(object, std::make_pair(cursor, end));
         }
     }
 
@@ -206,6 +278,15 @@ public:
                   m_id_maps(osmium::item_type::way).end());
         std::sort(m_id_maps(osmium::item_type::relation).begin(),
                   m_id_maps(osmium::item_type::relation).end());
+
+        m_cursors(osmium::item_type::node) =
+            m_id_maps(osmium::item_type::node).cbegin();
+        m_cursors(osmium::item_type::way) =
+            m_id_maps(osmium::item_type::way).cbegin();
+        m_cursors(osmium::item_type::relation) =
+            m_id_maps(osmium::item_type::relation).cbegin();
+        m_last_ids = {};
+        m_sorted_input = true;
     }
 
     void close_writer_rel() { m_writer_rel.close(); }
@@ -221,6 +302,10 @@ class Outputs
 {
 
     std::map<std::string, Output> m_outputs;
+
+    // Outputs in the order they were added for access by index.
+    std::vector<Output *> m_outputs_by_index;
+
     std::string m_dirname;
     osmium::io::Header m_header;
     osmium::geom::OGRFactory<> m_factory;
@@ -239,16 +324,28 @@ public:
         m_dataset.exec("PRAGMA journal_mode = OFF;");
     }
 
-    void add_output(char const *name, bool points = true, bool lines = true)
+    /**
+     * Add an output. Returns the index of the output which can be used
+     * for fast access with operator[].
+     */
+    std::size_t add_output(char const *name, bool points = true,
+                           bool lines = true)
     {
-        m_outputs.emplace(std::piecewise_construct, std::forward_as_tuple(name),
-                          std::forward_as_tuple(name, m_dataset, m_factory,
-                                                m_dirname, m_header, points,
-                                                lines));
+        auto const it = m_outputs.emplace(
+            std::piecewise_construct, std::forward_as_tuple(name),
+            std::forward_as_tuple(name, m_dataset, m_factory, m_dirname,
+                                  m_header, points, lines));
+        m_outputs_by_index.push_back(&it.first->second);
+        return m_outputs_by_index.size() - 1;
     }
 
     Output &operator[](char const *name) { return m_outputs.at(name); }
 
+    Output &operator[](std::size_t index) noexcept
+    {
+        return *m_outputs_by_index[index];
+    }
+
     template <typename TFunc>
     void for_all(TFunc &&func)
     {
@@ -0,0 +1,200 @@
+#ifndef OSMIUM_SURPLUS_PARALLEL_DIFF_HPP
+#define OSMIUM_SURPLUS_PARALLEL_DIFF_HPP
+
+#include <osmium/diff_visitor.hpp>
+#include <osmium/io/reader.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/thread/pool.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using diff_object_iterator =
+    osmium::memory::Buffer::t_const_iterator<osmium::OSMObject>;
+
+// Returns the first version of the last object in the range [it, end)
+// which must not be empty.
+inline diff_object_iterator
+last_object_start(diff_object_iterator it, diff_object_iterator end) noexcept
+{
+    auto start = it;
+    for (++it; it != end; ++it) {
+        if (start->type() != it->type() || start->id() != it->id()) {
+            start = it;
+        }
+    }
+    return start;
+}
+
+/**
+ * Like osmium::apply_diff(), but the work is spread over a thread pool.
+ * The input must be sorted by type, id, and version as usual for history
+ * files.
+ *
+ * Each buffer from the reader is one task, except for the versions of the
+ * last object in it: Those are copied into a small extra buffer together
+ * with the versions of the same object from the start of the following
+ * buffer(s) and are handled in the same task as the rest of the next
+ * buffer. So the versions of one object are never split between tasks.
+ *
+ * make_handler() is called once for each thread to get a DiffHandler,
+ * every task uses one of those handlers which is not in use by another
+ * task at the time. At the end all handlers are given to merge() from the
+ * calling thread in no particular order, so merging the results must not
+ * depend on the order of the objects. At most 4 * num_threads tasks are
+ * in flight at any time.
+ *
+ * With num_threads <= 1 all objects are given to a single handler from
+ * make_handler() in the calling thread.
+ */
+template <typename TMakeHandler, typename TMerge>
+void apply_diff_parallel(osmium::io::Reader &reader, int num_threads,
+                         TMakeHandler &&make_handler, TMerge &&merge)
+{
+    if (num_threads <= 1) {
+        auto handler = make_handler();
+        osmium::apply_diff(reader, handler);
+        merge(std::move(handler));
+        return;
+    }
+
+    using handler_type = decltype(make_handler());
+
+    auto const num_handlers = static_cast<std::size_t>(num_threads);
+    std::vector<handler_type> handlers;
+    handlers.reserve(num_handlers);
+    std::vector<std::size_t> free_handlers;
+    for (std::size_t n = 0; n < num_handlers; ++n) {
+        handlers.push_back(make_handler());
+        free_handlers.push_back(n);
+    }
+    std::mutex free_handlers_mutex;
+    std::condition_variable handler_freed;
+
+    osmium::thread::Pool pool{num_threads};
+    std::deque<std::future<void>> queue;
+    auto const max_queue_size = num_handlers * 4;
+
+    using buffer_ptr = std::shared_ptr<osmium::memory::Buffer>;
+
+    // The versions in the previous carry buffer (if any) are handled
+    // before the range from the buffer, both with the same handler.
+    auto const submit = [&](buffer_ptr previous, buffer_ptr buffer,
+                            diff_object_iterator first,
+                            diff_object_iterator last) {
+        queue.push_back(pool.submit([&, previous, buffer, first, last]() {
+            std::size_t n = 0;
+            {
+                std::unique_lock<std::mutex> lock{free_handlers_mutex};
+                handler_freed.wait(lock,
+                                   [&]() { return !free_handlers.empty(); });
+                n = free_handlers.back();
+                free_handlers.pop_back();
+            }
+            auto const release = [&]() {
+                {
+                    std::lock_guard<std::mutex> lock{free_handlers_mutex};
+                    free_handlers.push_back(n);
+                }
+                handler_freed.notify_one();
+            };
+            auto &handler = handlers[n];
+            try {
+                if (previous) {
+                    auto const objects =
+                        previous->select<osmium::OSMObject>();
+                    osmium::apply_diff(objects.cbegin(), objects.cend(),
+                                       handler);
+                }
+                osmium::apply_diff(first, last, handler);
+            } catch (...) {
+                release();
+                throw;
+            }
+            release();
+        }));
+        if (queue.size() >= max_queue_size) {
+            auto future = std::move(queue.front());
+            queue.pop_front();
+            future.get();
+        }
+    };
+
+    // versions of the object at the end of the last buffer
+    constexpr std::size_t const initial_carry_size = 1024UL * 1024UL;
+    auto const new_carry = [&]() {
+        return std::make_shared<osmium::memory::Buffer>(
+            initial_carry_size, osmium::memory::Buffer::auto_grow::yes);
+    };
+    buffer_ptr carry = new_carry();
+
+    try {
+        while (auto buffer = reader.read()) {
+            auto shared_buffer =
+                std::make_shared<osmium::memory::Buffer>(std::move(buffer));
+            auto const objects = shared_buffer->select<osmium::OSMObject>();
+            auto it = objects.cbegin();
+            auto const end = objects.cend();
+
+            // More versions of the object in the carry buffer?
+            if (carry->committed() > 0) {
+                auto const &carried =
+                    *carry->select<osmium::OSMObject>().cbegin();
+                auto const type = carried.type();
+                auto const id = carried.id();
+                while (it != end && it->type() == type && it->id() == id) {
+                    carry->add_item(*it);
+                    carry->commit();
+                    ++it;
+                }
+            }
+
+            if (it == end) {
+                continue;
+            }
+
+            auto const split = last_object_start(it, end);
+            buffer_ptr done_carry;
+            if (carry->committed() > 0) {
+                done_carry = std::move(carry);
+                carry = new_carry();
+            }
+            for (auto c = split; c != end; ++c) {
+                carry->add_item(*c);
+                carry->commit();
+            }
+            if (done_carry || it != split) {
+                submit(std::move(done_carry), shared_buffer, it, split);
+            }
+        }
+        if (carry->committed() > 0) {
+            auto const objects = carry->select<osmium::OSMObject>();
+            submit(nullptr, carry, objects.cbegin(), objects.cend());
+        }
+    } catch (...) {
+        // Wait for the running tasks, they reference the handlers.
+        for (auto &future : queue) {
+            future.wait();
+        }
+        throw;
+    }
+
+    for (auto &future : queue) {
+        future.wait();
+    }
+    for (auto &future : queue) {
+        future.get();
+    }
+    for (auto &handler : handlers) {
+        merge(std::move(handler));
+    }
+}
+
+#endif // OSMIUM_SURPLUS_PARALLEL_DIFF_HPP
@@ -0,0 +1,258 @@
+#ifndef OSMIUM_SURPLUS_RADIX_SORT_HPP
+#define OSMIUM_SURPLUS_RADIX_SORT_HPP
+
+#include "thread-util.hpp"
+
+#include <osmium/thread/pool.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Inputs smaller than this are sorted with std::sort.
+constexpr std::size_t const min_size_for_radix_sort = 1U << 16U;
+
+/**
+ * Sort the data with an LSD radix sort on 8 bit digits. The data is split
+ * into one chunk per thread. For each digit all threads count the digits
+ * in their chunk, then each thread moves its values to their place in a
+ * scratch vector the size of the data. Because the chunks are in order
+ * this is stable. Passes where all values have the same digit are skipped.
+ */
+inline void parallel_radix_sort(std::vector<uint64_t> &data, int num_threads)
+{
+    if (data.size() < min_size_for_radix_sort) {
+        std::sort(data.begin(), data.end());
+        return;
+    }
+
+    constexpr unsigned int const digit_bits = 8;
+    constexpr std::size_t const num_bins = 1U << digit_bits;
+    constexpr uint64_t const digit_mask = num_bins - 1;
+
+    using histogram_type = std::array<std::size_t, num_bins>;
+
+    auto const size = data.size();
+    auto const num_chunks = static_cast<std::size_t>(std::max(num_threads, 1));
+    auto const chunk_size = (size + num_chunks - 1) / num_chunks;
+    auto const chunk_begin = [&](std::size_t n) {
+        return std::min(n * chunk_size, size);
+    };
+
+    std::unique_ptr<osmium::thread::Pool> pool;
+    if (num_chunks > 1) {
+        pool = std::make_unique<osmium::thread::Pool>(num_threads);
+    }
+
+    std::vector<uint64_t> scratch(size);
+    std::vector<histogram_type> histograms(num_chunks);
+
+    for (unsigned int shift = 0; shift < 64; shift += digit_bits) {
+        run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+            auto &histogram = histograms[n];
+            histogram.fill(0);
+            for (auto i = chunk_begin(n); i < chunk_begin(n + 1); ++i) {
+                ++histogram[(data[i] >> shift) & digit_mask];
+            }
+        });
+
+        // Turn the counts into the positions where each chunk puts its
+        // first value with each digit.
+        bool single_bin = false;
+        std::size_t offset = 0;
+        for (std::size_t bin = 0; bin < num_bins; ++bin) {
+            auto const bin_begin = offset;
+            for (auto &histogram : histograms) {
+                auto const count = histogram[bin];
+                histogram[bin] = offset;
+                offset += count;
+            }
+            if (offset - bin_begin == size) {
+                single_bin = true;
+            }
+        }
+        if (single_bin) {
+            continue;
+        }
+
+        run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+            auto &positions = histograms[n];
+            for (auto i = chunk_begin(n); i < chunk_begin(n + 1); ++i) {
+                auto const value = data[i];
+                scratch[positions[(value >> shift) & digit_mask]++] = value;
+            }
+        });
+
+        data.swap(scratch);
+    }
+}
+
+/**
+ * Sort the values in [first, last) with a (single-threaded) LSD radix sort
+ * on 8 bit digits, but only looking at the lowest "bits" bits of the
+ * values. So this only works if all values have the same higher bits.
+ * The scratch space must be as large as the data. Returns a pointer to
+ * the sorted data, which is either first or scratch.
+ */
+inline uint64_t *radix_sort_low_bits(uint64_t *first, uint64_t *last,
+                                     uint64_t *scratch, unsigned int bits)
+{
+    constexpr std::size_t const min_size = 256;
+    constexpr unsigned int const digit_bits = 8;
+    constexpr std::size_t const num_bins = 1U << digit_bits;
+    constexpr uint64_t const digit_mask = num_bins - 1;
+
+    auto const size = static_cast<std::size_t>(last - first);
+    if (size < min_size) {
+        std::sort(first, last);
+        return first;
+    }
+
+    uint64_t *src = first;
+    uint64_t *dest = scratch;
+    std::array<std::size_t, num_bins> positions{};
+    for (unsigned int shift = 0; shift < bits; shift += digit_bits) {
+        positions.fill(0);
+        for (auto const *it = src; it != src + size; ++it) {
+            ++positions[(*it >> shift) & digit_mask];
+        }
+
+        if (std::find(positions.cbegin(), positions.cend(), size) !=
+            positions.cend()) {
+            continue;
+        }
+
+        std::size_t offset = 0;
+        for (auto &position : positions) {
+            auto const count = position;
+            position = offset;
+            offset += count;
+        }
+
+        for (auto const *it = src; it != src + size; ++it) {
+            dest[positions[(*it >> shift) & digit_mask]++] = *it;
+        }
+        std::swap(src, dest);
+    }
+
+    return src;
+}
+
+/**
+ * Sort the data and remove duplicates. The values are first distributed
+ * (in parallel, one chunk of data per thread) into buckets by their
+ * highest bits (MSD). Then the threads take one bucket after the other,
+ * sort it with an LSD radix sort on the remaining bits and remove the
+ * duplicates, which are always in the same bucket. Finally the buckets are
+ * moved together.
+ */
+inline void parallel_radix_sort_unique(std::vector<uint64_t> &data,
+                                       int num_threads)
+{
+    if (data.size() < min_size_for_radix_sort) {
+        std::sort(data.begin(), data.end());
+        data.erase(std::unique(data.begin(), data.end()), data.end());
+        return;
+    }
+
+    constexpr unsigned int const bucket_bits = 10;
+    constexpr std::size_t const num_buckets = 1U << bucket_bits;
+
+    using histogram_type = std::array<std::size_t, num_buckets>;
+
+    auto const size = data.size();
+    auto const num_chunks = static_cast<std::size_t>(std::max(num_threads, 1));
+    auto const chunk_size = (size + num_chunks - 1) / num_chunks;
+    auto const chunk_begin = [&](std::size_t n) {
+        return std::min(n * chunk_size, size);
+    };
+
+    std::unique_ptr<osmium::thread::Pool> pool;
+    if (num_chunks > 1) {
+        pool = std::make_unique<osmium::thread::Pool>(num_threads);
+    }
+
+    // The buckets are chosen based on the highest bits actually used.
+    std::vector<uint64_t> maxima(num_chunks);
+    run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+        maxima[n] = *std::max_element(data.cbegin() + chunk_begin(n),
+                                      data.cbegin() + chunk_begin(n + 1));
+    });
+    auto const max_value = *std::max_element(maxima.cbegin(), maxima.cend());
+    unsigned int bits = 0;
+    while (bits < 64 && (max_value >> bits) != 0) {
+        ++bits;
+    }
+    unsigned int const shift = bits > bucket_bits ? bits - bucket_bits : 0;
+
+    std::vector<histogram_type> histograms(num_chunks);
+    run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+        auto &histogram = histograms[n];
+        histogram.fill(0);
+        for (auto i = chunk_begin(n); i < chunk_begin(n + 1); ++i) {
+            ++histogram[data[i] >> shift];
+        }
+    });
+
+    std::vector<std::size_t> bucket_begin(num_buckets + 1);
+    std::size_t offset = 0;
+    for (std::size_t bucket = 0; bucket < num_buckets; ++bucket) {
+        bucket_begin[bucket] = offset;
+        for (auto &histogram : histograms) {
+            auto const count = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += count;
+        }
+    }
+    bucket_begin[num_buckets] = offset;
+
+    std::vector<uint64_t> scratch(size);
+    run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+        auto &positions = histograms[n];
+        for (auto i = chunk_begin(n); i < chunk_begin(n + 1); ++i) {
+            auto const value = data[i];
+            scratch[positions[value >> shift]++] = value;
+        }
+    });
+
+    // Buckets can have very different sizes, so the threads take the next
+    // bucket from a shared counter instead of getting a fixed range.
+    std::vector<uint64_t const *> results(num_buckets);
+    std::vector<std::size_t> unique_counts(num_buckets);
+    std::atomic<std::size_t> next_bucket{0};
+    run_chunks(pool.get(), num_chunks, [&](std::size_t /*n*/) {
+        for (auto bucket = next_bucket++; bucket < num_buckets;
+             bucket = next_bucket++) {
+            auto const begin = bucket_begin[bucket];
+            auto const end = bucket_begin[bucket + 1];
+            auto *sorted =
+                radix_sort_low_bits(scratch.data() + begin,
+                                    scratch.data() + end,
+                                    data.data() + begin, shift);
+            results[bucket] = sorted;
+            unique_counts[bucket] =
+                std::unique(sorted, sorted + (end - begin)) - sorted;
+        }
+    });
+
+    // Each bucket is moved to a position at or before the one it is in
+    // now, so doing this in order never overwrites data still needed.
+    // Buckets which were sorted into data and had no duplicates removed
+    // before them are already in place and not copied.
+    offset = 0;
+    for (std::size_t bucket = 0; bucket < num_buckets; ++bucket) {
+        if (results[bucket] != data.data() + offset) {
+            std::copy(results[bucket],
+                      results[bucket] + unique_counts[bucket],
+                      data.data() + offset);
+        }
+        offset += unique_counts[bucket];
+    }
+    data.resize(offset);
+}
+
+#endif // OSMIUM_SURPLUS_RADIX_SORT_HPP
@@ -0,0 +1,508 @@
+#ifndef OSMIUM_SURPLUS_REFERENCED_IDS_HPP
+#define OSMIUM_SURPLUS_REFERENCED_IDS_HPP
+
+#include "bucket.hpp"
+#include "concurrent-id-set.hpp"
+
+#include <osmium/io/any_input.hpp>
+#include <osmium/osm/timestamp.hpp>
+#include <osmium/thread/pool.hpp>
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+#include <osmium/util/progress_bar.hpp>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <future>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/**
+ * The sets of referenced ids kept in a ReferencedIds object. Nodes in ways
+ * don't include the first node of closed ways (which is also the last), so
+ * a node in a single closed way is not in multiple_way_nodes.
+ */
+enum class ref_set : std::size_t
+{
+    way_nodes = 0, // nodes referenced from ways
+    multiple_way_nodes = 1, // nodes referenced more than once from ways
+    member_nodes = 2, // nodes that are relation members
+    member_ways = 3, // ways that are relation members
+    member_relations = 4 // relations that are relation members
+};
+
+constexpr std::size_t const num_ref_sets = 5;
+
+/**
+ * Identifies the input file a cache was created from. If any of these
+ * change, the cache is considered stale and is created again.
+ */
+struct referenced_ids_key
+{
+    uint64_t file_size = 0;
+    int64_t mtime = 0;
+    int64_t header_timestamp = 0;
+};
+
+inline referenced_ids_key
+make_referenced_ids_key(osmium::io::File const &input_file)
+{
+    referenced_ids_key key;
+
+    struct stat s; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    if (::stat(input_file.filename().c_str(), &s) != 0) {
+        throw std::system_error{errno, std::system_category(),
+                                std::string{"Can't stat file '"} +
+                                    input_file.filename() + "'"};
+    }
+    key.file_size = static_cast<uint64_t>(s.st_size);
+    key.mtime = static_cast<int64_t>(s.st_mtime);
+
+    osmium::io::Reader reader{input_file, osmium::osm_entity_bits::nothing};
+    auto const header = reader.header();
+    reader.close();
+
+    auto timestamp = header.get("osmosis_replication_timestamp");
+    if (timestamp.empty()) {
+        timestamp = header.get("timestamp");
+    }
+    if (!timestamp.empty()) {
+        try {
+            key.header_timestamp =
+                osmium::Timestamp{timestamp}.seconds_since_epoch();
+        } catch (std::invalid_argument const &) {
+            // ignore broken timestamp in header
+        }
+    }
+
+    return key;
+}
+
+/**
+ * Which nodes, ways, and relations are referenced from ways and relations
+ * in an OSM file, plus which nodes are in more than one way. This is either
+ * created by reading the file or loaded from a cache file created earlier
+ * by any of the programs using it.
+ *
+ * The cache file contains a header with the key of the input file, followed
+ * by one table per set with the offsets of the bitmap chunks in the file (0
+ * for chunks without any ids set), followed by the chunks. It is mapped
+ * into memory when loaded, so only the chunks actually used are read.
+ */
+class ReferencedIds
+{
+
+    using id_type = osmium::unsigned_object_id_type;
+
+    struct file_header
+    {
+        std::array<char, 8> magic;
+        referenced_ids_key key;
+        uint64_t count_ways;
+        uint64_t count_relations;
+        uint64_t num_sets;
+    }; // struct file_header
+
+    constexpr static char const *const magic = "OSPREFS1";
+
+    constexpr static std::size_t const words_per_chunk =
+        ConcurrentIdSet::words_per_chunk;
+
+    // Used after the sets were created from the input file.
+    std::array<std::unique_ptr<ConcurrentIdSet>, num_ref_sets> m_sets;
+
+    // Used after the sets were loaded from a cache file.
+    std::unique_ptr<osmium::util::MemoryMapping> m_mapping;
+    std::array<std::vector<uint64_t const *>, num_ref_sets> m_chunks;
+
+    uint64_t m_count_ways = 0;
+    uint64_t m_count_relations = 0;
+
+    ConcurrentIdSet &set(ref_set s) noexcept
+    {
+        return *m_sets[static_cast<std::size_t>(s)];
+    }
+
+    ConcurrentIdSet const &created_set(std::size_t n) const noexcept
+    {
+        return *m_sets[n];
+    }
+
+    // Add all references from the buffer. Can be called for several
+    // buffers in parallel.
+    void add_references(osmium::memory::Buffer const &buffer,
+                        std::atomic<uint64_t> *count_ways,
+                        std::atomic<uint64_t> *count_relations)
+    {
+        uint64_t ways = 0;
+        uint64_t relations = 0;
+        for (auto const &object : buffer.select<osmium::OSMObject>()) {
+            if (object.type() == osmium::item_type::way) {
+                ++ways;
+                auto const &way = static_cast<osmium::Way const &>(object);
+                if (way.nodes().empty()) {
+                    continue;
+                }
+                auto const *it = way.nodes().begin();
+                if (way.is_closed()) {
+                    ++it;
+                }
+                for (; it != way.nodes().end(); ++it) {
+                    if (set(ref_set::way_nodes)
+                            .test_and_set(it->positive_ref())) {
+                        set(ref_set::multiple_way_nodes)
+                            .set(it->positive_ref());
+                    }
+                }
+            } else if (object.type() == osmium::item_type::relation) {
+                ++relations;
+                for (auto const &member :
+                     static_cast<osmium::Relation const &>(object).members()) {
+                    auto const s =
+                        static_cast<std::size_t>(ref_set::member_nodes) +
+                        osmium::item_type_to_nwr_index(member.type());
+                    m_sets[s]->set(member.positive_ref());
+                }
+            }
+        }
+        *count_ways += ways;
+        *count_relations += relations;
+    }
+
+public:
+    ReferencedIds() = default;
+
+    /**
+     * Create the sets by reading the input file. With more than one thread
+     * the buffers are handed to a thread pool as they are read and the
+     * bits are set in the (shared) sets from all threads.
+     */
+    void create(osmium::io::File const &input_file, int num_threads,
+                osmium::ProgressBar *progress_bar = nullptr)
+    {
+        m_mapping.reset();
+        for (std::size_t n = 0; n < num_ref_sets; ++n) {
+            m_sets[n] = std::make_unique<ConcurrentIdSet>();
+            m_chunks[n].clear();
+        }
+
+        std::atomic<uint64_t> count_ways{0};
+        std::atomic<uint64_t> count_relations{0};
+
+        osmium::io::Reader reader{input_file,
+                                  osmium::osm_entity_bits::way |
+                                      osmium::osm_entity_bits::relation};
+
+        if (num_threads <= 1) {
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                if (progress_bar) {
+                    progress_bar->update(reader.offset());
+                }
+                add_references(buffer, &count_ways, &count_relations);
+            }
+        } else {
+            // The queue limits the number of buffers in flight.
+            osmium::thread::Pool pool{num_threads};
+            std::deque<std::future<void>> queue;
+            auto const max_queue_size =
+                static_cast<std::size_t>(num_threads) * 4;
+
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                if (progress_bar) {
+                    progress_bar->update(reader.offset());
+                }
+                queue.push_back(pool.submit([&, b = std::move(buffer)]() {
+                    add_references(b, &count_ways, &count_relations);
+                }));
+                if (queue.size() >= max_queue_size) {
+                    queue.front().get();
+                    queue.pop_front();
+                }
+            }
+
+            for (auto &future : queue) {
+                future.get();
+            }
+        }
+
+        reader.close();
+
+        m_count_ways = count_ways;
+        m_count_relations = count_relations;
+    }
+
+    /**
+     * Load the sets from the cache file. Returns false if the file doesn't
+     * exist or doesn't match the key, in which case nothing is changed.
+     */
+    bool load(std::string const &filename, referenced_ids_key const &key)
+    {
+        int const fd =
+            ::open(filename.c_str(),
+                   O_RDONLY | O_CLOEXEC); // NOLINT(hicpp-signed-bitwise)
+        if (fd < 0) {
+            return false;
+        }
+        auto const file_size = osmium::util::file_size(fd);
+        if (file_size < sizeof(file_header)) {
+            ::close(fd);
+            return false;
+        }
+
+        auto mapping = std::make_unique<osmium::util::MemoryMapping>(
+            file_size, osmium::util::MemoryMapping::mapping_mode::readonly,
+            fd);
+        ::close(fd);
+
+        auto const *data = mapping->get_addr<char>();
+        file_header header; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        std::memcpy(&header, data, sizeof(file_header));
+
+        if (std::memcmp(header.magic.data(), magic, header.magic.size()) !=
+                0 ||
+            header.key.file_size != key.file_size ||
+            header.key.mtime != key.mtime ||
+            header.key.header_timestamp != key.header_timestamp ||
+            header.num_sets != num_ref_sets) {
+            return false;
+        }
+
+        auto const *words = reinterpret_cast<uint64_t const *>(data);
+        auto const num_words = file_size / sizeof(uint64_t);
+        std::array<std::vector<uint64_t const *>, num_ref_sets> chunks;
+
+        std::size_t pos = sizeof(file_header) / sizeof(uint64_t);
+        for (auto &table : chunks) {
+            if (pos >= num_words || words[pos] > num_words - pos - 1) {
+                return false;
+            }
+            auto const num_chunks = words[pos++];
+            for (std::size_t n = 0; n < num_chunks; ++n) {
+                auto const offset = words[pos + n];
+                if (offset > num_words ||
+                    (offset != 0 && num_words - offset < words_per_chunk)) {
+                    return false;
+                }
+                table.push_back(offset == 0 ? nullptr : words + offset);
+            }
+            pos += num_chunks;
+        }
+
+        for (auto &s : m_sets) {
+            s.reset();
+        }
+        m_chunks = std::move(chunks);
+        m_mapping = std::move(mapping);
+        m_count_ways = header.count_ways;
+        m_count_relations = header.count_relations;
+
+        return true;
+    }
+
+    /**
+     * Save the sets created with create() to a cache file. The file is
+     * written under a temporary name and renamed at the end, so other
+     * programs never see a partial file.
+     */
+    void save(std::string const &filename,
+              referenced_ids_key const &key) const
+    {
+        // number of chunks needed for each set
+        std::array<std::size_t, num_ref_sets> num_chunks{};
+        std::size_t table_words = 0;
+        for (std::size_t s = 0; s < num_ref_sets; ++s) {
+            for (std::size_t n = 0; n < ConcurrentIdSet::max_chunks; ++n) {
+                if (created_set(s).chunk(n)) {
+                    num_chunks[s] = n + 1;
+                }
+            }
+            table_words += 1 + num_chunks[s];
+        }
+
+        file_header header; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        std::memcpy(header.magic.data(), magic, header.magic.size());
+        header.key = key;
+        header.count_ways = m_count_ways;
+        header.count_relations = m_count_relations;
+        header.num_sets = num_ref_sets;
+
+        // Build the tables with the chunk offsets (in words).
+        std::vector<uint64_t> tables;
+        tables.reserve(table_words);
+        uint64_t offset = sizeof(file_header) / sizeof(uint64_t) + table_words;
+        for (std::size_t s = 0; s < num_ref_sets; ++s) {
+            tables.push_back(num_chunks[s]);
+            for (std::size_t n = 0; n < num_chunks[s]; ++n) {
+                if (created_set(s).chunk(n)) {
+                    tables.push_back(offset);
+                    offset += words_per_chunk;
+                } else {
+                    tables.push_back(0);
+                }
+            }
+        }
+
+        // The temporary file name is unique for each process, so several
+        // programs creating the same cache file at the same time don't
+        // write into the same file. The last rename() wins.
+        std::string const tmp_filename =
+            filename + ".tmp." + std::to_string(::getpid());
+        int const fd = ::open(tmp_filename.c_str(),
+                              // NOLINTNEXTLINE(hicpp-signed-bitwise)
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            throw std::system_error{errno, std::system_category(),
+                                    std::string{"Can't open file '"} +
+                                        tmp_filename + "'"};
+        }
+
+        try {
+            write_to_bucket_file(fd, &header, sizeof(file_header),
+                                 tmp_filename);
+            write_to_bucket_file(fd, tables.data(),
+                                 tables.size() * sizeof(uint64_t),
+                                 tmp_filename);
+
+            std::vector<uint64_t> words(words_per_chunk);
+            for (std::size_t s = 0; s < num_ref_sets; ++s) {
+                for (std::size_t n = 0; n < num_chunks[s]; ++n) {
+                    auto const *chunk = created_set(s).chunk(n);
+                    if (!chunk) {
+                        continue;
+                    }
+                    for (std::size_t i = 0; i < words_per_chunk; ++i) {
+                        words[i] = chunk[i].load(std::memory_order_relaxed);
+                    }
+                    write_to_bucket_file(fd, words.data(),
+                                         words.size() * sizeof(uint64_t),
+                                         tmp_filename);
+                }
+            }
+        } catch (...) {
+            ::close(fd);
+            ::unlink(tmp_filename.c_str());
+            throw;
+        }
+
+        ::close(fd);
+
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+            auto const error = errno;
+            ::unlink(tmp_filename.c_str());
+            throw std::system_error{error, std::system_category(),
+                                    std::string{"Can't rename file '"} +
+                                        tmp_filename + "'"};
+        }
+    }
+
+    /**
+     * Load the sets from the cache file if there is one matching the input
+     * file, otherwise create them and write the cache file. If the cache
+     * filename is empty, no cache is used. Returns true if the cache was
+     * used.
+     */
+    bool load_or_create(osmium::io::File const &input_file,
+                        std::string const &cache_filename, int num_threads,
+                        osmium::ProgressBar *progress_bar = nullptr)
+    {
+        if (cache_filename.empty()) {
+            create(input_file, num_threads, progress_bar);
+            return false;
+        }
+
+        auto const key = make_referenced_ids_key(input_file);
+        if (load(cache_filename, key)) {
+            return true;
+        }
+
+        create(input_file, num_threads, progress_bar);
+        save(cache_filename, key);
+        return false;
+    }
+
+    [[nodiscard]] bool get(ref_set s, id_type id) const noexcept
+    {
+        auto const n = static_cast<std::size_t>(s);
+        if (m_sets[n]) {
+            return m_sets[n]->get(id);
+        }
+
+        auto const c = static_cast<std::size_t>(
+            id >> ConcurrentIdSet::chunk_bits);
+        if (c >= m_chunks[n].size() || !m_chunks[n][c]) {
+            return false;
+        }
+        return (m_chunks[n][c][(id >> 6U) & (words_per_chunk - 1)] &
+                (uint64_t{1} << (id & 0x3fU))) != 0;
+    }
+
+    /// Is this object referenced from any way or relation?
+    [[nodiscard]] bool referenced(osmium::item_type type,
+                                  id_type id) const noexcept
+    {
+        if (type == osmium::item_type::node) {
+            return get(ref_set::way_nodes, id) ||
+                   get(ref_set::member_nodes, id);
+        }
+        if (type == osmium::item_type::way) {
+            return get(ref_set::member_ways, id);
+        }
+        return get(ref_set::member_relations, id);
+    }
+
+    /// Call func(id) for all ids in the set in order.
+    template <typename TFunc>
+    void for_each(ref_set s, TFunc &&func) const
+    {
+        auto const n = static_cast<std::size_t>(s);
+        std::size_t const num_chunks =
+            m_sets[n] ? ConcurrentIdSet::max_chunks : m_chunks[n].size();
+
+        for (std::size_t c = 0; c < num_chunks; ++c) {
+            auto const *created_chunk =
+                m_sets[n] ? created_set(n).chunk(c) : nullptr;
+            auto const *loaded_chunk = m_sets[n] ? nullptr : m_chunks[n][c];
+            if (!created_chunk && !loaded_chunk) {
+                continue;
+            }
+            auto const first_id = static_cast<id_type>(c)
+                                  << ConcurrentIdSet::chunk_bits;
+            for (std::size_t w = 0; w < words_per_chunk; ++w) {
+                uint64_t word =
+                    loaded_chunk
+                        ? loaded_chunk[w]
+                        : created_chunk[w].load(std::memory_order_relaxed);
+                while (word != 0) {
+                    auto const bit =
+                        static_cast<id_type>(__builtin_ctzll(word));
+                    func(first_id + w * 64U + bit);
+                    word &= word - 1;
+                }
+            }
+        }
+    }
+
+    /// The number of ways in the input file.
+    [[nodiscard]] uint64_t count_ways() const noexcept { return m_count_ways; }
+
+    /// The number of relations in the input file.
+    [[nodiscard]] uint64_t count_relations() const noexcept
+    {
+        return m_count_relations;
+    }
+
+}; // class ReferencedIds
+
+#endif // OSMIUM_SURPLUS_REFERENCED_IDS_HPP
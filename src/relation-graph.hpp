@@ -0,0 +1,332 @@
+#ifndef OSMIUM_SURPLUS_RELATION_GRAPH_HPP
+#define OSMIUM_SURPLUS_RELATION_GRAPH_HPP
+
+#include "thread-util.hpp"
+
+#include <osmium/osm/relation.hpp>
+#include <osmium/thread/pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * The graph of relations and their relation members. Relations are added
+ * with add_relation(), after that build() creates a compact representation
+ * of the graph in CSR (compressed sparse row) form: For each relation (or
+ * vertex) the offsets array has the position in the targets array where
+ * the list of its relation members starts. Relations are numbered in order
+ * of their ids, so this needs 4 bytes per vertex and 4 bytes per edge.
+ */
+class RelationGraph
+{
+
+public:
+    using index_type = uint32_t;
+
+    constexpr static index_type const invalid_index =
+        std::numeric_limits<index_type>::max();
+
+private:
+    // relation ids, sorted after build(), the position of an id in this
+    // vector is its index
+    std::vector<osmium::unsigned_object_id_type> m_ids;
+
+    // edges from relation to member relation by id, only used until
+    // build() is called
+    std::vector<std::pair<osmium::unsigned_object_id_type,
+                          osmium::unsigned_object_id_type>>
+        m_edges;
+
+    std::vector<index_type> m_offsets;
+    std::vector<index_type> m_targets;
+
+public:
+    /// Add the relation and its relation members to the graph.
+    void add_relation(osmium::Relation const &relation)
+    {
+        m_ids.push_back(relation.positive_id());
+        for (auto const &member : relation.members()) {
+            if (member.type() == osmium::item_type::relation) {
+                m_edges.emplace_back(relation.positive_id(),
+                                     member.positive_ref());
+            }
+        }
+    }
+
+    /**
+     * Build the CSR form of the graph with a parallel counting sort of the
+     * edges by their source. Edges to relations not in the graph are
+     * dropped.
+     */
+    void build(int num_threads)
+    {
+        std::sort(m_ids.begin(), m_ids.end());
+        m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+        if (m_ids.size() >= invalid_index) {
+            throw std::range_error{"too many relations for RelationGraph"};
+        }
+
+        auto const num_vertices = m_ids.size();
+        auto const num_chunks =
+            static_cast<std::size_t>(std::max(num_threads, 1));
+        auto const chunk_size = (m_edges.size() + num_chunks - 1) / num_chunks;
+        auto const chunk_begin = [&](std::size_t n) {
+            return std::min(n * chunk_size, m_edges.size());
+        };
+
+        std::unique_ptr<osmium::thread::Pool> pool;
+        if (num_chunks > 1) {
+            pool = std::make_unique<osmium::thread::Pool>(num_threads);
+        }
+
+        // Replace ids by indexes and count the edges per source.
+        std::unique_ptr<std::atomic<index_type>[]> positions{
+            new std::atomic<index_type>[num_vertices + 1]()};
+        run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+            for (auto i = chunk_begin(n); i < chunk_begin(n + 1); ++i) {
+                auto &edge = m_edges[i];
+                edge.first = index_of(edge.first);
+                edge.second = index_of(edge.second);
+                if (edge.second != invalid_index) {
+                    positions[edge.first + 1].fetch_add(
+                        1, std::memory_order_relaxed);
+                }
+            }
+        });
+
+        m_offsets.resize(num_vertices + 1);
+        m_offsets[0] = 0;
+        for (std::size_t v = 1; v <= num_vertices; ++v) {
+            m_offsets[v] = m_offsets[v - 1] + positions[v].load();
+            positions[v] = m_offsets[v];
+        }
+        positions[0] = 0;
+
+        m_targets.resize(m_offsets[num_vertices]);
+        run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+            for (auto i = chunk_begin(n); i < chunk_begin(n + 1); ++i) {
+                auto const &edge = m_edges[i];
+                if (edge.second != invalid_index) {
+                    auto const pos = positions[edge.first].fetch_add(
+                        1, std::memory_order_relaxed);
+                    m_targets[pos] = static_cast<index_type>(edge.second);
+                }
+            }
+        });
+
+        m_edges.clear();
+        m_edges.shrink_to_fit();
+
+        // The order of the edges of each vertex depends on the order the
+        // threads ran in, sort them so the result is always the same.
+        auto const vertex_chunk_size =
+            (num_vertices + num_chunks - 1) / num_chunks;
+        run_chunks(pool.get(), num_chunks, [&](std::size_t n) {
+            auto const end = std::min((n + 1) * vertex_chunk_size,
+                                      num_vertices);
+            for (auto v = n * vertex_chunk_size; v < end; ++v) {
+                std::sort(m_targets.begin() + m_offsets[v],
+                          m_targets.begin() + m_offsets[v + 1]);
+            }
+        });
+    }
+
+    [[nodiscard]] std::size_t num_vertices() const noexcept
+    {
+        return m_ids.size();
+    }
+
+    [[nodiscard]] std::size_t num_edges() const noexcept
+    {
+        return m_targets.size();
+    }
+
+    /// The index of the relation with this id or invalid_index.
+    [[nodiscard]] index_type
+    index_of(osmium::unsigned_object_id_type id) const noexcept
+    {
+        auto const it = std::lower_bound(m_ids.cbegin(), m_ids.cend(), id);
+        if (it == m_ids.cend() || *it != id) {
+            return invalid_index;
+        }
+        return static_cast<index_type>(it - m_ids.cbegin());
+    }
+
+    [[nodiscard]] osmium::unsigned_object_id_type
+    id_of(index_type v) const noexcept
+    {
+        return m_ids[v];
+    }
+
+    /// The indexes of the relation members of relation v.
+    [[nodiscard]] std::pair<index_type const *, index_type const *>
+    children(index_type v) const noexcept
+    {
+        return {m_targets.data() + m_offsets[v],
+                m_targets.data() + m_offsets[v + 1]};
+    }
+
+}; // class RelationGraph
+
+/**
+ * Results of the analysis of a RelationGraph, indexed by vertex.
+ */
+struct relation_graph_analysis
+{
+    // relation is in a cycle of two or more relations
+    std::vector<bool> in_cycle;
+
+    // relation can not be reached from any relation that is not itself a
+    // member of some relation
+    std::vector<bool> unreachable;
+
+    // number of levels of relation members below this relation, relations
+    // in a cycle all get the same depth
+    std::vector<RelationGraph::index_type> depth;
+
+}; // struct relation_graph_analysis
+
+/**
+ * Find the strongly connected components of the graph with Tarjan's
+ * algorithm (written iteratively, because recursion could be too deep),
+ * the nesting depth of all relations and the unreachable relations.
+ *
+ * Tarjan's algorithm finds the components in reverse topological order,
+ * so when a component is found, the depths of all relations below it are
+ * already known.
+ */
+inline relation_graph_analysis analyze_graph(RelationGraph const &graph)
+{
+    using index_type = RelationGraph::index_type;
+    constexpr auto const invalid = RelationGraph::invalid_index;
+
+    auto const num_vertices = graph.num_vertices();
+
+    relation_graph_analysis result;
+    result.in_cycle.resize(num_vertices);
+    result.unreachable.resize(num_vertices);
+    result.depth.resize(num_vertices);
+
+    std::vector<index_type> order(num_vertices, invalid);
+    std::vector<index_type> lowlink(num_vertices);
+    std::vector<bool> on_stack(num_vertices);
+    std::vector<index_type> component_stack;
+
+    // the call stack of the recursive version: vertex and next child
+    std::vector<std::pair<index_type, index_type const *>> call_stack;
+
+    index_type next_order = 0;
+
+    for (index_type start = 0; start < num_vertices; ++start) {
+        if (order[start] != invalid) {
+            continue;
+        }
+
+        call_stack.emplace_back(start, graph.children(start).first);
+        order[start] = lowlink[start] = next_order++;
+        component_stack.push_back(start);
+        on_stack[start] = true;
+
+        while (!call_stack.empty()) {
+            auto &frame = call_stack.back();
+            auto const v = frame.first;
+            auto const end = graph.children(v).second;
+
+            if (frame.second != end) {
+                auto const w = *frame.second++;
+                if (order[w] == invalid) {
+                    order[w] = lowlink[w] = next_order++;
+                    component_stack.push_back(w);
+                    on_stack[w] = true;
+                    call_stack.emplace_back(w, graph.children(w).first);
+                } else if (on_stack[w]) {
+                    lowlink[v] = std::min(lowlink[v], order[w]);
+                }
+                continue;
+            }
+
+            call_stack.pop_back();
+            if (!call_stack.empty()) {
+                auto const parent = call_stack.back().first;
+                lowlink[parent] = std::min(lowlink[parent], lowlink[v]);
+            }
+
+            if (lowlink[v] != order[v]) {
+                continue;
+            }
+
+            // v is the root of a component, the component is everything
+            // on the component stack down to v.
+            auto const it =
+                std::find(component_stack.rbegin(), component_stack.rend(), v);
+            auto const begin = it.base() - 1;
+            bool const cycle = (component_stack.end() - begin) > 1;
+
+            // Children still on the stack are in this component, all other
+            // children are in components found earlier.
+            index_type depth = 0;
+            for (auto c = begin; c != component_stack.end(); ++c) {
+                auto const children = graph.children(*c);
+                for (auto const *w = children.first; w != children.second;
+                     ++w) {
+                    if (!on_stack[*w]) {
+                        depth = std::max(depth, result.depth[*w] + 1);
+                    }
+                }
+            }
+            for (auto c = begin; c != component_stack.end(); ++c) {
+                on_stack[*c] = false;
+                result.depth[*c] = depth;
+                result.in_cycle[*c] = cycle;
+            }
+            component_stack.erase(begin, component_stack.end());
+        }
+    }
+
+    // Find all relations reachable from the roots, ie. the relations that
+    // are not members of other relations. Relations which are members of
+    // themselves are not counted as members here.
+    std::vector<bool> has_parent(num_vertices);
+    for (index_type v = 0; v < num_vertices; ++v) {
+        auto const children = graph.children(v);
+        for (auto const *w = children.first; w != children.second; ++w) {
+            if (*w != v) {
+                has_parent[*w] = true;
+            }
+        }
+    }
+
+    std::vector<bool> reached(num_vertices);
+    std::vector<index_type> queue;
+    for (index_type v = 0; v < num_vertices; ++v) {
+        if (!has_parent[v]) {
+            reached[v] = true;
+            queue.push_back(v);
+        }
+    }
+    while (!queue.empty()) {
+        auto const v = queue.back();
+        queue.pop_back();
+        auto const children = graph.children(v);
+        for (auto const *w = children.first; w != children.second; ++w) {
+            if (!reached[*w]) {
+                reached[*w] = true;
+                queue.push_back(*w);
+            }
+        }
+    }
+    for (index_type v = 0; v < num_vertices; ++v) {
+        result.unreachable[v] = !reached[v];
+    }
+
+    return result;
+}
+
+#endif // OSMIUM_SURPLUS_RELATION_GRAPH_HPP
@@ -0,0 +1,39 @@
+#ifndef OSMIUM_SURPLUS_THREAD_UTIL_HPP
+#define OSMIUM_SURPLUS_THREAD_UTIL_HPP
+
+#include <osmium/thread/pool.hpp>
+
+#include <cstddef>
+#include <future>
+#include <vector>
+
+/**
+ * Call func(n) for each n in 0 <= n < num_chunks. If there is a thread
+ * pool, the calls are done in parallel. Returns after all calls are done.
+ */
+template <typename TFunc>
+void run_chunks(osmium::thread::Pool *pool, std::size_t num_chunks,
+                TFunc &&func)
+{
+    if (!pool || num_chunks == 1) {
+        for (std::size_t n = 0; n < num_chunks; ++n) {
+            func(n);
+        }
+        return;
+    }
+
+    std::vector<std::future<void>> futures;
+    futures.reserve(num_chunks);
+    for (std::size_t n = 0; n < num_chunks; ++n) {
+        futures.push_back(pool->submit([&func, n]() { func(n); }));
+    }
+    // Wait for all calls before get() can throw, func must outlive them.
+    for (auto &future : futures) {
+        future.wait();
+    }
+    for (auto &future : futures) {
+        future.get();
+    }
+}
+
+#endif // OSMIUM_SURPLUS_THREAD_UTIL_HPP
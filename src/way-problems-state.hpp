@@ -0,0 +1,501 @@
+#ifndef OSMIUM_SURPLUS_WAY_PROBLEMS_STATE_HPP
+#define OSMIUM_SURPLUS_WAY_PROBLEMS_STATE_HPP
+
+/**
+ * Persistent state of osp-find-way-problems needed for updating the results
+ * from change files. The state is kept in the "state" subdirectory of the
+ * output directory:
+ *
+ * header.dat       - The state_header.
+ * problems.dat     - A way_state record for each way with problems, sorted
+ *                    by way id.
+ * ways_XX.dat      - All ways as libosmium items, sorted by id and split
+ *                    into 256 buckets by way id.
+ * node_ways_XX.dat - A node_way record for each node reference in a way,
+ *                    sorted and split into 256 buckets by node id. This is
+ *                    used to find the ways affected by changed nodes.
+ *
+ * Files are always written under a temporary name and then renamed, so a
+ * crash while updating leaves each file in either the old or the new state.
+ */
+
+#include "bucket.hpp"
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <tuple>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// must be a power of 2
+// must change build_bucket_filename() function if you change this
+constexpr unsigned int const num_state_buckets = 1U << 8U;
+
+constexpr uint32_t const state_format_version = 1;
+
+struct state_header
+{
+    std::array<char, 8> magic{{'O', 'S', 'P', 'W', 'P', 'S', 'T', '\0'}};
+    uint32_t version = state_format_version;
+
+    // The checks the state was created with (bits from problem_flags).
+    uint32_t checks = 0;
+
+    // Number of node references in all ways.
+    uint64_t way_nodes = 0;
+
+    // Timestamp of the newest object seen.
+    uint32_t last_timestamp = 0;
+
+    uint32_t padding = 0;
+};
+
+struct node_way
+{
+    osmium::object_id_type node_id;
+    osmium::object_id_type way_id;
+
+    friend bool operator<(node_way const &a, node_way const &b) noexcept
+    {
+        return std::tie(a.node_id, a.way_id) < std::tie(b.node_id, b.way_id);
+    }
+};
+
+struct way_state
+{
+    osmium::object_id_type way_id;
+    uint32_t flags;
+    uint32_t duplicate_segments;
+
+    friend bool operator<(way_state const &a, way_state const &b) noexcept
+    {
+        return a.way_id < b.way_id;
+    }
+};
+
+inline unsigned int state_bucket_of(osmium::object_id_type id) noexcept
+{
+    return static_cast<unsigned int>(static_cast<uint64_t>(id) &
+                                     (num_state_buckets - 1));
+}
+
+inline std::string state_ways_filename(std::string const &dir, unsigned int n)
+{
+    return build_bucket_filename(dir, "ways", n);
+}
+
+inline std::string state_node_ways_filename(std::string const &dir,
+                                            unsigned int n)
+{
+    return build_bucket_filename(dir, "node_ways", n);
+}
+
+inline void create_state_directory(std::string const &dir)
+{
+    if (::mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+        throw std::system_error{errno, std::system_category(),
+                                std::string{"Can't create directory '"} + dir +
+                                    "'"};
+    }
+}
+
+inline void rename_file(std::string const &from, std::string const &to)
+{
+    if (std::rename(from.c_str(), to.c_str()) != 0) {
+        throw std::system_error{errno, std::system_category(),
+                                std::string{"Can't rename file '"} + from +
+                                    "'"};
+    }
+}
+
+/**
+ * Map the file read-only into memory and call func with a pointer to the
+ * data and the size in bytes. Missing and empty files are treated the
+ * same.
+ */
+template <typename TFunc>
+void with_mapped_file(std::string const &filename, TFunc &&func)
+{
+    int const fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC); // NOLINT
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            func(static_cast<unsigned char *>(nullptr), std::size_t{0});
+            return;
+        }
+        throw std::system_error{errno, std::system_category(),
+                                std::string{"Can't open file '"} + filename +
+                                    "'"};
+    }
+
+    auto const file_size = osmium::util::file_size(fd);
+    if (file_size == 0) {
+        ::close(fd);
+        func(static_cast<unsigned char *>(nullptr), std::size_t{0});
+        return;
+    }
+
+    osmium::util::MemoryMapping mapping{
+        file_size, osmium::util::MemoryMapping::mapping_mode::readonly, fd};
+    ::close(fd);
+    func(mapping.get_addr<unsigned char>(), file_size);
+}
+
+template <typename T>
+std::vector<T> read_records(std::string const &filename)
+{
+    std::vector<T> records;
+    with_mapped_file(filename, [&](unsigned char const *data,
+                                   std::size_t size) {
+        records.resize(size / sizeof(T));
+        if (!records.empty()) {
+            std::memcpy(records.data(), data, records.size() * sizeof(T));
+        }
+    });
+    return records;
+}
+
+template <typename T>
+void write_records(std::string const &filename, std::vector<T> const &records)
+{
+    {
+        Bucket<T> bucket{filename + ".new"};
+        bucket.append(records.data(), records.size());
+        bucket.flush();
+    }
+    rename_file(filename + ".new", filename);
+}
+
+inline state_header read_state_header(std::string const &dir)
+{
+    auto const headers = read_records<state_header>(dir + "/header.dat");
+    state_header const expected;
+    if (headers.size() != 1 || headers[0].magic != expected.magic) {
+        throw std::runtime_error{"No valid state found in '" + dir + "'"};
+    }
+    if (headers[0].version != state_format_version) {
+        throw std::runtime_error{"State in '" + dir +
+                                 "' has an unsupported version"};
+    }
+    return headers[0];
+}
+
+inline void write_state_header(std::string const &dir,
+                               state_header const &header)
+{
+    write_records(dir + "/header.dat", std::vector<state_header>{header});
+}
+
+inline std::vector<way_state> read_state_problems(std::string const &dir)
+{
+    return read_records<way_state>(dir + "/problems.dat");
+}
+
+inline void write_state_problems(std::string const &dir,
+                                 std::vector<way_state> const &problems)
+{
+    write_records(dir + "/problems.dat", problems);
+}
+
+/**
+ * Call func with the ids from the sorted vector grouped by bucket. The ids
+ * for each bucket are sorted.
+ */
+template <typename T, typename TId, typename TFunc>
+void for_each_state_bucket(std::vector<T> const &values, TId &&get_id,
+                           TFunc &&func)
+{
+    std::vector<std::vector<T>> buckets(num_state_buckets);
+    for (auto const &value : values) {
+        buckets[state_bucket_of(get_id(value))].push_back(value);
+    }
+    for (unsigned int n = 0; n < num_state_buckets; ++n) {
+        if (!buckets[n].empty()) {
+            func(n, buckets[n]);
+        }
+    }
+}
+
+/**
+ * Writes the state while all ways are read in a full run.
+ */
+class StateWriter
+{
+
+    std::string m_dir;
+
+    std::vector<Bucket<unsigned char>> m_way_buckets;
+
+    std::vector<Bucket<node_way>> m_node_way_buckets;
+
+    std::vector<way_state> m_problems;
+
+    osmium::object_id_type m_last_way_id = 0;
+
+    uint64_t m_way_nodes = 0;
+
+public:
+    explicit StateWriter(std::string dir) : m_dir(std::move(dir))
+    {
+        create_state_directory(m_dir);
+
+        m_way_buckets.reserve(num_state_buckets);
+        m_node_way_buckets.reserve(num_state_buckets);
+        for (unsigned int n = 0; n < num_state_buckets; ++n) {
+            m_way_buckets.emplace_back(state_ways_filename(m_dir, n) + ".new");
+            m_node_way_buckets.emplace_back(
+                state_node_ways_filename(m_dir, n) + ".new");
+        }
+    }
+
+    void add_way(osmium::Way const &way)
+    {
+        if (way.id() <= m_last_way_id) {
+            throw std::runtime_error{
+                "Input file must be sorted by id to write the state"};
+        }
+        m_last_way_id = way.id();
+
+        m_way_buckets[state_bucket_of(way.id())].append(way.data(),
+                                                        way.padded_size());
+        for (auto const &node_ref : way.nodes()) {
+            m_node_way_buckets[state_bucket_of(node_ref.ref())].set(
+                {node_ref.ref(), way.id()});
+        }
+        m_way_nodes += way.nodes().size();
+    }
+
+    void add_buffer(osmium::memory::Buffer const &buffer)
+    {
+        for (auto const &way : buffer.select<osmium::Way>()) {
+            add_way(way);
+        }
+    }
+
+    void add_problem(way_state const &problem)
+    {
+        m_problems.push_back(problem);
+    }
+
+    void close(uint32_t checks, uint32_t last_timestamp)
+    {
+        for (auto &bucket : m_way_buckets) {
+            bucket.flush();
+        }
+        for (auto &bucket : m_node_way_buckets) {
+            bucket.flush();
+        }
+        m_way_buckets.clear();
+        m_node_way_buckets.clear();
+
+        for (unsigned int n = 0; n < num_state_buckets; ++n) {
+            auto const filename = state_node_ways_filename(m_dir, n);
+            auto records = read_records<node_way>(filename + ".new");
+            std::sort(records.begin(), records.end());
+            write_records(filename, records);
+            ::unlink((filename + ".new").c_str());
+
+            rename_file(state_ways_filename(m_dir, n) + ".new",
+                        state_ways_filename(m_dir, n));
+        }
+
+        std::sort(m_problems.begin(), m_problems.end());
+        write_state_problems(m_dir, m_problems);
+
+        state_header header;
+        header.checks = checks;
+        header.way_nodes = m_way_nodes;
+        header.last_timestamp = last_timestamp;
+        write_state_header(m_dir, header);
+    }
+
+}; // class StateWriter
+
+/**
+ * Return the (sorted and unique) ids of all ways referencing any of the
+ * nodes with the sorted ids.
+ */
+inline std::vector<osmium::object_id_type>
+find_state_ways_for_nodes(std::string const &dir,
+                          std::vector<osmium::object_id_type> const &node_ids)
+{
+    std::vector<osmium::object_id_type> way_ids;
+
+    for_each_state_bucket(
+        node_ids, [](osmium::object_id_type id) { return id; },
+        [&](unsigned int n, std::vector<osmium::object_id_type> const &ids) {
+            with_mapped_file(
+                state_node_ways_filename(dir, n),
+                [&](unsigned char const *data, std::size_t size) {
+                    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+                    auto const *begin =
+                        reinterpret_cast<node_way const *>(data);
+                    auto const *end = begin + size / sizeof(node_way);
+                    for (auto const id : ids) {
+                        auto const range = std::equal_range(
+                            begin, end, node_way{id, 0},
+                            [](node_way const &a, node_way const &b) {
+                                return a.node_id < b.node_id;
+                            });
+                        for (auto const *it = range.first; it != range.second;
+                             ++it) {
+                            way_ids.push_back(it->way_id);
+                        }
+                    }
+                });
+        });
+
+    std::sort(way_ids.begin(), way_ids.end());
+    way_ids.erase(std::unique(way_ids.begin(), way_ids.end()), way_ids.end());
+
+    return way_ids;
+}
+
+/**
+ * Call func for all ways from the state with one of the sorted ids.
+ */
+template <typename TFunc>
+void read_state_ways(std::string const &dir,
+                     std::vector<osmium::object_id_type> const &way_ids,
+                     TFunc &&func)
+{
+    for_each_state_bucket(
+        way_ids, [](osmium::object_id_type id) { return id; },
+        [&](unsigned int n, std::vector<osmium::object_id_type> const &ids) {
+            auto const filename = state_ways_filename(dir, n);
+            with_mapped_file(filename, [&](unsigned char *data,
+                                           std::size_t size) {
+                if (size == 0) {
+                    return;
+                }
+                osmium::memory::Buffer buffer{data, size};
+                auto it = ids.cbegin();
+                for (auto const &way : buffer.select<osmium::Way>()) {
+                    while (it != ids.cend() && *it < way.id()) {
+                        ++it;
+                    }
+                    if (it == ids.cend()) {
+                        break;
+                    }
+                    if (*it == way.id()) {
+                        func(way);
+                    }
+                }
+            });
+        });
+}
+
+/**
+ * Replace the ways with the sorted ids in the state by the ways in the
+ * buffer (which must be sorted by id). Ways with ids not in the buffer are
+ * removed.
+ */
+inline void
+update_state_ways(std::string const &dir,
+                  std::vector<osmium::object_id_type> const &way_ids,
+                  osmium::memory::Buffer &new_ways)
+{
+    std::vector<std::vector<osmium::Way const *>> new_by_bucket(
+        num_state_buckets);
+    for (auto const &way : new_ways.select<osmium::Way>()) {
+        new_by_bucket[state_bucket_of(way.id())].push_back(&way);
+    }
+
+    for_each_state_bucket(
+        way_ids, [](osmium::object_id_type id) { return id; },
+        [&](unsigned int n, std::vector<osmium::object_id_type> const &ids) {
+            auto const filename = state_ways_filename(dir, n);
+            {
+                Bucket<unsigned char> out{filename + ".new"};
+                auto const &ways = new_by_bucket[n];
+                auto it = ways.cbegin();
+                auto const add_new_ways_before =
+                    [&](osmium::object_id_type id) {
+                        for (; it != ways.cend() && (*it)->id() < id; ++it) {
+                            out.append((*it)->data(), (*it)->padded_size());
+                        }
+                    };
+
+                with_mapped_file(filename, [&](unsigned char *data,
+                                               std::size_t size) {
+                    if (size == 0) {
+                        return;
+                    }
+                    osmium::memory::Buffer buffer{data, size};
+                    for (auto const &way : buffer.select<osmium::Way>()) {
+                        add_new_ways_before(way.id());
+                        if (!std::binary_search(ids.cbegin(), ids.cend(),
+                                                way.id())) {
+                            out.append(way.data(), way.padded_size());
+                        }
+                    }
+                });
+                add_new_ways_before(
+                    std::numeric_limits<osmium::object_id_type>::max());
+                out.flush();
+            }
+            rename_file(filename + ".new", filename);
+        });
+}
+
+/**
+ * Update the node to way lookup: Remove all records in removed and add all
+ * records in added. Both must be sorted.
+ */
+inline void update_state_node_ways(std::string const &dir,
+                                   std::vector<node_way> const &removed,
+                                   std::vector<node_way> const &added)
+{
+    std::vector<std::vector<node_way>> removed_by_bucket(num_state_buckets);
+    std::vector<std::vector<node_way>> added_by_bucket(num_state_buckets);
+    for (auto const &r : removed) {
+        removed_by_bucket[state_bucket_of(r.node_id)].push_back(r);
+    }
+    for (auto const &r : added) {
+        added_by_bucket[state_bucket_of(r.node_id)].push_back(r);
+    }
+
+    for (unsigned int n = 0; n < num_state_buckets; ++n) {
+        if (removed_by_bucket[n].empty() && added_by_bucket[n].empty()) {
+            continue;
+        }
+
+        auto const filename = state_node_ways_filename(dir, n);
+        std::vector<node_way> records;
+        with_mapped_file(filename, [&](unsigned char const *data,
+                                       std::size_t size) {
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+            auto const *begin = reinterpret_cast<node_way const *>(data);
+            auto const *end = begin + size / sizeof(node_way);
+            std::vector<node_way> kept;
+            kept.reserve(static_cast<std::size_t>(end - begin));
+            std::set_difference(begin, end, removed_by_bucket[n].cbegin(),
+                                removed_by_bucket[n].cend(),
+                                std::back_inserter(kept));
+            records.reserve(kept.size() + added_by_bucket[n].size());
+            std::merge(kept.cbegin(), kept.cend(), added_by_bucket[n].cbegin(),
+                       added_by_bucket[n].cend(),
+                       std::back_inserter(records));
+        });
+        write_records(filename, records);
+    }
+}
+
+#endif // OSMIUM_SURPLUS_WAY_PROBLEMS_STATE_HPP
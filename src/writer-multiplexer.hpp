@@ -0,0 +1,291 @@
+#ifndef OSMIUM_SURPLUS_WRITER_MULTIPLEXER_HPP
+#define OSMIUM_SURPLUS_WRITER_MULTIPLEXER_HPP
+
+#include "bucket.hpp"
+
+#include <osmium/io/file.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/io/writer.hpp>
+#include <osmium/memory/item.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/thread/pool.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Writes OSM objects into many output files without needing a Writer (with
+ * its own thread and buffers) and a file descriptor for each of them.
+ *
+ * The first max_writers outputs getting any data are written directly
+ * through their own Writer. Objects for all other outputs are collected in
+ * a small buffer per output which is appended to a temporary spill file
+ * whenever it is full. Only max_open_files of those spill files are kept
+ * open, the least recently used one is closed when another one is needed.
+ * In close() the spilled objects are written out, one output after the
+ * other. All Writers share the same thread pool for encoding.
+ *
+ * Output files are written in close() even if they didn't get any data.
+ * If close() is not called, the spilled data is lost.
+ */
+class WriterMultiplexer
+{
+
+public:
+    constexpr static std::size_t const default_max_writers = 8;
+    constexpr static std::size_t const default_max_open_files = 64;
+    constexpr static std::size_t const default_buffer_size = 64UL * 1024UL;
+
+private:
+    struct output_type
+    {
+        osmium::io::File file;
+        std::string spill_filename;
+        std::unique_ptr<osmium::io::Writer> writer;
+
+        // objects not yet in the spill file
+        std::vector<char> buffer;
+
+        // number of bytes in the spill file
+        std::size_t spilled = 0;
+
+        // for finding the least recently used spill file
+        uint64_t last_use = 0;
+
+        int fd = -1;
+
+        explicit output_type(osmium::io::File &&f)
+        : file(std::move(f)), spill_filename(file.filename() + ".spill")
+        {}
+
+    }; // struct output_type
+
+    osmium::io::Header m_header;
+    osmium::thread::Pool &m_pool;
+
+    std::vector<output_type> m_outputs;
+
+    // indexes of the outputs with an open spill file
+    std::vector<std::size_t> m_open_files;
+
+    std::size_t m_max_writers;
+    std::size_t m_max_open_files;
+    std::size_t m_buffer_size;
+
+    std::size_t m_num_writers = 0;
+    uint64_t m_use_counter = 0;
+
+    bool m_closed = false;
+
+    std::unique_ptr<osmium::io::Writer>
+    create_writer(osmium::io::File const &file)
+    {
+        return std::make_unique<osmium::io::Writer>(
+            file, m_header, osmium::io::overwrite::allow, m_pool);
+    }
+
+    void close_spill_file(std::size_t n) noexcept
+    {
+        auto &output = m_outputs[n];
+        if (output.fd < 0) {
+            return;
+        }
+        ::close(output.fd);
+        output.fd = -1;
+        m_open_files.erase(
+            std::find(m_open_files.begin(), m_open_files.end(), n));
+    }
+
+    int spill_file(std::size_t n)
+    {
+        auto &output = m_outputs[n];
+        output.last_use = ++m_use_counter;
+        if (output.fd >= 0) {
+            return output.fd;
+        }
+
+        if (m_open_files.size() >= m_max_open_files) {
+            auto const lru = std::min_element(
+                m_open_files.cbegin(), m_open_files.cend(),
+                [&](std::size_t a, std::size_t b) {
+                    return m_outputs[a].last_use < m_outputs[b].last_use;
+                });
+            close_spill_file(*lru);
+        }
+
+        // NOLINTNEXTLINE(hicpp-signed-bitwise)
+        int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        if (output.spilled == 0) {
+            flags |= O_TRUNC; // NOLINT(hicpp-signed-bitwise)
+        }
+        output.fd = ::open(output.spill_filename.c_str(), flags, 0666);
+        if (output.fd < 0) {
+            throw std::system_error{errno, std::system_category(),
+                                    std::string{"Can't open file '"} +
+                                        output.spill_filename + "'"};
+        }
+        m_open_files.push_back(n);
+
+        return output.fd;
+    }
+
+    void spill(std::size_t n)
+    {
+        auto &output = m_outputs[n];
+        auto const fd = spill_file(n);
+        write_to_bucket_file(fd, output.buffer.data(), output.buffer.size(),
+                             output.spill_filename);
+        output.spilled += output.buffer.size();
+        output.buffer.clear();
+    }
+
+    // The items are always padded to the alignment needed, so they can be
+    // used directly from the buffer or the mapped spill file.
+    static void write_items(osmium::io::Writer &writer, char const *data,
+                            std::size_t size)
+    {
+        auto const *const end = data + size;
+        while (data != end) {
+            auto const &item =
+                *reinterpret_cast<osmium::memory::Item const *>(data);
+            writer(item);
+            data += item.padded_size();
+        }
+    }
+
+    void write_spilled(std::size_t n)
+    {
+        auto &output = m_outputs[n];
+        output.writer = create_writer(output.file);
+
+        if (output.spilled > 0) {
+            close_spill_file(n);
+            int const fd =
+                ::open(output.spill_filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                throw std::system_error{errno, std::system_category(),
+                                        std::string{"Can't open file '"} +
+                                            output.spill_filename + "'"};
+            }
+            {
+                osmium::util::MemoryMapping const mapping{
+                    output.spilled,
+                    osmium::util::MemoryMapping::mapping_mode::readonly, fd};
+                write_items(*output.writer, mapping.get_addr<char>(),
+                            output.spilled);
+            }
+            ::close(fd);
+            ::unlink(output.spill_filename.c_str());
+            output.spilled = 0;
+        }
+
+        write_items(*output.writer, output.buffer.data(),
+                    output.buffer.size());
+        output.buffer.clear();
+        output.buffer.shrink_to_fit();
+    }
+
+public:
+    explicit WriterMultiplexer(
+        osmium::io::Header header = {},
+        std::size_t max_writers = default_max_writers,
+        std::size_t max_open_files = default_max_open_files,
+        osmium::thread::Pool &pool = osmium::thread::Pool::default_instance())
+    : m_header(std::move(header)), m_pool(pool), m_max_writers(max_writers),
+      m_max_open_files(std::max(max_open_files, std::size_t{1})),
+      m_buffer_size(default_buffer_size)
+    {}
+
+    WriterMultiplexer(WriterMultiplexer const &) = delete;
+    WriterMultiplexer &operator=(WriterMultiplexer const &) = delete;
+
+    WriterMultiplexer(WriterMultiplexer &&) = delete;
+    WriterMultiplexer &operator=(WriterMultiplexer &&) = delete;
+
+    ~WriterMultiplexer()
+    {
+        for (auto &output : m_outputs) {
+            if (output.fd >= 0) {
+                ::close(output.fd);
+            }
+            if (output.spilled > 0) {
+                ::unlink(output.spill_filename.c_str());
+            }
+        }
+    }
+
+    /**
+     * Add an output. Returns the index of the output which is used to
+     * write to it. The file is not opened until data is written to it or
+     * close() is called.
+     */
+    std::size_t add_output(osmium::io::File file)
+    {
+        m_outputs.emplace_back(std::move(file));
+        return m_outputs.size() - 1;
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept { return m_outputs.size(); }
+
+    /// Write a copy of the object to output n.
+    void operator()(std::size_t n, osmium::OSMObject const &object)
+    {
+        auto &output = m_outputs[n];
+
+        if (output.writer) {
+            (*output.writer)(object);
+            return;
+        }
+
+        if (output.spilled == 0 && output.buffer.empty() &&
+            m_num_writers < m_max_writers) {
+            output.writer = create_writer(output.file);
+            ++m_num_writers;
+            (*output.writer)(object);
+            return;
+        }
+
+        auto const size = object.padded_size();
+        if (!output.buffer.empty() &&
+            output.buffer.size() + size > m_buffer_size) {
+            spill(n);
+        }
+        auto const *data = reinterpret_cast<char const *>(&object);
+        output.buffer.insert(output.buffer.end(), data, data + size);
+    }
+
+    /**
+     * Write out everything and close all output files. Outputs which have
+     * not been written to yet are written out now.
+     */
+    void close()
+    {
+        if (m_closed) {
+            return;
+        }
+        m_closed = true;
+
+        for (std::size_t n = 0; n < m_outputs.size(); ++n) {
+            auto &output = m_outputs[n];
+            if (!output.writer) {
+                write_spilled(n);
+            }
+            output.writer->close();
+            output.writer.reset();
+        }
+        m_num_writers = 0;
+    }
+
+}; // class WriterMultiplexer
+
+#endif // OSMIUM_SURPLUS_WRITER_MULTIPLEXER_HPP
@@ -0,0 +1,59 @@
+#!/bin/bash
+#-----------------------------------------------------------------------------
+#
+#  test/osp-stats-basic-update.sh SOURCE_DIR
+#
+#  Checks that updating stats with a change file gives the same results
+#  as a full run on the new data for all stats that can be updated
+#  exactly.
+#
+#-----------------------------------------------------------------------------
+
+set -euo pipefail
+
+SRCDIR="$1"
+DATADIR="$SRCDIR/test/osp-stats-basic-update"
+
+mkdir -p osp-stats-basic-update
+cd osp-stats-basic-update
+rm -f old.db updated.db new.db refused.db
+
+COLUMNS="objects, nodes, ways, relations, max_node_id, max_way_id,
+         max_relation_id, sum_version, sum_node_version, sum_way_version,
+         sum_relation_version, max_version, max_node_version,
+         max_way_version, max_relation_version"
+
+latest_stats() {
+    sqlite3 "$1" "SELECT $COLUMNS FROM stats ORDER BY ts DESC LIMIT 1"
+}
+
+latest_versions() {
+    sqlite3 "$1" "SELECT object_type, version, num FROM hist_versions
+                  WHERE ts = (SELECT max(ts) FROM stats) AND num > 0
+                  ORDER BY object_type, version"
+}
+
+../../src/osp-stats-basic -q -o old.db "$DATADIR/old.opl"
+../../src/osp-stats-basic -q -o new.db "$DATADIR/new.opl"
+../../src/osp-stats-basic -q -s old.db --max-unresolved=100 \
+    -o updated.db "$DATADIR/changes.osc"
+
+diff -u <(latest_stats new.db) <(latest_stats updated.db)
+diff -u <(latest_versions new.db) <(latest_versions updated.db)
+
+# The old snapshot is still there.
+test "$(sqlite3 updated.db 'SELECT count(*) FROM stats')" = 2
+
+# Modified n2 and w10, deleted n3 and r20.
+test "$(sqlite3 updated.db \
+    "SELECT value FROM state WHERE key = 'unresolved_changes'")" = 4
+
+# With the default limit of 1% the update must fail and leave no output.
+if ../../src/osp-stats-basic -q -s old.db -o refused.db \
+    "$DATADIR/changes.osc"; then
+    echo "update with too many unresolved changes did not fail"
+    exit 1
+fi
+test ! -e refused.db
+
+#-----------------------------------------------------------------------------